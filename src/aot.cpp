@@ -0,0 +1,64 @@
+#include "aot.hpp"
+#include "reader.hpp"
+
+#include <iostream>
+
+namespace {
+    using namespace mal;
+
+    MalValue ReadForms(Interpreter& interp, const char* source) {
+        return ReadForm(std::string{"("} + source + ")", &interp.str_interner);
+    }
+}
+
+namespace mal {
+namespace aot {
+    std::uintptr_t StackGuard::base = 0;
+
+    MalValue Constant(Interpreter& interp, const char* printed) {
+        return ReadForm(printed, &interp.str_interner);
+    }
+
+    const Builtin* FindBuiltin(Interpreter& interp, const char* name) {
+        const MalValue& val = interp.env_global->cell(name)->get();
+        if (val.tag != Builtin_T)
+            throw mal_error{std::string{"Missing builtin "} + name};
+        return val.blt;
+    }
+
+    int Run(const Program& program, int argc, char** argv) {
+        // ! Assuming stdout is actually a TTY
+        TTYPrinter printer{std::cout};
+        Interpreter interp{printer};
+        StackGuard::base = reinterpret_cast<std::uintptr_t>(__builtin_frame_address(0));
+        try {
+            program.init(interp);
+            // Without a script name in *ARGV*, bootstrap.mal only defines its functions
+            interp.env_global->set("*ARGV*", mh::list(MalList::Make(mh::string(argv[0]))));
+            MalValue bootstrap = ReadForms(interp, program.bootstrap);
+            for (ListIterator it = bootstrap.li; it; ++it)
+                interp.EvaluateExpression(*it, interp.env_global);
+
+            ListBuilder arg_lb;
+            arg_lb.push(mh::string(program.script_name));
+            for (int i = 1; i < argc; ++i)
+                arg_lb.push(mh::string(argv[i]));
+            interp.env_global->set("*ARGV*", mh::list(arg_lb.release()));
+            MalValue script = ReadForms(interp, program.script);
+            auto def = program.definitions.begin();
+            std::size_t index = 0;
+            for (ListIterator it = script.li; it; ++it, ++index) {
+                if (def != program.definitions.end() && def->form == index) {
+                    interp.env_global->set(def->function->name, mh::builtin(def->function));
+                    ++def;
+                } else
+                    interp.EvaluateExpression(*it, interp.env_global);
+            }
+        } catch (const mal_error& err) {
+            printer << print_begin << "Script Mal Error: " << err.msg << print_end;
+            return 1;
+        }
+        return 0;
+    }
+}
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+#include "interpreter.hpp"
+#include "bytecode.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace mal {
+    // Ahead-of-time compilation of scripts to C++ (see: emitter.cpp)
+    //
+    // Top-level definitions of functions `(def name (fn (params...) body))` are translated to C++
+    // functions, after the expansion of the macro calls in their bodies. The emitted program embeds
+    // bootstrap.mal and the script: it evaluates them like `mal_repl script` would, except that the
+    // compiled definitions bind the name to a builtin running the C++ function
+    //
+    // Compiled functions call each other and fixed arity builtins through their direct entries,
+    // guarded by a check of the global binding, so redefinitions of the names are still observed.
+    // Macros are expanded once, at compile time
+
+    // Writes a C++ program running the script `script_name` with the source `script`
+    // Function and macro definitions of the script are evaluated in `interp` to expand the macros
+    void EmitProgram(Interpreter& interp, const std::string& bootstrap, const std::string& script_name, const std::string& script, std::ostream& out);
+
+    // Runtime of the emitted programs (see: aot.cpp)
+    namespace aot {
+        // ! WARNING: Platform specific
+        // Compiled functions recurse on the native stack, which is assumed to hold at least MAX_STACK bytes
+        static constexpr std::size_t MAX_STACK = 4 << 20;
+
+        // A definition replaced by a compiled function
+        struct Definition {
+            std::size_t form; // Index of the top-level form of the script
+            const Builtin* function;
+        };
+
+        struct Program {
+            const char* bootstrap;
+            const char* script_name;
+            const char* script;
+            std::vector<Definition> definitions;
+            void (*init)(Interpreter&); // Resolves the constants and global cells used by the compiled functions
+        };
+
+        // Runs the program, `argv` are passed to the script in *ARGV*
+        int Run(const Program& program, int argc, char** argv);
+
+        // Reads a constant printed by the emitter
+        MalValue Constant(Interpreter& interp, const char* printed);
+
+        // Returns the builtin defined as `name` by the interpreter
+        const Builtin* FindBuiltin(Interpreter& interp, const char* name);
+
+        // Checks the stack usage on the entry to a compiled function
+        struct StackGuard {
+            static std::uintptr_t base; // Stack address at the start of the program (see: Run)
+
+            StackGuard() {
+                auto top = reinterpret_cast<std::uintptr_t>(__builtin_frame_address(0));
+                if (base - top > MAX_STACK)
+                    throw mal_error{"Stack limit reached"};
+            }
+        };
+
+        inline bool IsTrue(const MalValue& v) {
+            return v.tag != Nil_T && v.tag != False_T;
+        }
+
+        template <typename... A>
+        MalArgs Args(A&&... values) {
+            MalArgs args;
+            args.reserve(sizeof...(A));
+            (args.push_back(MalValue{std::forward<A>(values)}), ...);
+            return args;
+        }
+
+        inline MalValue Call(Interpreter& interp, const MalValue& callee, MalArgs&& args) {
+            if (!mh::is_invokable(callee))
+                throw mal_error{"Cannot call non-function"};
+            if (callee.tag == Function_T && callee.fun->kind == MalFunction::KMacro)
+                throw mal_error{"Cannot call a macro defined after compilation"};
+            return interp.InvokeFunction(callee, std::move(args));
+        }
+
+        inline bool Holds(const GlobalCell& cell, const Builtin& expected) {
+            const MalValue& callee = cell.get();
+            return callee.tag == Builtin_T && callee.blt == &expected;
+        }
+
+        // Calls `expected` through its direct entry, if the global binding `cell` still holds it
+        inline MalValue Direct(Interpreter& interp, const GlobalCell& cell, const Builtin& expected, MalValue* args, std::size_t argc) {
+            if (Holds(cell, expected))
+                return expected.direct(interp, args);
+            const MalValue& callee = cell.get();
+            MalArgs call_args;
+            call_args.reserve(argc);
+            for (std::size_t i = 0; i < argc; ++i)
+                call_args.push_back(std::move(args[i]));
+            return Call(interp, callee, std::move(call_args));
+        }
+
+        // Applies an arithmetic builtin inline, if the global binding `cell` still holds it and the operands are integers
+        template <IntOp op>
+        MalValue Int(Interpreter& interp, const GlobalCell& cell, const Builtin& expected, const MalValue& a, const MalValue& b) {
+            const MalValue& callee = cell.get();
+            if (callee.tag == Builtin_T && callee.blt == &expected && a.tag == Int_T && b.tag == Int_T) {
+                MalValue ret = IntOperation(op, a.no, b.no);
+                if (ret.tag != Nil_T)
+                    return ret;
+            }
+            return Call(interp, callee, Args(a, b));
+        }
+
+        // Generic entry of a compiled function
+        inline MalValue Generic(Interpreter& interp, const Builtin& function, MalArgs&& args) {
+            if (args.size() != function.arity)
+                throw mal_error{"Arguments count doesn't match function's parameter count"};
+            return function.direct(interp, args.begin());
+        }
+
+        inline MalValue Vector(MalArgs&& elements) {
+            VectorBuilder vb;
+            for (MalValue& v : elements)
+                vb.push(std::move(v));
+            return mh::vector(vb.release());
+        }
+    }
+}
@@ -0,0 +1,140 @@
+#pragma once
+
+#include "malvalue.hpp"
+#include "malstring.hpp"
+#include "invoke.hpp"
+
+#include <cstdint>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+namespace mal {
+    class Interpreter;
+
+    // Typed registration of builtin functions
+    //
+    // A builtin is a plain function of the interpreter and its parameters:
+    //   MalValue Mod(Interpreter&, Number a, Number b); // Fixed arity, the arguments are converted to the parameter types
+    //   MalValue List(Interpreter&, MalArgs&& args);    // Any number of arguments
+    // Arity and type checks of fixed arity builtins are generated (see: BuiltinParam). They also get a direct
+    // entry point, which callers holding the arguments in an array use to skip MalArgs and the arity check.
+    // A variadic builtin can name a fixed arity function serving its most common arity: DefineBuiltin<Add, Add2>(env, "+")
+
+    [[noreturn]] inline void ArgumentError(const char* name, std::size_t index, const char* expected) {
+        throw mal_error{std::string{name} + ": argument " + std::to_string(index + 1) + " must be " + expected};
+    }
+
+    // Conversion of an argument to a parameter type
+    template <typename T>
+    struct BuiltinParam;
+
+    template <>
+    struct BuiltinParam<const MalValue&> {
+        static const MalValue& Get(MalValue& arg, const Builtin&, std::size_t) {
+            return arg;
+        }
+    };
+
+    template <>
+    struct BuiltinParam<MalValue&&> {
+        static MalValue&& Get(MalValue& arg, const Builtin&, std::size_t) {
+            return std::move(arg);
+        }
+    };
+
+    template <>
+    struct BuiltinParam<std::int64_t> {
+        static std::int64_t Get(MalValue& arg, const Builtin& info, std::size_t index) {
+            if (arg.tag != Int_T)
+                ArgumentError(info.name, index, arg.tag == Bigint_T ? "a number in the 64-bit range" : "a number");
+            return arg.no;
+        }
+    };
+
+    // A number of any size, a fixnum or a bignum (see: malbigint.hpp)
+    struct Number {
+        const MalValue& value;
+    };
+
+    template <>
+    struct BuiltinParam<Number> {
+        static Number Get(MalValue& arg, const Builtin& info, std::size_t index) {
+            if (!mh::is_num(arg))
+                ArgumentError(info.name, index, "a number");
+            return Number{arg};
+        }
+    };
+
+    template <>
+    struct BuiltinParam<const MalString::string_t&> {
+        static const MalString::string_t& Get(MalValue& arg, const Builtin& info, std::size_t index) {
+            if (arg.tag != String_T)
+                ArgumentError(info.name, index, "a string");
+            return arg.st->Get();
+        }
+    };
+
+    // A string kept whole, for builtins that slice or join it without copying (see: MalString)
+    template <>
+    struct BuiltinParam<const Ref<MalString>&> {
+        static const Ref<MalString>& Get(MalValue& arg, const Builtin& info, std::size_t index) {
+            if (arg.tag != String_T)
+                ArgumentError(info.name, index, "a string");
+            return arg.st;
+        }
+    };
+
+    template <auto F, typename Sig = decltype(F)>
+    struct FixedBuiltin;
+
+    template <auto F, typename... P>
+    struct FixedBuiltin<F, MalValue (*)(Interpreter&, P...)> {
+        static constexpr std::size_t arity = sizeof...(P);
+
+        static Builtin& Info() {
+            static Builtin info{Generic, Direct, arity, ""};
+            return info;
+        }
+
+        static MalValue Direct(Interpreter& interp, MalValue* args) {
+            return Unpack(interp, args, std::index_sequence_for<P...>{});
+        }
+
+        static MalValue Generic(Interpreter& interp, MalArgs&& args) {
+            if (args.size() != arity)
+                throw mal_error{std::string{Info().name} + " takes " + std::to_string(arity) + " argument(s)"};
+            return Direct(interp, args.begin());
+        }
+
+    private:
+        template <std::size_t... I>
+        static MalValue Unpack([[maybe_unused]] Interpreter& interp, [[maybe_unused]] MalValue* args, std::index_sequence<I...>) {
+            return F(interp, BuiltinParam<P>::Get(args[I], Info(), I)...);
+        }
+    };
+
+    // Returns the entry points of a builtin, `D` is the direct entry of a variadic builtin `F`
+    template <auto F, auto D = nullptr>
+    const Builtin* MakeBuiltin(const char* name) {
+        if constexpr (std::is_same_v<decltype(F), Builtin::generic_t>) {
+            static Builtin info{F, nullptr, 0, name};
+            if constexpr (!std::is_same_v<decltype(D), std::nullptr_t>) {
+                FixedBuiltin<D>::Info().name = name;
+                info.direct = FixedBuiltin<D>::Direct;
+                info.arity = FixedBuiltin<D>::arity;
+            }
+            return &info;
+        } else {
+            static_assert(std::is_same_v<decltype(D), std::nullptr_t>, "Fixed arity builtins are their own direct entry");
+            Builtin& info = FixedBuiltin<F>::Info();
+            info.name = name;
+            return &info;
+        }
+    }
+
+    template <auto F, auto D = nullptr>
+    void DefineBuiltin(Environment& env, const char* name) {
+        env.set(name, mh::builtin(MakeBuiltin<F, D>(name)));
+    }
+}
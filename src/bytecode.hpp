@@ -0,0 +1,96 @@
+#pragma once
+
+#include "malvalue.hpp"
+#include "invoke.hpp"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace mal {
+    class Interpreter;
+
+    // Instructions of the bytecode VM (see: vm.cpp)
+    // Operands are stored as separate words following the opcode
+    enum class Op : std::uint32_t {
+        Const,       // [k]    push consts[k]
+        LoadName,    // [n]    push value bound to names[n] in the current environment
+        LoadLocal,   // [d s]  push value of slot s of the environment d levels above the current one
+        LoadGlobal,  // [c]    push value of cells[c]
+        Def,         // [n]    bind names[n] to the top of the stack (the value stays on the stack)
+        Pop,         //        drop the top of the stack
+        Jump,        // [t]    jump to t
+        JumpIfFalse, // [t]    pop, jump to t if the value is nil or false
+        MacroCheck,  // [k t]  if the top is a macro, pop it, expand consts[k] with it, evaluate the expansion, push the result and jump to t
+        Expanded,    // [k m t] pop; if it's the macro consts[m], run the inlined expansion of consts[k] that follows, otherwise evaluate consts[k], push the result and jump to t
+        CallInt,     // [k i]  if the callee below 2 integers is the builtin consts[k], apply IntOp i to them and skip the Call that follows
+        Call,        // [n]    call the function below n arguments
+        TailCall,    // [n]    same as Call, but replaces the current frame if the callee is compiled (always followed by Return)
+        Return,      //        return the top of the stack from the current frame
+        Closure,     // [p]    push a new function created from protos[p] over the current environment
+        EnterScope,  // [s]    open a new environment (let*) with slots named by scopes[s]
+        LeaveScope,  //        close the environment opened by EnterScope
+        Bind,        //        pop and bind to the next slot of the current environment
+        Rebind,      // [n m]  pop n values and rebind them to the m slots of the current environment (recur of a loop)
+        Times,       // [t]    jump to t if slot 0 of the current environment reached the count on the top of the stack (dotimes)
+        Step,        // [t]    rebind slot 0 of the current environment to its value plus one and jump to t
+        MakeVector,  // [n]    pop n values and push a vector of them
+        EvalTree,    // [k]    evaluate consts[k] with the tree-walking evaluator
+    };
+
+    // Integer operations of the builtins specialized by Op::CallInt
+    enum class IntOp : std::uint32_t {
+        Add, Sub, Mul, Div, Mod, Lt, Le, Gt, Ge, Eq,
+    };
+
+    // Finds the operation of the builtin defined as `name`, builtins are identified by that name rather than by their bindings
+    bool LookupIntOp(const std::string& name, IntOp& op);
+
+    // Computes an operation of Op::CallInt (or of compiled scripts), returns nil if the builtin has to handle it
+    // (division by zero, or a result out of the fixnum range)
+    inline MalValue IntOperation(IntOp op, std::int64_t a, std::int64_t b) {
+        std::int64_t r;
+        switch (op) {
+            case IntOp::Add: return FixnumAdd(a, b, r) ? mh::num(r) : mh::nil;
+            case IntOp::Sub: return FixnumSub(a, b, r) ? mh::num(r) : mh::nil;
+            case IntOp::Mul: return FixnumMul(a, b, r) ? mh::num(r) : mh::nil;
+            case IntOp::Div: return FixnumDiv(a, b, r) ? mh::num(r) : mh::nil;
+            case IntOp::Mod: return FixnumMod(a, b, r) ? mh::num(r) : mh::nil;
+            case IntOp::Lt: return mh::bool_val(a < b);
+            case IntOp::Le: return mh::bool_val(a <= b);
+            case IntOp::Gt: return mh::bool_val(a > b);
+            case IntOp::Ge: return mh::bool_val(a >= b);
+            case IntOp::Eq: return mh::bool_val(a == b);
+        }
+        return mh::nil;
+    }
+
+    struct Prototype;
+
+    // A compiled function body
+    struct Code {
+        std::vector<std::uint32_t> ops;
+        std::vector<MalValue> consts;
+        std::vector<std::string> names;
+        std::vector<std::shared_ptr<GlobalCell>> cells;
+        std::shared_ptr<const SlotNames> params; // Slots of the call frame
+        std::vector<std::shared_ptr<const SlotNames>> scopes;
+        std::vector<std::shared_ptr<const Prototype>> protos;
+    };
+
+    // A nested `fn` or `macro` form, instantiated by Op::Closure
+    struct Prototype {
+        std::vector<MalString::string_t> params;
+        MalString::string_t param_var;
+        MalValue body;
+        MalFunction::FKind kind;
+        std::shared_ptr<const Code> code;
+    };
+
+    // Lowers the body of a function to bytecode (see: compiler.cpp)
+    std::shared_ptr<const Code> CompileFunction(Interpreter& interp, const MalFunction& func);
+
+    // Lowers the body of a loop or dotimes `form` to bytecode continuing the loop in `env`, its current environment
+    // Returns nullptr if a recur in the body can't be compiled
+    std::shared_ptr<const Code> CompileLoop(Interpreter& interp, const MalValue& form, const EnvironFrame& env);
+}
@@ -0,0 +1,293 @@
+#include "collector.hpp"
+#include "malfunction.hpp"
+#include "malmap.hpp"
+
+#include <algorithm>
+#include <unordered_map>
+#include <utility>
+
+namespace {
+    using namespace mal;
+
+    enum class Kind {
+        Env,
+        Function,
+        Atom,
+        List,
+        Vector,
+        VectorNode,
+        Map,
+        MapNode,
+    };
+
+    // An object found by a collection
+    struct Node {
+        Kind kind;
+        void* object;
+        long refs; // References from outside of the tracked objects
+        bool reachable = false;
+    };
+
+    using Index = std::unordered_map<const void*, std::size_t>;
+
+    // Drops the freed objects of a registry
+    template <typename T>
+    void Prune(std::vector<Weak<T>>& registry) {
+        registry.erase(std::remove_if(registry.begin(), registry.end(), [](const Weak<T>& entry) {
+            return entry.expired();
+        }), registry.end());
+    }
+
+    // Locks the live objects of a registry, and drops the freed ones
+    template <typename T>
+    std::vector<Ref<T>> Lock(std::vector<Weak<T>>& registry) {
+        std::vector<Ref<T>> live;
+        live.reserve(registry.size());
+        for (const auto& entry : registry) {
+            if (auto object = entry.lock())
+                live.push_back(std::move(object));
+        }
+        registry.assign(live.begin(), live.end());
+        return live;
+    }
+
+    template <typename T>
+    void AddNodes(Kind kind, const std::vector<Ref<T>>& live, std::vector<Node>& nodes, Index& index) {
+        for (const auto& object : live) {
+            index.emplace(object.get(), nodes.size());
+            // Without the reference held by `live`
+            nodes.push_back(Node{kind, object.get(), object.use_count() - 1});
+        }
+    }
+}
+
+namespace mal {
+    // Calls `edge` with the index of every tracked object referenced by an object
+    // Untracked values are followed when they are referenced once, so all their references come from the scanned object
+    // A tracked object referenced from elsewhere keeps a positive count of outside references, and is never freed
+    template <typename F>
+    class CycleCollector::Scanner {
+        const Index& index;
+        F edge;
+        std::vector<std::pair<Kind, const void*>> pending;
+
+        template <typename T>
+        void Reference(Kind kind, const Ref<T>& ptr) {
+            if (!ptr)
+                return;
+            if (kind == Kind::Env || kind == Kind::Function || kind == Kind::Atom) {
+                auto entry = index.find(ptr.get());
+                if (entry != index.end()) {
+                    edge(entry->second);
+                    return;
+                }
+            }
+            if (ptr.use_count() == 1)
+                pending.emplace_back(kind, ptr.get());
+        }
+
+        void Value(const MalValue& v) {
+            switch (v.tag) {
+                case List_T:
+                    Reference(Kind::List, v.li);
+                    break;
+                case Vector_T:
+                    Reference(Kind::Vector, v.ve);
+                    break;
+                case Map_T:
+                    Reference(Kind::Map, v.mp);
+                    break;
+                case Function_T:
+                    Reference(Kind::Function, v.fun);
+                    break;
+                case Atom_T:
+                    Reference(Kind::Atom, v.at);
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        // Metadata is held by the side table on behalf of its object
+        void Meta(const MetaMark& mark) {
+            if (mark.IsSet())
+                Value(mark.Get());
+        }
+
+        void Expand(Kind kind, const void* object) {
+            switch (kind) {
+                case Kind::Env: {
+                    const auto& env = *static_cast<const Environment*>(object);
+                    for (const MalAtom& slot : env.slots)
+                        Value(slot.v);
+                    for (const auto& entry : env.data)
+                        Value(entry.second.v);
+                    Reference(Kind::Env, env.outer);
+                    break;
+                }
+                case Kind::Function: {
+                    const auto& fun = *static_cast<const MalFunction*>(object);
+                    Reference(Kind::Env, fun.env);
+                    Value(fun.body);
+                    Meta(fun.meta);
+                    break;
+                }
+                case Kind::Atom:
+                    Value(static_cast<const MalAtom*>(object)->v);
+                    break;
+                case Kind::List: {
+                    const auto& list = *static_cast<const MalList*>(object);
+                    Value(list.node);
+                    Reference(Kind::List, list.next);
+                    Meta(list.meta);
+                    break;
+                }
+                case Kind::Vector: {
+                    const auto& vector = *static_cast<const MalVector*>(object);
+                    Reference(Kind::VectorNode, vector.root);
+                    for (const MalAtom& v : vector.tail)
+                        Value(v.v);
+                    Reference(Kind::List, vector.list);
+                    Meta(vector.meta);
+                    break;
+                }
+                case Kind::VectorNode: {
+                    const auto& node = *static_cast<const mal::VectorNode*>(object);
+                    for (std::size_t i = 0; i < mal::VectorNode::WIDTH; ++i) {
+                        if (node.leaf)
+                            Value(node.values[i].v);
+                        else
+                            Reference(Kind::VectorNode, node.children[i]);
+                    }
+                    break;
+                }
+                case Kind::Map: {
+                    const auto& map = *static_cast<const MalMap*>(object);
+                    Reference(Kind::MapNode, map.root);
+                    Meta(map.meta);
+                    break;
+                }
+                case Kind::MapNode: {
+                    const auto& node = *static_cast<const mal::MapNode*>(object);
+                    for (const auto& entry : node.entries) {
+                        Value(entry.first);
+                        Value(entry.second.v);
+                    }
+                    for (const auto& child : node.nodes)
+                        Reference(Kind::MapNode, child);
+                    break;
+                }
+            }
+        }
+    public:
+        Scanner(const Index& index, F edge) : index{index}, edge{std::move(edge)} {}
+
+        void Scan(const Node& node) {
+            // Followed values are kept on `pending`, long lists would overflow the native stack
+            Expand(node.kind, node.object);
+            while (!pending.empty()) {
+                auto next = pending.back();
+                pending.pop_back();
+                Expand(next.first, next.second);
+            }
+        }
+    };
+
+    void CycleCollector::Allocated() {
+        if (++allocations < MIN_THRESHOLD)
+            return;
+        // Most objects are freed by their reference counts, only the survivors are collected
+        allocations = 0;
+        Prune(envs);
+        Prune(functions);
+        Prune(atoms);
+        if (envs.size() + functions.size() + atoms.size() >= threshold)
+            Collect();
+    }
+
+    void CycleCollector::Track(const Ref<MalFunction>& function) {
+        functions.emplace_back(function);
+        // Outer environments of a tracked one are already tracked
+        for (const EnvironFrame* env = &function->env; *env && !(*env)->tracked && !(*env)->global; env = &(*env)->outer) {
+            (*env)->tracked = true;
+            envs.emplace_back(*env);
+        }
+        Allocated();
+    }
+
+    void CycleCollector::Track(const Ref<MalAtom>& atom) {
+        atoms.emplace_back(atom);
+        Allocated();
+    }
+
+    // Trial deletion: references between the tracked objects are subtracted from their reference counts,
+    // objects left with outside references are reachable, as well as the objects referenced by reachable ones.
+    // The rest is referenced only by unreachable objects, they are released by clearing their references
+    std::size_t CycleCollector::Collect() {
+        auto live_envs = Lock(envs);
+        auto live_functions = Lock(functions);
+        auto live_atoms = Lock(atoms);
+
+        std::vector<Node> nodes;
+        nodes.reserve(live_envs.size() + live_functions.size() + live_atoms.size());
+        Index index;
+        index.reserve(nodes.capacity());
+        AddNodes(Kind::Env, live_envs, nodes, index);
+        AddNodes(Kind::Function, live_functions, nodes, index);
+        AddNodes(Kind::Atom, live_atoms, nodes, index);
+
+        auto subtract = [&nodes](std::size_t i) { --nodes[i].refs; };
+        Scanner<decltype(subtract)> internal{index, subtract};
+        for (const Node& node : nodes)
+            internal.Scan(node);
+
+        std::vector<std::size_t> work;
+        for (std::size_t i = 0; i < nodes.size(); ++i) {
+            if (nodes[i].refs > 0) {
+                nodes[i].reachable = true;
+                work.push_back(i);
+            }
+        }
+        auto mark = [&nodes, &work](std::size_t i) {
+            if (!nodes[i].reachable) {
+                nodes[i].reachable = true;
+                work.push_back(i);
+            }
+        };
+        Scanner<decltype(mark)> reachable{index, mark};
+        while (!work.empty()) {
+            std::size_t i = work.back();
+            work.pop_back();
+            reachable.Scan(nodes[i]);
+        }
+
+        // `live` keeps all the objects until the references are cleared
+        std::size_t freed = 0;
+        for (const Node& node : nodes) {
+            if (node.reachable)
+                continue;
+            ++freed;
+            switch (node.kind) {
+                case Kind::Env: {
+                    auto& env = *static_cast<Environment*>(node.object);
+                    env.slots.clear();
+                    env.data.clear();
+                    env.outer.reset();
+                    break;
+                }
+                case Kind::Function:
+                    static_cast<MalFunction*>(node.object)->env.reset();
+                    break;
+                case Kind::Atom:
+                    *static_cast<MalAtom*>(node.object) = MalValue{};
+                    break;
+                default:
+                    break;
+            }
+        }
+        collected += freed;
+        // Collections run when the tracked objects double, so their cost is proportional to the allocations
+        threshold = std::max(MIN_THRESHOLD, 2 * (nodes.size() - freed));
+        return freed;
+    }
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "malvalue.hpp"
+
+#include <cstddef>
+#include <vector>
+
+namespace mal {
+    // Reclaims reference cycles, which the reference counting can't free (see: collector.cpp)
+    //
+    // A cycle needs a value changed after its creation: a binding of an environment (a closure stored in
+    // the environment it captures) or an atom. The collector keeps weak references to the environments
+    // captured by closures, the closures and the atoms, and periodically looks for groups of them referenced
+    // only by each other. Other values are followed when they are referenced once
+    class CycleCollector {
+        std::vector<Weak<Environment>> envs;
+        std::vector<Weak<MalFunction>> functions;
+        std::vector<Weak<MalAtom>> atoms;
+        // Objects tracked since the freed ones were dropped from the registries
+        std::size_t allocations = 0;
+        // Tracked objects, which start the next collection
+        std::size_t threshold = MIN_THRESHOLD;
+
+        template <typename F>
+        class Scanner;
+        void Allocated();
+    public:
+        static constexpr std::size_t MIN_THRESHOLD = 4096;
+        // Objects freed by all the collections
+        std::size_t collected = 0;
+
+        // Tracks a closure and the environments it captured
+        void Track(const Ref<MalFunction>& function);
+        void Track(const Ref<MalAtom>& atom);
+        // Frees the unreachable cycles, returns the number of the tracked objects freed
+        std::size_t Collect();
+    };
+}
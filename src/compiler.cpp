@@ -0,0 +1,582 @@
+#include "bytecode.hpp"
+#include "interpreter.hpp"
+
+#include <algorithm>
+
+namespace {
+    using namespace mal;
+
+    constexpr std::size_t npos = static_cast<std::size_t>(-1);
+
+    // Returns true if `expr` contains a recur form
+    bool HasRecur(const MalValue& expr) {
+        if (!mh::is_fseq(expr))
+            return false;
+        if (expr.tag == List_T && mh::is_symbol(expr.li->First()) && expr.li->First().st->Form() == SpecialForm::Recur)
+            return true;
+        for (ListIterator it = mh::as_list(expr); it; ++it) {
+            if (HasRecur(*it))
+                return true;
+        }
+        return false;
+    }
+
+    // Thrown when a recur would be left to the tree-walker, which can't restart a compiled loop
+    struct TreeLoop {};
+
+    // Translates code values of a single function body into bytecode
+    // Forms that can't be compiled ahead of time (malformed forms, macro calls, try*, ...)
+    // are left to the tree-walking evaluator with Op::EvalTree
+    //
+    // Local variables are resolved to (depth, slot) pairs, where depth is the number
+    // of environments between the reference and the binding. Each function call and
+    // each let* opens one environment. Names bound by `def`, names bound outside of
+    // the compiled function and names introduced by macro expansions are looked up by name
+    //
+    // If the function is defined in the global environment, the remaining names can only
+    // refer to global bindings, so they are resolved to global cells once, at compile time
+    //
+    // A recur in a tail position of a loop body rebinds the slots of the loop and jumps to
+    // the start of the body. Tail positions are passed down like `tail` (see: at_loop_tail)
+    class Compiler {
+    public:
+        struct Scope {
+            std::shared_ptr<const SlotNames> names;
+            std::size_t bound; // Bindings visible at the current point
+        };
+    private:
+        enum Binding { Local, Pending, Free };
+
+        Interpreter& interp;
+        const EnvironFrame& env; // Defining environment, used to detect macro calls ahead of time
+        Code& code;
+        // Compile-time view of the environment chain (innermost last), holds only names bound at the current point
+        std::vector<Scope> scopes;
+        const std::vector<std::string>& dynamic;
+        bool globals; // Free names refer to global bindings
+        std::size_t expanding = 0; // Nesting of the macro expansions being compiled
+        static constexpr std::size_t MAX_EXPANSION_DEPTH = 100;
+
+        struct Loop {
+            std::size_t start; // Start of the body
+            std::size_t depth; // Size of `scopes` in the body
+            std::size_t count; // Number of variables
+        };
+        // Loops being compiled, innermost last
+        std::vector<Loop> loops;
+        // Set before compiling a tail position of the innermost loop body, cleared by Expression
+        bool at_loop_tail = false;
+
+        std::uint32_t AddConst(MalValue&& val) {
+            code.consts.push_back(std::move(val));
+            return code.consts.size() - 1;
+        }
+
+        std::uint32_t AddName(const std::string& name) {
+            auto it = std::find(code.names.begin(), code.names.end(), name);
+            if (it != code.names.end())
+                return it - code.names.begin();
+            code.names.push_back(name);
+            return code.names.size() - 1;
+        }
+
+        std::uint32_t AddCell(const std::string& name) {
+            const auto& cell = interp.env_global->cell(name);
+            auto it = std::find(code.cells.begin(), code.cells.end(), cell);
+            if (it != code.cells.end())
+                return it - code.cells.begin();
+            code.cells.push_back(cell);
+            return code.cells.size() - 1;
+        }
+
+        void Emit(Op op) {
+            code.ops.push_back(static_cast<std::uint32_t>(op));
+        }
+
+        void Emit(Op op, std::uint32_t arg) {
+            Emit(op);
+            code.ops.push_back(arg);
+        }
+
+        // Emits a jump with an unresolved target, returns position of the target operand
+        std::size_t EmitJump(Op op) {
+            Emit(op, 0);
+            return code.ops.size() - 1;
+        }
+
+        void Patch(std::size_t at) {
+            code.ops[at] = code.ops.size();
+        }
+
+        bool IsDynamic(const std::string& name) const {
+            return std::find(dynamic.begin(), dynamic.end(), name) != dynamic.end();
+        }
+
+        // Names which are not bound yet (later bindings of let*) may be bound by the time
+        // a nested function refers to them, so they must be looked up by name
+        Binding Resolve(const std::string& name, std::uint32_t& depth, std::uint32_t& slot) const {
+            if (IsDynamic(name))
+                return Pending;
+            for (std::size_t d = 0; d < scopes.size(); ++d) {
+                const Scope& scope = scopes[scopes.size() - d - 1];
+                const SlotNames& names = *scope.names;
+                for (std::size_t i = scope.bound; i > 0; --i) {
+                    if (names[i-1] == name) {
+                        depth = d;
+                        slot = i - 1;
+                        return Local;
+                    }
+                }
+                if (std::find(names.begin() + scope.bound, names.end(), name) != names.end())
+                    return Pending;
+            }
+            return Free;
+        }
+
+        bool IsLocal(const std::string& name) const {
+            std::uint32_t depth, slot;
+            return Resolve(name, depth, slot) != Free;
+        }
+
+        void Finish(bool tail) {
+            if (tail)
+                Emit(Op::Return);
+        }
+
+        void Fallback(const MalValue& expr, bool tail, bool loop_tail = false) {
+            if (loop_tail && HasRecur(expr))
+                throw TreeLoop{};
+            Emit(Op::EvalTree, AddConst(mh::copy(expr)));
+            Finish(tail);
+        }
+
+        void Constant(const MalValue& expr, bool tail) {
+            Emit(Op::Const, AddConst(mh::copy(expr)));
+            Finish(tail);
+        }
+
+        // Calls of arithmetic builtins get an inline path for integers, guarded by a check of the callee
+        void SpecializeInt(const MalValue& callee) {
+            if (!mh::is_symbol(callee) || IsLocal(callee.st->Get()))
+                return;
+            const MalAtom* bound = env->find(callee.st->Get());
+            IntOp op;
+            if (bound == nullptr || (*bound)->tag != Builtin_T || !LookupIntOp((*bound)->blt->name, op))
+                return;
+            Emit(Op::CallInt, AddConst(mh::builtin((*bound)->blt)));
+            code.ops.push_back(static_cast<std::uint32_t>(op));
+        }
+
+        bool CompileForm(SpecialForm form, const MalValue& expr, bool tail, bool loop_tail);
+        void CompileCall(const MalValue& expr, bool tail, bool loop_tail);
+        bool CompileLoop(const Ref<MalList>& args, bool tail);
+    public:
+        Compiler(Interpreter& interp, const EnvironFrame& env, Code& code, std::vector<Scope>&& scopes, const std::vector<std::string>& dynamic)
+            : interp{interp}, env{env}, code{code}, scopes{std::move(scopes)}, dynamic{dynamic}, globals{env == interp.env_global} {}
+
+        // Emits code leaving the value of `expr` on the stack, or returning it if `tail` is set
+        void Expression(const MalValue& expr, bool tail);
+
+        // Emits the body of a loop with `count` variables in the innermost scope (none if `count` is 0)
+        void LoopBody(const MalValue& body, std::size_t count, bool tail) {
+            loops.push_back(Loop{code.ops.size(), scopes.size(), count});
+            at_loop_tail = true;
+            Expression(body, tail);
+            loops.pop_back();
+        }
+
+        // Emits the iterations of dotimes, the counter is slot 0 of the innermost scope and the count is on the top of the stack
+        // The count is popped at the end
+        void CountedBody(const MalValue& body) {
+            std::size_t start = code.ops.size();
+            std::size_t to_end = EmitJump(Op::Times);
+            Expression(body, false);
+            Emit(Op::Pop);
+            Emit(Op::Step, start);
+            Patch(to_end);
+            Emit(Op::Pop);
+        }
+
+        std::shared_ptr<const Prototype> Function(const MalValue& spec, const MalValue& body, MalFunction::FKind kind);
+    };
+
+    void Compiler::Expression(const MalValue& expr, bool tail) {
+        bool loop_tail = at_loop_tail;
+        at_loop_tail = false;
+        // Constant expressions are served from their fold marks by the tree-walker
+        if (interp.IsFolded(expr)) {
+            Fallback(expr, tail);
+            return;
+        }
+        switch (expr.tag) {
+            case Symbol_T: {
+                std::uint32_t depth, slot;
+                switch (Resolve(expr.st->Get(), depth, slot)) {
+                    case Local:
+                        Emit(Op::LoadLocal, depth);
+                        code.ops.push_back(slot);
+                        break;
+                    case Free:
+                        if (globals) {
+                            Emit(Op::LoadGlobal, AddCell(expr.st->Get()));
+                            break;
+                        }
+                        [[fallthrough]];
+                    case Pending:
+                        Emit(Op::LoadName, AddName(expr.st->Get()));
+                }
+                Finish(tail);
+                return;
+            }
+            case Vector_T: {
+                std::uint32_t count = 0;
+                for (ListIterator it = mh::as_list(expr); it; ++it, ++count)
+                    Expression(*it, false);
+                Emit(Op::MakeVector, count);
+                Finish(tail);
+                return;
+            }
+            case List_T:
+                if (expr.li == nullptr) {
+                    Emit(Op::Const, AddConst(mh::copy(expr)));
+                    Finish(tail);
+                    return;
+                }
+                if (mh::is_symbol(expr.li->First())) {
+                    SpecialForm form = expr.li->First().st->Form();
+                    if (form != SpecialForm::None) {
+                        if (!CompileForm(form, expr, tail, loop_tail))
+                            Fallback(expr, tail, loop_tail);
+                        return;
+                    }
+                }
+                CompileCall(expr, tail, loop_tail);
+                return;
+            default:
+                Constant(expr, tail);
+        }
+    }
+
+    // Returns false if the form must be evaluated by the tree-walker
+    bool Compiler::CompileForm(SpecialForm form, const MalValue& expr, bool tail, bool loop_tail) {
+        const auto& args = expr.li->Rest();
+        std::size_t argc = args ? args->GetSize() : 0;
+        switch (form) {
+            case SpecialForm::Def:
+                if (argc != 2 || !mh::is_symbol(args->At(0)))
+                    return false;
+                Expression(args->At(1), false);
+                Emit(Op::Def, AddName(args->At(0).st->Get()));
+                Finish(tail);
+                return true;
+            case SpecialForm::Let: {
+                if (argc != 2 || args->At(0).tag != List_T)
+                    return false;
+                const auto& bindings = args->At(0).li;
+                std::size_t count = bindings ? bindings->GetSize() : 0;
+                if (count & 1)
+                    return false;
+                for (ListIterator it = bindings; it; ++it, ++it) {
+                    if (!mh::is_symbol(*it))
+                        return false;
+                }
+                auto names = std::make_shared<SlotNames>();
+                for (ListIterator it = bindings; it; ++it, ++it)
+                    names->push_back((*it).st->Get());
+                code.scopes.push_back(names);
+                Emit(Op::EnterScope, code.scopes.size() - 1);
+                scopes.push_back(Scope{std::move(names), 0});
+                for (ListIterator it = bindings; it; ++it) {
+                    ++it;
+                    Expression(*it, false);
+                    Emit(Op::Bind);
+                    // Bindings are visible from the next binding value on
+                    ++scopes.back().bound;
+                }
+                at_loop_tail = loop_tail;
+                Expression(args->At(1), tail);
+                if (!tail)
+                    Emit(Op::LeaveScope);
+                scopes.pop_back();
+                return true;
+            }
+            case SpecialForm::Do: {
+                if (argc == 0) {
+                    Constant(mh::nil, tail);
+                    return true;
+                }
+                for (ListIterator it = args; it; ) {
+                    MalValue e = *it;
+                    ++it;
+                    if (it) {
+                        Expression(e, false);
+                        Emit(Op::Pop);
+                    } else {
+                        at_loop_tail = loop_tail;
+                        Expression(e, tail);
+                    }
+                }
+                return true;
+            }
+            case SpecialForm::If: {
+                if (argc != 2 && argc != 3)
+                    return false;
+                Expression(args->At(0), false);
+                std::size_t to_else = EmitJump(Op::JumpIfFalse);
+                at_loop_tail = loop_tail;
+                Expression(args->At(1), tail);
+                std::size_t to_end = tail ? npos : EmitJump(Op::Jump);
+                Patch(to_else);
+                if (argc == 3) {
+                    at_loop_tail = loop_tail;
+                    Expression(args->At(2), tail);
+                } else
+                    Constant(mh::nil, tail);
+                if (to_end != npos)
+                    Patch(to_end);
+                return true;
+            }
+            case SpecialForm::Fn:
+            case SpecialForm::Macro: {
+                if (argc != 2)
+                    return false;
+                std::shared_ptr<const Prototype> proto;
+                try {
+                    proto = Function(args->At(0), args->At(1), form == SpecialForm::Fn ? MalFunction::KFunc : MalFunction::KMacro);
+                } catch (const mal_error&) {
+                    // Report the error when the form is evaluated
+                    return false;
+                }
+                code.protos.push_back(std::move(proto));
+                Emit(Op::Closure, code.protos.size() - 1);
+                Finish(tail);
+                return true;
+            }
+            case SpecialForm::Quote:
+                if (argc != 1)
+                    return false;
+                Emit(Op::Const, AddConst(mh::copy(args->First())));
+                Finish(tail);
+                return true;
+            case SpecialForm::Quasiquote:
+                if (argc != 1)
+                    return false;
+                Expression(interp.QuasiQuote(args->First()), tail);
+                return true;
+            case SpecialForm::Loop:
+                if (argc != 2)
+                    return false;
+                return CompileLoop(args, tail);
+            case SpecialForm::Recur: {
+                if (!loop_tail)
+                    return false;
+                Loop loop = loops.back(); // Loops in the arguments may reallocate `loops`
+                for (ListIterator it = args; it; ++it)
+                    Expression(*it, false);
+                // Close the let* scopes between the recur and the loop
+                for (std::size_t i = loop.depth; i < scopes.size(); ++i)
+                    Emit(Op::LeaveScope);
+                Emit(Op::Rebind, argc);
+                code.ops.push_back(loop.count);
+                Emit(Op::Jump, loop.start);
+                return true;
+            }
+            case SpecialForm::Dotimes: {
+                if (argc != 2 || !mh::is_flist(args->At(0)) || args->At(0).li->GetSize() != 2 || !mh::is_symbol(args->At(0).li->First()))
+                    return false;
+                Expression(args->At(0).li->At(1), false);
+                auto names = std::make_shared<SlotNames>(1, args->At(0).li->First().st->Get());
+                code.scopes.push_back(names);
+                Emit(Op::EnterScope, code.scopes.size() - 1);
+                Emit(Op::Const, AddConst(mh::num(0)));
+                Emit(Op::Bind);
+                scopes.push_back(Scope{std::move(names), 1});
+                CountedBody(args->At(1));
+                scopes.pop_back();
+                Emit(Op::LeaveScope);
+                Constant(mh::nil, tail);
+                return true;
+            }
+            default:
+                // macroexpand & try* are left to the tree-walker
+                return false;
+        }
+    }
+
+    // Returns false if the loop must be evaluated by the tree-walker
+    bool Compiler::CompileLoop(const Ref<MalList>& args, bool tail) {
+        if (args->At(0).tag != List_T)
+            return false;
+        const auto& bindings = args->At(0).li;
+        std::size_t count = bindings ? bindings->GetSize() : 0;
+        if (count & 1)
+            return false;
+        for (ListIterator it = bindings; it; ++it, ++it) {
+            if (!mh::is_symbol(*it))
+                return false;
+        }
+        std::size_t mark = code.ops.size();
+        std::size_t outer = scopes.size();
+        std::size_t outer_loops = loops.size();
+        std::size_t outer_expanding = expanding;
+        try {
+            // Variables are bound like the ones of let*, a loop without them runs in the current environment
+            if (bindings) {
+                auto names = std::make_shared<SlotNames>();
+                for (ListIterator it = bindings; it; ++it, ++it)
+                    names->push_back((*it).st->Get());
+                code.scopes.push_back(names);
+                Emit(Op::EnterScope, code.scopes.size() - 1);
+                scopes.push_back(Scope{std::move(names), 0});
+                for (ListIterator it = bindings; it; ++it) {
+                    ++it;
+                    Expression(*it, false);
+                    Emit(Op::Bind);
+                    ++scopes.back().bound;
+                }
+            }
+            LoopBody(args->At(1), count / 2, tail);
+        } catch (const TreeLoop&) {
+            // The whole loop is left to the tree-walker
+            code.ops.resize(mark);
+            scopes.resize(outer);
+            loops.resize(outer_loops);
+            expanding = outer_expanding;
+            return false;
+        }
+        if (bindings) {
+            if (!tail)
+                Emit(Op::LeaveScope);
+            scopes.pop_back();
+        }
+        return true;
+    }
+
+    void Compiler::CompileCall(const MalValue& expr, bool tail, bool loop_tail) {
+        const MalValue& callee = expr.li->First();
+        if (mh::is_symbol(callee) && !IsLocal(callee.st->Get())) {
+            // Macros known at this point are expanded now and the expansion is compiled in place,
+            // guarded by a check that the callee still holds the same macro at runtime
+            const MalAtom* bound = env->find(callee.st->Get());
+            if (bound && (*bound)->tag == Function_T && (*bound)->fun->kind == MalFunction::KMacro) {
+                MalAtom expansion;
+                bool expanded = expanding < MAX_EXPANSION_DEPTH;
+                if (expanded) {
+                    try {
+                        expansion = interp.ExpandMacro(expr, (*bound)->fun);
+                    } catch (const mal_error&) {
+                        expanded = false; // Reported when the form is evaluated
+                    }
+                }
+                // Names bound by `def` in the expansion could shadow slots
+                std::vector<std::string> defs;
+                if (expanded)
+                    CollectDefs(expansion.v, defs);
+                if (!expanded || !defs.empty()) {
+                    if (loop_tail && expanded && HasRecur(expansion.v))
+                        throw TreeLoop{};
+                    Fallback(expr, tail, loop_tail);
+                    return;
+                }
+                Expression(callee, false);
+                Emit(Op::Expanded, AddConst(mh::copy(expr)));
+                code.ops.push_back(AddConst((*bound)->fun));
+                code.ops.push_back(0);
+                std::size_t end = code.ops.size() - 1;
+                ++expanding;
+                at_loop_tail = loop_tail;
+                Expression(expansion.v, tail);
+                --expanding;
+                Patch(end);
+                Finish(tail);
+                return;
+            }
+        }
+        Expression(callee, false);
+        // The callee might still turn out to be a macro at runtime
+        std::size_t macro_end = npos;
+        if (mh::is_symbol(callee) || mh::is_flist(callee)) {
+            Emit(Op::MacroCheck, AddConst(mh::copy(expr)));
+            code.ops.push_back(0);
+            macro_end = code.ops.size() - 1;
+        }
+        std::uint32_t argc = 0;
+        for (ListIterator it = expr.li->Rest(); it; ++it, ++argc)
+            Expression(*it, false);
+        if (argc == 2)
+            SpecializeInt(callee);
+        Emit(tail ? Op::TailCall : Op::Call, argc);
+        if (macro_end != npos)
+            Patch(macro_end);
+        // Reached after TailCall of builtins and expanded macros
+        Finish(tail);
+    }
+
+    std::shared_ptr<const Prototype> Compiler::Function(const MalValue& spec, const MalValue& body, MalFunction::FKind kind) {
+        std::vector<MalString::string_t> params;
+        MalString::string_t param_var;
+        ParseParameters(spec, params, param_var);
+
+        auto inner = std::make_shared<Code>();
+        auto frame = std::make_shared<SlotNames>(params);
+        if (!param_var.empty())
+            frame->push_back(param_var);
+        inner->params = frame;
+        std::vector<Scope> inner_scopes = scopes;
+        inner_scopes.push_back(Scope{std::move(frame), inner->params->size()});
+        Compiler{interp, env, *inner, std::move(inner_scopes), dynamic}.Expression(body, true);
+        return std::make_shared<Prototype>(Prototype{std::move(params), std::move(param_var), body, kind, std::move(inner)});
+    }
+}
+
+namespace mal {
+    bool LookupIntOp(const std::string& name, IntOp& op) {
+        static const std::pair<const char*, IntOp> ops[] = {
+            {"+", IntOp::Add}, {"-", IntOp::Sub}, {"*", IntOp::Mul}, {"/", IntOp::Div}, {"mod", IntOp::Mod},
+            {"<", IntOp::Lt}, {"<=", IntOp::Le}, {">", IntOp::Gt}, {">=", IntOp::Ge}, {"=", IntOp::Eq},
+        };
+        for (const auto& entry : ops) {
+            if (name == entry.first) {
+                op = entry.second;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::shared_ptr<const Code> CompileFunction(Interpreter& interp, const MalFunction& func) {
+        auto code = std::make_shared<Code>();
+        auto frame = func.frame;
+        code->params = frame;
+        // Names bound with `def` are never addressed lexically, because `def` can shadow a slot of an outer scope at runtime
+        std::vector<std::string> dynamic;
+        CollectDefs(func.body, dynamic);
+        Compiler{interp, func.env, *code, {Compiler::Scope{std::move(frame), code->params->size()}}, dynamic}.Expression(func.body, true);
+        return code;
+    }
+
+    std::shared_ptr<const Code> CompileLoop(Interpreter& interp, const MalValue& form, const EnvironFrame& env) {
+        auto code = std::make_shared<Code>();
+        const MalValue& body = form.li->At(2);
+        std::vector<std::string> dynamic;
+        CollectDefs(body, dynamic);
+        // Dotimes and loops with variables run in an environment of their own
+        bool counted = form.li->First().st->Form() == SpecialForm::Dotimes;
+        bool scoped = counted || form.li->At(1).li != nullptr;
+        std::vector<Compiler::Scope> scopes;
+        if (scoped)
+            scopes.push_back(Compiler::Scope{env->slot_names, env->slots.size()});
+        Compiler compiler{interp, scoped ? env->outer : env, *code, std::move(scopes), dynamic};
+        if (counted) {
+            compiler.CountedBody(body);
+            compiler.Expression(mh::nil, true);
+            return code;
+        }
+        try {
+            compiler.LoopBody(body, scoped ? env->slots.size() : 0, true);
+        } catch (const TreeLoop&) {
+            return nullptr;
+        }
+        return code;
+    }
+}
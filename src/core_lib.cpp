@@ -1,14 +1,7 @@
 #include "interpreter.hpp"
 #include "reader.hpp"
 #include "interop.hpp"
-
-#include <sstream>
-
-#define DEF_FUNC(name) static MalValue _Core_##name([[maybe_unused]] Interpreter& interp, MalArgs&& args)
-#define EXP_FUNC(symbol_name, internal_name) env_global->set(symbol_name, mh::builtin(_Core_##internal_name));
-#define CHECK_ARGS(nArgs, name) \
-    if (args.size() != nArgs) \
-        throw mal_error{name " takes " #nArgs " argument(s)"}
+#include "builtin.hpp"
 
 namespace mal {
     // Checks list equality ignoring list types
@@ -25,88 +18,134 @@ namespace mal {
 namespace {
     using namespace mal;
 
+    // Walks the values of a list or a vector without copying the vector to a list, the sequence must outlive it
+    class SeqCursor {
+        const MalList* node = nullptr;
+        const MalVector* vector = nullptr;
+        std::size_t idx = 0;
+    public:
+        explicit SeqCursor(const MalValue& seq) {
+            if (seq.tag == List_T)
+                node = seq.li.get();
+            else
+                vector = seq.ve.get();
+        }
+
+        SeqCursor& operator++() {
+            if (node)
+                node = node->Next();
+            else
+                ++idx;
+            return *this;
+        }
+
+        const MalValue& operator*() const {
+            return node ? node->First() : vector->At(idx);
+        }
+
+        explicit operator bool() const {
+            return node != nullptr || (vector != nullptr && idx < vector->GetSize());
+        }
+    };
+
+    // Hashing (see: MalHash)
+    // Spreads the bits of `h` (the finalizer of splitmix64), the trie of maps indexes by the low bits first
+    std::size_t MixHash(std::size_t h) {
+        h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+        return h ^ (h >> 31);
+    }
+
+    // For sequences, the order of the values matters
+    std::size_t CombineOrdered(std::size_t seed, std::size_t h) {
+        return (seed ^ MixHash(h)) * 0x100000001b3ULL;
+    }
+
+    // Computes a hash once and keeps it in `cache`, 0 marks a hash not computed yet
+    template <typename T, typename F>
+    std::size_t CachedHash(T& cache, F&& compute) {
+        if (cache == 0) {
+            cache = static_cast<T>(compute());
+            if (cache == 0)
+                cache = 1;
+        }
+        return cache;
+    }
+
     // Arithmetic
-    DEF_FUNC(Add) {
-        //(void)interp;
-        int val = 0;
-        for (auto&& v : args) {
-            if (!mh::is_num(v))
-                throw mal_error{"Plus takes only number arguments"};
-            val += v.no;
+    // Fixnums take the inline paths of NumberAdd etc., results that overflow become bignums
+    MalValue Add(Interpreter&, MalArgs&& args) {
+        MalAtom val = mh::num(0);
+        for (std::size_t i = 0; i < args.size(); ++i) {
+            if (!mh::is_num(args[i]))
+                ArgumentError("+", i, "a number");
+            val = NumberAdd(val.v, args[i]);
         }
-        return mh::num(val);
+        return std::move(val.v);
     }
 
-    DEF_FUNC(Sub) {
-        (void)interp;
-        int val = 0;
+    MalValue Add2(Interpreter&, Number a, Number b) {
+        return NumberAdd(a.value, b.value);
+    }
+
+    MalValue Sub(Interpreter&, MalArgs&& args) {
         if (args.size() == 0)
             throw mal_error{"Minus takes at least one argument"};
-        if (args.size() == 1) {
-            const MalValue& v = args[0];
-            if (!mh::is_num(v))
-                throw mal_error{"Minus takes only number arguments"};
-            return mh::num(-v.no);
+        for (std::size_t i = 0; i < args.size(); ++i) {
+            if (!mh::is_num(args[i]))
+                ArgumentError("-", i, "a number");
         }
-        bool first = true;
-        for (auto&& v : args) {
-            if (!mh::is_num(v))
-                throw mal_error{"Minus takes only number arguments"};
-            if (first) {
-                val  = v.no;
-                first = false;
-            } else
-                val -= v.no;
-        }
-        return mh::num(val);
+        if (args.size() == 1)
+            return NumberSub(mh::num(0), args[0]);
+        MalAtom val = args[0];
+        for (std::size_t i = 1; i < args.size(); ++i)
+            val = NumberSub(val.v, args[i]);
+        return std::move(val.v);
     }
 
-    DEF_FUNC(Mul) {
-        (void)interp;
-        int val = 1;
-        for (auto&& v : args) {
-            if (!mh::is_num(v))
-                throw mal_error{"Star takes only number arguments"};
-            val *= v.no;
+    MalValue Sub2(Interpreter&, Number a, Number b) {
+        return NumberSub(a.value, b.value);
+    }
+
+    MalValue Mul(Interpreter&, MalArgs&& args) {
+        MalAtom val = mh::num(1);
+        for (std::size_t i = 0; i < args.size(); ++i) {
+            if (!mh::is_num(args[i]))
+                ArgumentError("*", i, "a number");
+            val = NumberMul(val.v, args[i]);
         }
-        return mh::num(val);
+        return std::move(val.v);
+    }
+
+    MalValue Mul2(Interpreter&, Number a, Number b) {
+        return NumberMul(a.value, b.value);
     }
 
-    DEF_FUNC(Div) {
-        (void)interp;
-        int val = 1;
+    MalValue Div(Interpreter&, MalArgs&& args) {
         if (args.size() == 0)
             throw mal_error{"Slash takes at least two arguments"};
         if (args.size() == 1)
             throw mal_error{"Multiplicative opposite is not allowed"};
-        bool first = true;
-        for (auto&& v : args) {
-            if (!mh::is_num(v))
-                throw mal_error{"Slash takes only number arguments"};
-            if (first) {
-                val  = v.no;
-                first = false;
-            } else {
-                if (v.no == 0)
-                    throw mal_error{"Division by zero"};
-                val /= v.no;
-            }
+        for (std::size_t i = 0; i < args.size(); ++i) {
+            if (!mh::is_num(args[i]))
+                ArgumentError("/", i, "a number");
         }
-        return mh::num(val);
+        MalAtom val = args[0];
+        for (std::size_t i = 1; i < args.size(); ++i)
+            val = NumberDiv(val.v, args[i]);
+        return std::move(val.v);
+    }
+
+    MalValue Div2(Interpreter&, Number a, Number b) {
+        return NumberDiv(a.value, b.value);
     }
 
-    DEF_FUNC(Mod) {
-        CHECK_ARGS(2, "mod takes 2 arguments");
-        if (!mh::is_num(args[0]) || !mh::is_num(args[1]))
-            throw mal_error{"mod only takes numbers"};
-        if (args[1].no == 0)
-            throw mal_error{"Division by zero"};
-        return mh::num((args[0].no % args[1].no + args[1].no) % args[1].no);
+    MalValue Mod(Interpreter&, Number a, Number b) {
+        return NumberMod(a.value, b.value);
     }
 
     // Types
-    DEF_FUNC(NewList) {
-        (void)interp;
+    MalValue NewList(Interpreter&, MalArgs&& args) {
         ListBuilder builder;
         for (auto&& v : args) {
             builder.push(std::move(v));
@@ -114,30 +153,15 @@ namespace {
         return mh::list(builder.release());
     }
 
-    DEF_FUNC(IsList) {
-        (void)interp;
-        if (args.size() == 0)
-            return mh::mal_false;
-        return mh::bool_val(mh::is_list(args[0]));
-    }
-
-    DEF_FUNC(NewVector) {
-        (void)interp;
-        ListBuilder builder;
+    MalValue NewVector(Interpreter&, MalArgs&& args) {
+        VectorBuilder builder;
         for (auto&& v : args) {
             builder.push(std::move(v));
         }
         return mh::vector(builder.release());
     }
 
-    DEF_FUNC(IsVector) {
-        (void)interp;
-        if (args.size() == 0)
-            return mh::mal_false;
-        return mh::bool_val(mh::is_vector(args[0]));
-    }
-
-    DEF_FUNC(NewMap) {
+    MalValue NewMap(Interpreter&, MalArgs&& args) {
         if (args.size() & 1)
             throw mal_error{"hash-map takes even number of arguments"};
         auto map = MalMap::Make();
@@ -149,405 +173,408 @@ namespace {
         return mh::hash_map(map);
     }
 
-    DEF_FUNC(IsMap) {
-        if (args.size() == 0)
-            return mh::mal_false;
-        return mh::bool_val(mh::is_map(args[0]));
+    // Type predicates, called without arguments they return false
+    template <bool (*P)(const MalValue&)>
+    MalValue Is(Interpreter&, const MalValue& v) {
+        return mh::bool_val(P(v));
     }
 
-    DEF_FUNC(IsSequence) {
-        (void)interp;
+    template <bool (*P)(const MalValue&)>
+    MalValue IsAny(Interpreter& interp, MalArgs&& args) {
         if (args.size() == 0)
             return mh::mal_false;
-        return mh::bool_val(mh::is_sequence(args[0]));
+        return Is<P>(interp, args[0]);
     }
 
-    DEF_FUNC(IsNumber) {
-        if (args.size() == 0)
-            return mh::mal_false;
-        return mh::bool_val(mh::is_num(args[0]));
+    MalValue NewAtom(Interpreter& interp, MalArgs&& args) {
+        MalValue atom = mh::atom(args.size() == 0 ? mh::nil : args[0]);
+        interp.collector.Track(atom.at);
+        return atom;
     }
 
-    DEF_FUNC(NewAtom) {
-        if (args.size() == 0)
-            return mh::atom();
-        return mh::atom(args[0]);
-    }
-
-    DEF_FUNC(IsAtom) {
-        if (args.size() == 0)
-            return mh::mal_false;
-        return mh::bool_val(mh::is_atom(args[0]));
-    }
-
-    DEF_FUNC(NewSymbol) {
-        if (args.size() != 1 || !mh::is_string(args[0]))
+    MalValue NewSymbol(Interpreter&, const MalValue& name) {
+        if (!mh::is_string(name))
             throw mal_error{"symbol: First argument must be a string"};
-        return MalValue(args[0].st, Symbol_T);
-    }
-
-    DEF_FUNC(IsSymbol) {
-        if (args.size() == 0)
-            return mh::mal_false;
-        return mh::bool_val(mh::is_symbol(args[0]));
+        return mh::symbol(mh::copy(name.st));
     }
 
-    DEF_FUNC(IsString) {
-        if (args.size() == 0)
-            return mh::mal_false;
-        return mh::bool_val(mh::is_string(args[0]));
-    }
-
-    DEF_FUNC(NewKeyword) {
-        if (args.size() != 1 || !mh::is_string(args[0]))
+    MalValue NewKeyword(Interpreter&, const MalValue& name) {
+        if (!mh::is_string(name))
             throw mal_error{"keyword: First argument must be a string"};
-        return MalValue(args[0].st, Keyword_T);
-    }
-
-    DEF_FUNC(IsKeyword) {
-        if (args.size() == 0)
-            return mh::mal_false;
-        return mh::bool_val(mh::is_keyword(args[0]));
+        return mh::keyword(mh::copy(name.st));
     }
 
     // Atoms
-    DEF_FUNC(Deref) {
-        if (args.size() != 1)
-            throw mal_error{"deref takes 1 argument"};
-        if (!mh::is_atom(args[0]))
+    MalValue Deref(Interpreter&, const MalValue& atom) {
+        if (!mh::is_atom(atom))
             return mh::nil;
-        return args[0].at->get();
+        return atom.at->get();
     }
 
-    // ! TODO: Check for cycles
-    DEF_FUNC(RefSet) {
-        if (args.size() != 2)
-            throw mal_error{"reset! takes 2 arguments"};
-        if (!mh::is_atom(args[0]))
+    // An atom may end up holding itself, such cycles are freed by the cycle collector (see: collector.cpp)
+    MalValue RefSet(Interpreter&, const MalValue& atom, MalValue&& value) {
+        if (!mh::is_atom(atom))
             throw mal_error{"First argument must be an atom"};
-        *args[0].at = args[1];
-        return args[0].at->get();
+        *atom.at = std::move(value);
+        return atom.at->get();
     }
 
     // Lists
-    DEF_FUNC(IsEmpty) {
-        (void)interp;
-        if (args.size() == 0)
-            return mh::mal_false;
-        const MalValue& v = args[0];
+    MalValue IsEmpty(Interpreter&, const MalValue& v) {
         if (mh::is_sequence(v))
-            return mh::bool_val(v.li == nullptr);
+            return mh::bool_val(!mh::is_fseq(v));
+        else if (mh::is_map(v))
+            return mh::bool_val(v.mp->GetSize() == 0);
         else if (mh::is_string(v))
-            return mh::bool_val(v.st->Get().size() == 0);
+            return mh::bool_val(v.st->Size() == 0);
         return mh::nil;
     }
 
-    DEF_FUNC(ElementCount) {
-        (void)interp;
+    MalValue IsEmptyAny(Interpreter& interp, MalArgs&& args) {
         if (args.size() == 0)
-            return mh::nil;
-        const MalValue& v = args[0];
+            return mh::mal_false;
+        return IsEmpty(interp, args[0]);
+    }
+
+    MalValue ElementCount(Interpreter&, const MalValue& v) {
         if (mh::is_sequence(v))
-            return mh::num(v.li == nullptr ? 0 : v.li->GetSize());
+            return mh::num(mh::seq_size(v));
+        else if (mh::is_map(v))
+            return mh::num(v.mp->GetSize());
         else if (mh::is_string(v))
-            return mh::num(v.st->Get().size());
+            return mh::num(v.st->Size());
         return mh::nil;
     }
 
-    DEF_FUNC(First) {
-        CHECK_ARGS(1, "first");
-        if (!mh::is_fseq(args[0]))
+    MalValue ElementCountAny(Interpreter& interp, MalArgs&& args) {
+        if (args.size() == 0)
+            return mh::nil;
+        return ElementCount(interp, args[0]);
+    }
+
+    MalValue First(Interpreter&, const MalValue& seq) {
+        if (!mh::is_fseq(seq))
             return mh::nil;
-        return args[0].li->First();
+        return seq.tag == Vector_T ? seq.ve->At(0) : seq.li->First();
     }
 
-    DEF_FUNC(Rest) {
-        CHECK_ARGS(1, "rest");
-        if (!mh::is_fseq(args[0]))
+    // The rest of a vector is a list, the list view of the vector is made by the first call and shared by the next ones
+    MalValue Rest(Interpreter&, const MalValue& seq) {
+        if (!mh::is_fseq(seq))
             return mh::nil;
-        return mh::list(args[0].li->Rest());
+        return mh::list(mh::as_list(seq)->Rest());
     }
 
-    DEF_FUNC(GetElement) {
-        CHECK_ARGS(2, "nth");
-        if (!mh::is_num(args[1]))
+    MalValue GetElement(Interpreter&, const MalValue& seq, const MalValue& index) {
+        if (!mh::is_num(index))
             throw mal_error{"Second argument must be a valid index"};
-        int idx = args[1].no;
-        if (mh::is_fseq(args[0])) {
-            if (idx < 0 || idx >= args[0].li->GetSize())
+        // Bignums are out of range
+        std::int64_t idx = index.tag == Int_T ? index.no : -1;
+        if (mh::is_fseq(seq)) {
+            if (idx < 0)
                 return mh::nil;
-            return args[0].li->At(idx);
-        } else if (mh::is_string(args[0])) {
-            if (idx < 0 || idx >= args[0].st->Get().size())
+            return seq.tag == Vector_T ? seq.ve->At(idx) : seq.li->At(idx);
+        } else if (mh::is_string(seq)) {
+            if (idx < 0 || idx >= seq.st->Size())
                 return mh::string("");
-            return mh::string(mal::MalString::string_t(1, args[0].st->Get()[idx]));
+            return mh::string(mal::MalString::string_t(1, seq.st->View()[idx]));
         }
         return mh::nil;
     }
 
-    DEF_FUNC(Cons) {
-        CHECK_ARGS(2, "cons");
-        if (!mh::is_list(args[1]) && !mh::is_nil(args[1]))
+    MalValue Cons(Interpreter&, MalValue&& head, const MalValue& tail) {
+        if (!mh::is_list(tail) && !mh::is_nil(tail))
             throw mal_error{"Second arguemnt must be a list or nil"};
         return mh::list(
-            mh::cons(MalValue(args[0]), mh::is_list(args[1]) ? args[1].li : nullptr)
+            mh::cons(std::move(head), mh::is_list(tail) ? tail.li : nullptr)
         );
     }
 
-    DEF_FUNC(Concat) {
+    MalValue Concat(Interpreter&, MalArgs&& args) {
         mal::ListBuilder lb;
         for (const auto& l : args) {
             if (!mh::is_sequence(l))
                 throw mal_error{"All arguments must be lists or vectors"};
-            mal::ListIterator it{l.li};
-            while (it) {
-                lb.push(*it);
-                ++it;
-            }
+            for (SeqCursor it{l}; it; ++it)
+                lb.push(MalValue{*it});
         }
         return mh::list(lb.release());
     }
 
+    // Adds values to the front of a list, or to the end of a vector; nil is an empty list
+    MalValue Conj(Interpreter&, MalArgs&& args) {
+        if (args.size() == 0)
+            throw mal_error{"conj takes at least one argument"};
+        MalAtom coll = args[0];
+        if (mh::is_vector(coll.v)) {
+            Ref<MalVector> vector = coll->ve;
+            for (std::size_t i = 1; i < args.size(); ++i) {
+                if (vector == nullptr) {
+                    VectorBuilder vb;
+                    vb.push(std::move(args)[i]);
+                    vector = vb.release();
+                } else {
+                    vector = vector->Conj(std::move(args)[i]);
+                }
+            }
+            return mh::vector(vector);
+        }
+        if (!mh::is_list(coll.v) && !mh::is_nil(coll.v))
+            throw mal_error{"First argument must be a list, a vector or nil"};
+        Ref<MalList> list = mh::is_list(coll.v) ? coll->li : nullptr;
+        for (std::size_t i = 1; i < args.size(); ++i)
+            list = mh::cons(std::move(args)[i], std::move(list));
+        return mh::list(list);
+    }
+
     // Hash maps
-    DEF_FUNC(MapAssoc) {
-        CHECK_ARGS(3, "assoc");
-        if (!mh::is_map(args[0]))
-            throw mal_error{"First argument must be a hash-map"};
-        return mh::assoc(args[0], args[1], args[2]);
+    // Replaces a value of a vector, the index one past the end appends it
+    MalValue VectorAssoc(const MalValue& vec, const MalValue& index, const MalValue& value) {
+        std::size_t size = mh::seq_size(vec);
+        if (index.tag != Int_T || index.no < 0 || static_cast<std::size_t>(index.no) > size)
+            throw mal_error{"Index out of bounds"};
+        std::size_t idx = index.no;
+        if (idx == size) {
+            if (vec.ve == nullptr) {
+                VectorBuilder vb;
+                vb.push(MalValue{value});
+                return mh::vector(vb.release());
+            }
+            return mh::vector(vec.ve->Conj(MalValue{value}));
+        }
+        return mh::vector(vec.ve->Assoc(idx, MalValue{value}));
+    }
+
+    MalValue MapAssoc(Interpreter&, const MalValue& map, const MalValue& key, const MalValue& value) {
+        if (mh::is_vector(map))
+            return VectorAssoc(map, key, value);
+        if (!mh::is_map(map))
+            throw mal_error{"First argument must be a hash-map or a vector"};
+        return mh::assoc(map, key, value);
     }
 
-    DEF_FUNC(MapDissoc) {
-        CHECK_ARGS(2, "dissoc");
-        if (!mh::is_map(args[0]))
+    MalValue MapDissoc(Interpreter&, const MalValue& map, const MalValue& key) {
+        if (!mh::is_map(map))
             throw mal_error{"First argument must be a hash-map"};
-        return mh::dissoc(args[0], args[1]);
+        return mh::dissoc(map, key);
     }
 
-    DEF_FUNC(MapGet) {
-        CHECK_ARGS(2, "get");
-        if (!mh::is_map(args[0]))
+    MalValue MapGet(Interpreter&, const MalValue& map, const MalValue& key) {
+        if (!mh::is_map(map))
             throw mal_error{"First argument must be a hash-map"};
-        auto m = mh::as_map(args[0]);
-        auto i = m->Lookup(args[1]);
-        if (i == m->data.end())
-            return mh::nil;
-        return i->second.get();
+        const MalValue* value = map.mp->Find(key);
+        return value ? *value : mh::nil;
     }
 
-    DEF_FUNC(MapContains) {
-        CHECK_ARGS(2, "contains?");
-        if (mh::is_map(args[0])) {
-            auto m = mh::as_map(args[0]);
-            auto i = m->Lookup(args[1]);
-            return mh::bool_val(i != m->data.end());
-        } else if (mh::is_string(args[0])) {
-            if (!mh::is_string(args[1]))
+    MalValue MapContains(Interpreter&, const MalValue& coll, const MalValue& key) {
+        if (mh::is_map(coll)) {
+            return mh::bool_val(coll.mp->Find(key) != nullptr);
+        } else if (mh::is_string(coll)) {
+            if (!mh::is_string(key))
                 throw mal_error{"All arguments must be strings for a string search"};
-            return mh::bool_val(args[0].st->Get().find(args[1].st->Get()) != mal::MalString::string_t::npos);
+            return mh::bool_val(coll.st->View().find(key.st->View()) != std::string_view::npos);
         }
         throw mal_error{"First argument must be a hash-map or a string"};
     }
 
-    DEF_FUNC(MapKeys) {
-        CHECK_ARGS(1, "keys");
-        if (!mh::is_map(args[0]))
+    MalValue MapKeys(Interpreter&, const MalValue& map) {
+        if (!mh::is_map(map))
             throw mal_error{"First argument must be a hash-map"};
-        auto m = mh::as_map(args[0]);
         ListBuilder lb;
-        for (auto it = m->data.begin(); it != m->data.end(); ++it) {
-            lb.push(mh::copy(it->first));
-        }
+        map.mp->ForEach([&lb](const MalValue& key, const MalValue&) {
+            lb.push(MalValue{key});
+        });
         return mh::list(lb.release());
     }
 
-    DEF_FUNC(MapValues) {
-        CHECK_ARGS(1, "vals");
-        if (!mh::is_map(args[0]))
+    MalValue MapValues(Interpreter&, const MalValue& map) {
+        if (!mh::is_map(map))
             throw mal_error{"First argument must be a hash-map"};
-        auto m = mh::as_map(args[0]);
         ListBuilder lb;
-        for (auto it = m->data.begin(); it != m->data.end(); ++it) {
-            lb.push(it->second.get());
-        }
+        map.mp->ForEach([&lb](const MalValue&, const MalValue& value) {
+            lb.push(MalValue{value});
+        });
         return mh::list(lb.release());
     }
 
     // Comparisons
-    DEF_FUNC(IsEqual) {
-        (void)interp;
-        if (args.size() != 2)
-            throw mal_error{"Equal takes 2 arguments"};
-        return mh::bool_val(args[0] == args[1]);
+    MalValue IsEqual(Interpreter&, const MalValue& a, const MalValue& b) {
+        return mh::bool_val(a == b);
     }
 
-    DEF_FUNC(EqList) {
-        (void)interp;
-        if (args.size() != 2)
-            throw mal_error{"List-Equal takes 2 arguments"};
-        return mh::bool_val(ListEqual(args[0], args[1]));
+    MalValue EqList(Interpreter&, const MalValue& a, const MalValue& b) {
+        return mh::bool_val(ListEqual(a, b));
     }
 
-    DEF_FUNC(CmpLT) {
-        (void)interp;
-        if (args.size() != 2)
-            throw mal_error{"LessThan takes 2 arguments"};
-        return mh::bool_val(compare(args[0], args[1]) < 0);
+    MalValue CmpLT(Interpreter&, Number a, Number b) {
+        return mh::bool_val(NumberCompare(a.value, b.value) < 0);
     }
 
-    DEF_FUNC(CmpLE) {
-        (void)interp;
-        if (args.size() != 2)
-            throw mal_error{"LessOrEqual takes 2 arguments"};
-        return mh::bool_val(compare(args[0], args[1]) <= 0);
+    MalValue CmpLE(Interpreter&, Number a, Number b) {
+        return mh::bool_val(NumberCompare(a.value, b.value) <= 0);
     }
 
-    DEF_FUNC(CmpGT) {
-        (void)interp;
-        if (args.size() != 2)
-            throw mal_error{"GreaterThan takes 2 arguments"};
-        return mh::bool_val(compare(args[0], args[1]) > 0);
+    MalValue CmpGT(Interpreter&, Number a, Number b) {
+        return mh::bool_val(NumberCompare(a.value, b.value) > 0);
     }
 
-    DEF_FUNC(CmpGE) {
-        (void)interp;
-        if (args.size() != 2)
-            throw mal_error{"GreaterOrEqual takes 2 arguments"};
-        return mh::bool_val(compare(args[0], args[1]) >= 0);
+    MalValue CmpGE(Interpreter&, Number a, Number b) {
+        return mh::bool_val(NumberCompare(a.value, b.value) >= 0);
     }
 
     // Printing
-    DEF_FUNC(PFormat) {
-        (void)interp;
-        std::stringstream str;
-        OstreamPrinter printer{str};
-        printer << print_begin;
+    // The values are formatted into one buffer (see: StringBuilder), sized for the strings among them
+    void PrintArgs(StringBuilder& builder, MalArgs& args) {
+        std::size_t size = args.size();
+        for (auto&& v : args)
+            size += mh::is_string(v) ? v.st->Size() + 2 : 8;
+        builder.Reserve(size);
         bool first = true;
         for (auto&& v : args) {
             if (first)
                 first = false;
             else
-                printer << " ";
-            printer << v;
+                builder.Append(' ');
+            builder.Append(v);
         }
-        return mh::string(str.str());
     }
 
-    DEF_FUNC(StrCat) {
-        (void)interp;
-        std::stringstream str;
-        OstreamPrinter printer{str};
-        printer << print_begin_raw;
-        for (auto&& v : args) {
-            printer << v;
-        }
-        return mh::string(str.str());
+    MalValue PFormat(Interpreter&, MalArgs&& args) {
+        StringBuilder builder{false};
+        PrintArgs(builder, args);
+        return mh::string(std::move(builder.Get()));
     }
 
-    DEF_FUNC(PPrint) {
-        interp.printer << print_begin;
-        bool first = true;
+    // Long strings are joined into a rope rather than copied, building a string by appends takes a linear time
+    // The other values are formatted into one buffer between them
+    MalValue StrCat(Interpreter&, MalArgs&& args) {
+        auto joined = [](const MalValue& v) {
+            return v.tag == String_T && v.st->Size() > MalString::SHORT;
+        };
+        std::size_t size = 0;
         for (auto&& v : args) {
-            if (first)
-                first = false;
-            else
-                interp.printer << " ";
-            interp.printer << v;
+            if (!joined(v))
+                size += mh::is_string(v) ? v.st->Size() : 8;
         }
-        interp.printer << print_end;
+        StringBuilder builder{true};
+        builder.Reserve(size);
+        Ref<MalString> result = MalString::Make(MalString::string_t{});
+        auto flush = [&builder, &result]() {
+            if (!builder.Get().empty()) {
+                result = MalString::Concat(std::move(result), MalString::Make(std::move(builder.Get())));
+                builder.Get().clear();
+            }
+        };
+        for (auto&& v : args) {
+            if (joined(v)) {
+                flush();
+                result = MalString::Concat(std::move(result), v.st);
+            } else {
+                builder.Append(v);
+            }
+        }
+        flush();
+        return mh::string(std::move(result));
+    }
+
+    MalValue PPrint(Interpreter& interp, MalArgs&& args) {
+        StringBuilder builder{false, interp.printer.HasColors()};
+        PrintArgs(builder, args);
+        interp.printer << print_begin << builder.Get() << print_end;
         return mh::nil;
     }
 
-    DEF_FUNC(PrintLn) {
-        interp.printer << print_begin_raw;
-        bool first = true;
-        for (auto&& v : args) {
-            if (first)
-                first = false;
-            else
-                interp.printer << " ";
-            interp.printer << v;
-        }
-        interp.printer << print_end;
+    MalValue PrintLn(Interpreter& interp, MalArgs&& args) {
+        StringBuilder builder{true};
+        PrintArgs(builder, args);
+        interp.printer << print_begin_raw << builder.Get() << print_end;
         return mh::nil;
     }
 
-    DEF_FUNC(ReadString) {
-        if (args.size() != 1) {
-            throw mal_error{"read-string takes 1 argument"};
-        }
-        if (!mh::is_string(args[0])) {
-            throw mal_error{"First argument must be a string"};
-        }
-        const auto& str = args[0].st->Get();
+    MalValue ReadString(Interpreter& interp, const MalString::string_t& str) {
         return mal::ReadForm(str, &interp.str_interner);
     }
 
-    DEF_FUNC(Substr) {
-        CHECK_ARGS(3, "substr");
-        if (!mh::is_string(args[0]) || !mh::is_num(args[1]) || !mh::is_num(args[2]))
-            throw mal_error{"substr takes string, number, number"};
-        int a = args[1].no;
-        int b = args[2].no;
+    // The substring shares the bytes of `str` (see: MalString::Slice)
+    MalValue Substr(Interpreter&, const Ref<MalString>& str, std::int64_t a, std::int64_t b) {
         if (a < 0 || b < 0)
             throw mal_error{"Ranges must not be negative"};
-        if (a+b > args[0].st->Get().size())
+        if (a > str->Size() || b > str->Size() - a)
             throw mal_error{"Indexing past string end"};
-        return mh::string(args[0].st->Get().substr(a, b));
+        return mh::string(MalString::Slice(str, a, b));
     }
 
-    DEF_FUNC(CharIdx) {
-        CHECK_ARGS(1, "char-index");
-        if (!mh::is_num(args[0]))
-            throw mal_error{"Index must be a number"};
-        int i = args[0].no;
+    MalValue CharIdx(Interpreter&, std::int64_t i) {
         if (i < 0 || i >= 0x100)
             throw mal_error{"Index must be in byte range"};
         return mh::string(MalString::string_t(1, (unsigned char)i));
     }
 
     // Runtime
-    DEF_FUNC(DoEval) {
-        if (args.size() != 1) {
-            throw mal_error{"eval takes 1 argument"};
-        }
-        return interp.EvaluateExpression(args[0], interp.env_global);
+    MalValue DoEval(Interpreter& interp, const MalValue& expr) {
+        return interp.EvaluateExpression(expr, interp.env_global);
     }
 
-    DEF_FUNC(DoThrow) {
-        CHECK_ARGS(1, "throw");
-        throw mal_error{MalValue(args[0])};
+    MalValue DoThrow(Interpreter&, MalValue&& value) {
+        throw mal_error{std::move(value)};
     }
 
-    DEF_FUNC(GetMeta) {
-        CHECK_ARGS(1, "meta");
-        return args[0].meta ? args[0].meta->get() : mh::nil;
+    MalValue GetMetadata(Interpreter&, const MalValue& v) {
+        return v.Meta();
     }
 
-    DEF_FUNC(WithMeta) {
-        CHECK_ARGS(2, "with-meta");
-        auto v = args[0];
-        v.meta = MalAtom::Make(args[1]);
-        return v;
+    // Metadata belongs to objects, the value gets a copy of its object unless it holds the only reference
+    MalValue WithMeta(Interpreter& interp, MalValue&& value, const MalValue& meta) {
+        MalAtom v = std::move(value);
+        switch (v->tag) {
+            case List_T:
+                if (v->li == nullptr)
+                    throw mal_error{"Empty sequences can't have metadata"};
+                if (v->li.use_count() > 1)
+                    v = mh::list(MalList::Make(MalValue{v->li->First()}, v->li->Rest()));
+                break;
+            case Vector_T:
+                if (v->ve == nullptr)
+                    throw mal_error{"Empty sequences can't have metadata"};
+                if (v->ve.use_count() > 1)
+                    v = mh::vector(MakeRef<MalVector>(*v->ve));
+                break;
+            case Map_T:
+                if (v->mp.use_count() > 1)
+                    v = mh::hash_map(MakeRef<MalMap>(*v->mp));
+                break;
+            case String_T:
+                if (v->st.use_count() > 1)
+                    v = MalValue{MalString::Copy(v->st), v->tag};
+                break;
+            case Symbol_T:
+            case Keyword_T:
+                // Interned names are always shared, through the symbol table
+                v = MalValue{MalString::Copy(v->st), v->tag};
+                break;
+            case Function_T:
+                if (v->fun.use_count() > 1) {
+                    v = MalValue{MakeRef<MalFunction>(*v->fun)};
+                    interp.collector.Track(v->fun);
+                }
+                break;
+            default:
+                throw mal_error{"Only sequences, hash-maps, strings and functions can have metadata"};
+        }
+        v->SetMeta(meta);
+        return std::move(v.v);
     }
 
-    DEF_FUNC(Apply) {
-        CHECK_ARGS(2, "apply");
-        if (!mh::is_invokable(args[0]))
+    MalValue DoApply(Interpreter& interp, const MalValue& func, const MalValue& args) {
+        if (!mh::is_invokable(func))
             throw mal_error{"First argument must be a function"};
-        if (!mh::is_sequence(args[1]))
+        if (!mh::is_sequence(args))
             throw mal_error{"Second argument must be an argument list"};
-        return interp.InvokeFunction(args[0], args[1].li);
+        return interp.InvokeFunction(func, mh::as_list(args));
     }
 
 #   if (ENABLE_FS)
-    DEF_FUNC(Slurp) {
-        if (args.size() != 1) {
-            throw mal_error{"slurp takes 1 argument"};
-        }
-        if (!mh::is_string(args[0])) {
-            throw mal_error{"First argument must be a string"};
-        }
-        const auto& fname = args[0].st->Get();
+    MalValue Slurp(Interpreter&, const MalString::string_t& fname) {
         std::ifstream file{fname};
         if (!file.good()) {
             throw mal_error{std::string{"Could not open file "} + fname};
@@ -556,27 +583,22 @@ namespace {
         return mh::string(std::string(it, std::istreambuf_iterator<char>{}));
     }
 
-    DEF_FUNC(LoadLibrary) {
-        if (args.size() != 1 || !mh::is_string(args[0]))
-            throw mal_error{"load-library: First argument must be a string"};
-        bool status = ::mal::InLoadLibrary(interp, args[0].st->Get().c_str());
+    MalValue LoadLibrary(Interpreter& interp, const MalString::string_t& fname) {
+        bool status = ::mal::InLoadLibrary(interp, fname.c_str());
         if (!status)
             throw mal_error{"Error while loading a library! Aborted"};
         return mh::nil;
     }
 #   endif
 
-    DEF_FUNC(GetRefcount) {
-        CHECK_ARGS(1, "ref-count");
-        auto& val = args[0];
+    MalValue GetRefcount(Interpreter&, const MalValue& val) {
         switch (val.tag) {
             case List_T:
-            case Vector_T:
                 return mh::num(val.li.use_count());
+            case Vector_T:
+                return mh::num(val.ve.use_count());
             case Map_T:
                 return mh::num(val.mp.use_count());
-            case MapSpec_T:
-                return mh::num(val.ms.use_count());
             case Symbol_T:
             case Keyword_T:
             case String_T:
@@ -590,33 +612,44 @@ namespace {
         }
     }
 
-    DEF_FUNC(Intern) {
-        CHECK_ARGS(1, "intern");
-        auto& val = args[0];
+    MalValue Intern(Interpreter& interp, const MalValue& val) {
         switch (val.tag) {
             case Symbol_T:
             case Keyword_T:
+                return val;
             case String_T:
-                return MalValue{interp.str_interner.Intern(mh::copy(val.st->Get())), val.tag};
+                return MalValue{interp.str_interner.Intern(val.st->Get()), val.tag};
             default:
                 throw mal_error{"Only string-like values can be interned"};
         }
     }
 
-    DEF_FUNC(GetSystem) {
-        CHECK_ARGS(0, "get-system-info");
+    MalValue GetCallStack(Interpreter& interp) {
+        return mh::list(interp.CallStack());
+    }
+
+    MalValue CollectCycles(Interpreter& interp) {
+        return mh::num(interp.collector.Collect());
+    }
+
+    MalValue GetSystem(Interpreter& interp) {
         auto info = MalMap::Make();
-        info->Set(mh::string("recursion_limit"), Interpreter::MAX_RECURSION_DEPTH);
+        info->Set(mh::string("recursion_limit"), mh::num(Interpreter::MAX_RECURSION_DEPTH));
+        info->Set(mh::string("stack_limit"), mh::num(interp.stack_limit));
+        info->Set(mh::string("call_cache_hits"), mh::num(interp.call_cache_hits));
+        info->Set(mh::string("call_cache_misses"), mh::num(interp.call_cache_misses));
         info->Set(mh::string("filesystem_enabled"), mh::bool_val(static_cast<bool>(ENABLE_FS)));
-        //info->Set(mh::string("total_refs"), RefCounter::total_refs);
+        info->Set(mh::string("engine"), mh::string(interp.engine == Interpreter::Engine::VM ? "vm" : "tree"));
+        info->Set(mh::string("tier_threshold"), mh::num(interp.tier_threshold));
+        info->Set(mh::string("cycles_collected"), mh::num(interp.collector.collected));
         return info;
     }
 }
 
 namespace mal {
-    // Checks lists recursively.
-    bool check_list(std::shared_ptr<MalList> a_, std::shared_ptr<MalList> b_) {
-        ListIterator a{a_}, b{b_};
+    // Checks sequences recursively.
+    bool check_list(const MalValue& a_, const MalValue& b_) {
+        SeqCursor a{a_}, b{b_};
         while (a && b) {
             if (*a != *b)
                 return false;
@@ -627,37 +660,38 @@ namespace mal {
     }
 
     // Checks maps recursively
-    bool check_map(std::shared_ptr<MalMap> a, std::shared_ptr<MalMap> b) {
-        if (a->data.size() != b->data.size())
+    bool check_map(const MalMap& a, const MalMap& b) {
+        if (a.GetSize() != b.GetSize())
             return false;
-        for (auto it = a->data.begin(); it != a->data.end(); ++it) {
-            auto itb = b->Lookup(it->first);
-            if (itb == b->data.end() || (it->second.v != itb->second.v))
-                return false;
-        }
-        return true;
+        bool equal = true;
+        a.ForEach([&b, &equal](const MalValue& key, const MalValue& value) {
+            if (equal) {
+                const MalValue* other = b.Find(key);
+                equal = other != nullptr && *other == value;
+            }
+        });
+        return equal;
     }
 
     bool operator==(const MalValue& a, const MalValue& b) {
         auto tag = a.tag;
         auto btag = b.tag;
-        // A & B must be the same type (!exception: A & B's types are [int | bigint] or [map | mapspec])
-        if (tag == Map_T || tag == MapSpec_T) {
-            if (btag != Map_T && btag != MapSpec_T)
-                return false;
-            tag = btag = Map_T;
-        }
+        // A & B must be the same type
         if (tag != btag)
             return false;
         if (tag == Int_T)
             return a.no == b.no;
+        if (tag == Bigint_T)
+            return a.bi->negative == b.bi->negative && a.bi->limbs == b.bi->limbs;
         if (tag == List_T || tag == Vector_T)
-            return check_list(a.li, b.li);
-        if (tag == Map_T /*|| tag == MapSpec_T*/)
-            return check_map(mh::as_map(a), mh::as_map(b));
-        if (tag == Symbol_T || tag == Keyword_T || tag == String_T)
-            return a.st->Get() == b.st->Get();
-        if (tag == Builtin_T) // TODO: Abstract builtin storage
+            return check_list(a, b);
+        if (tag == Map_T)
+            return check_map(*a.mp, *b.mp);
+        if (tag == Symbol_T || tag == Keyword_T)
+            return a.st->Id() == b.st->Id();
+        if (tag == String_T)
+            return a.st == b.st || a.st->View() == b.st->View();
+        if (tag == Builtin_T)
             return a.blt == b.blt;
         if (tag == Function_T)
             return a.fun == b.fun;
@@ -671,33 +705,59 @@ namespace mal {
         switch (tag) {
             case Int_T:
                 return v.no;
+            case Bigint_T:
+                return v.bi->Hash();
             case List_T:
+                if (v.li == nullptr)
+                    return List_T;
+                return CachedHash(v.li->hash, [this, &v]() {
+                    std::size_t h = List_T;
+                    for (const MalList* p = v.li.get(); p != nullptr; p = p->Next())
+                        h = CombineOrdered(h, (*this)(p->First()));
+                    return MixHash(h);
+                });
             case Vector_T:
-                // FIXME: Add some algorithm for lists and vectors
-                return v.li->GetSize();
+                if (v.ve == nullptr)
+                    return Vector_T;
+                return CachedHash(v.ve->hash, [this, &v]() {
+                    std::size_t h = Vector_T;
+                    v.ve->ForEach([this, &h](const MalValue& val) {
+                        h = CombineOrdered(h, (*this)(val));
+                    });
+                    return MixHash(h);
+                });
             case Map_T:
-            case MapSpec_T:
-                // Note: Maps are intentionally left out
-                return static_cast<std::size_t>(-1);
+                // The entries are combined by a sum, maps of the same entries have the same hash in any order
+                return CachedHash(v.mp->hash, [this, &v]() {
+                    std::size_t h = Map_T;
+                    v.mp->ForEach([this, &h](const MalValue& key, const MalValue& value) {
+                        h += MixHash(CombineOrdered((*this)(key), (*this)(value)));
+                    });
+                    return MixHash(h);
+                });
             case Symbol_T:
             case Keyword_T:
             case String_T:
                 // Note: strings, keywords and strings with the same content have the same hash
-                return std::hash<std::string>()(v.st->Get());
+                return CachedHash(v.st->hash, [&v]() {
+                    return std::hash<std::string_view>()(v.st->View());
+                });
             case Builtin_T:
-                return reinterpret_cast<std::size_t>(reinterpret_cast<void*>(v.blt));
+                return reinterpret_cast<std::size_t>(v.blt);
             case Function_T:
+                return reinterpret_cast<std::size_t>(v.fun.get());
             case Atom_T:
-            // Note: Atoms can't have unique hashes except addresses because their value can change
+                // Note: Atoms can't have unique hashes except addresses because their value can change
+                return reinterpret_cast<std::size_t>(v.at.get());
             default:
-                return static_cast<std::size_t>(-1);
+                return tag;
         }
     }
 
     int compare(const MalValue& a, const MalValue& b) {
         if (!mh::is_num(a) || !mh::is_num(b))
             throw mal_error{"Cannot compare non-numbers"};
-        return a.no - b.no;
+        return NumberCompare(a, b);
     }
 
     bool ListEqual(const MalValue& a, const MalValue& b) {
@@ -705,7 +765,7 @@ namespace mal {
             return a == b;
         if (!mh::is_list(b) && !mh::is_vector(b))
             return false;
-        ListIterator ia{a.li}, ib{b.li};
+        SeqCursor ia{a}, ib{b};
         while (ia && ib) {
             if (!ListEqual(*ia, *ib))
                 return false;
@@ -716,67 +776,81 @@ namespace mal {
     }
 
     void Interpreter::InitEnv() {
-        env_global = std::make_shared<Environment>();
+        env_global = MakeRef<Environment>();
+        env_global->global = true;
         
-        EXP_FUNC("+", Add)
-        EXP_FUNC("-", Sub)
-        EXP_FUNC("*", Mul)
-        EXP_FUNC("/", Div)
-        EXP_FUNC("mod", Mod);
-        EXP_FUNC("list", NewList)
-        EXP_FUNC("list?", IsList)
-        EXP_FUNC("vector", NewVector)
-        EXP_FUNC("vector?", IsVector)
-        EXP_FUNC("hash-map", NewMap)
-        EXP_FUNC("map?", IsMap)
-        EXP_FUNC("sequence?", IsSequence)
-        EXP_FUNC("number?", IsNumber)
-        EXP_FUNC("atom", NewAtom)
-        EXP_FUNC("atom?", IsAtom)
-        EXP_FUNC("symbol", NewSymbol)
-        EXP_FUNC("symbol?", IsSymbol)
-        EXP_FUNC("string?", IsString)
-        EXP_FUNC("keyword", NewKeyword)
-        EXP_FUNC("keyword?", IsKeyword)
-        EXP_FUNC("deref", Deref)
-        EXP_FUNC("reset!", RefSet)
-        EXP_FUNC("empty?", IsEmpty)
-        EXP_FUNC("count", ElementCount)
-        EXP_FUNC("first", First)
-        EXP_FUNC("rest", Rest)
-        EXP_FUNC("nth", GetElement)
-        EXP_FUNC("cons", Cons)
-        EXP_FUNC("concat", Concat)
-        EXP_FUNC("assoc", MapAssoc)
-        EXP_FUNC("dissoc", MapDissoc)
-        EXP_FUNC("get", MapGet)
-        EXP_FUNC("contains?", MapContains)
-        EXP_FUNC("keys", MapKeys)
-        EXP_FUNC("vals", MapValues)
-        EXP_FUNC("=", IsEqual)
-        EXP_FUNC("list-equal", EqList)
-        EXP_FUNC("<", CmpLT)
-        EXP_FUNC("<=", CmpLE)
-        EXP_FUNC(">", CmpGT)
-        EXP_FUNC(">=", CmpGE)
-        EXP_FUNC("pr-str", PFormat)
-        EXP_FUNC("str", StrCat)
-        EXP_FUNC("prn", PPrint)
-        EXP_FUNC("println", PrintLn)
-        EXP_FUNC("read-string", ReadString)
-        EXP_FUNC("substr", Substr)
-        EXP_FUNC("char-index", CharIdx)
-        EXP_FUNC("eval", DoEval)
-        EXP_FUNC("throw", DoThrow)
-        EXP_FUNC("apply", Apply)
-        EXP_FUNC("meta", GetMeta)
-        EXP_FUNC("with-meta", WithMeta)
-        EXP_FUNC("ref-count", GetRefcount)
-        EXP_FUNC("intern", Intern)
-        EXP_FUNC("get-system-info", GetSystem)
+        Environment& env = *env_global;
+        DefineBuiltin<Add, Add2>(env, "+");
+        DefineBuiltin<Sub, Sub2>(env, "-");
+        DefineBuiltin<Mul, Mul2>(env, "*");
+        DefineBuiltin<Div, Div2>(env, "/");
+        DefineBuiltin<Mod>(env, "mod");
+        DefineBuiltin<NewList>(env, "list");
+        DefineBuiltin<IsAny<mh::is_list>, Is<mh::is_list>>(env, "list?");
+        DefineBuiltin<NewVector>(env, "vector");
+        DefineBuiltin<IsAny<mh::is_vector>, Is<mh::is_vector>>(env, "vector?");
+        DefineBuiltin<NewMap>(env, "hash-map");
+        DefineBuiltin<IsAny<mh::is_map>, Is<mh::is_map>>(env, "map?");
+        DefineBuiltin<IsAny<mh::is_sequence>, Is<mh::is_sequence>>(env, "sequence?");
+        DefineBuiltin<IsAny<mh::is_num>, Is<mh::is_num>>(env, "number?");
+        DefineBuiltin<NewAtom>(env, "atom");
+        DefineBuiltin<IsAny<mh::is_atom>, Is<mh::is_atom>>(env, "atom?");
+        DefineBuiltin<NewSymbol>(env, "symbol");
+        DefineBuiltin<IsAny<mh::is_symbol>, Is<mh::is_symbol>>(env, "symbol?");
+        DefineBuiltin<IsAny<mh::is_string>, Is<mh::is_string>>(env, "string?");
+        DefineBuiltin<NewKeyword>(env, "keyword");
+        DefineBuiltin<IsAny<mh::is_keyword>, Is<mh::is_keyword>>(env, "keyword?");
+        DefineBuiltin<Deref>(env, "deref");
+        DefineBuiltin<RefSet>(env, "reset!");
+        DefineBuiltin<IsEmptyAny, IsEmpty>(env, "empty?");
+        DefineBuiltin<ElementCountAny, ElementCount>(env, "count");
+        DefineBuiltin<First>(env, "first");
+        DefineBuiltin<Rest>(env, "rest");
+        DefineBuiltin<GetElement>(env, "nth");
+        DefineBuiltin<Cons>(env, "cons");
+        DefineBuiltin<Concat>(env, "concat");
+        DefineBuiltin<Conj>(env, "conj");
+        DefineBuiltin<MapAssoc>(env, "assoc");
+        DefineBuiltin<MapDissoc>(env, "dissoc");
+        DefineBuiltin<MapGet>(env, "get");
+        DefineBuiltin<MapContains>(env, "contains?");
+        DefineBuiltin<MapKeys>(env, "keys");
+        DefineBuiltin<MapValues>(env, "vals");
+        DefineBuiltin<IsEqual>(env, "=");
+        DefineBuiltin<EqList>(env, "list-equal");
+        DefineBuiltin<CmpLT>(env, "<");
+        DefineBuiltin<CmpLE>(env, "<=");
+        DefineBuiltin<CmpGT>(env, ">");
+        DefineBuiltin<CmpGE>(env, ">=");
+        DefineBuiltin<PFormat>(env, "pr-str");
+        DefineBuiltin<StrCat>(env, "str");
+        DefineBuiltin<PPrint>(env, "prn");
+        DefineBuiltin<PrintLn>(env, "println");
+        DefineBuiltin<ReadString>(env, "read-string");
+        DefineBuiltin<Substr>(env, "substr");
+        DefineBuiltin<CharIdx>(env, "char-index");
+        DefineBuiltin<DoEval>(env, "eval");
+        DefineBuiltin<DoThrow>(env, "throw");
+        DefineBuiltin<DoApply>(env, "apply");
+        DefineBuiltin<GetMetadata>(env, "meta");
+        DefineBuiltin<WithMeta>(env, "with-meta");
+        DefineBuiltin<GetRefcount>(env, "ref-count");
+        DefineBuiltin<Intern>(env, "intern");
+        DefineBuiltin<GetSystem>(env, "get-system-info");
+        DefineBuiltin<GetCallStack>(env, "call-stack");
+        DefineBuiltin<CollectCycles>(env, "collect-cycles");
 #       if (ENABLE_FS)
-        EXP_FUNC("slurp", Slurp)
-        EXP_FUNC("load-library", LoadLibrary)
+        DefineBuiltin<Slurp>(env, "slurp");
+        DefineBuiltin<LoadLibrary>(env, "load-library");
 #       endif
+
+        for (const char* name : {"+", "-", "*", "/", "mod", "list", "list?", "vector", "vector?", "hash-map", "map?",
+                "sequence?", "number?", "atom?", "symbol", "symbol?", "string?", "keyword", "keyword?", "empty?", "count",
+                "first", "rest", "nth", "cons", "concat", "conj", "assoc", "dissoc", "get", "contains?", "keys", "vals", "=",
+                "list-equal", "<", "<=", ">", ">=", "substr", "char-index"})
+            pure_builtins.insert(env_global->lookup(name).blt);
+
+        quasiquote_cons = env_global->cell("cons");
+        quasiquote_concat = env_global->cell("concat");
     }
 }
\ No newline at end of file
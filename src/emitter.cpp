@@ -0,0 +1,599 @@
+#include "aot.hpp"
+#include "reader.hpp"
+
+#include <algorithm>
+#include <sstream>
+
+namespace {
+    using namespace mal;
+
+    // Raised when a function body uses a form the emitter doesn't translate (def, fn, try*, map literals, ...)
+    // The definition is then left to the interpreter
+    struct Unsupported {};
+
+    // C++ expression of a translated subexpression, evaluating it has no side effects
+    struct Value {
+        std::string expr;
+        bool temporary = false; // Names a temporary used only once, so it can be moved from
+
+        std::string Take() const {
+            return temporary ? "std::move(" + expr + ")" : expr;
+        }
+    };
+
+    // A top-level definition of a function, which is compiled
+    struct Definition {
+        std::size_t form;
+        std::string name;
+        std::vector<MalString::string_t> params;
+        MalAtom body;
+    };
+
+    // Writes a string as a C++ literal, split at line breaks
+    std::string Literal(const std::string& str) {
+        std::string res = "\"";
+        for (unsigned char ch : str) {
+            switch (ch) {
+                case '\\': res += "\\\\"; break;
+                case '"': res += "\\\""; break;
+                case '\t': res += "\\t"; break;
+                case '\n': res += "\\n\"\n    \""; break;
+                default:
+                    if (ch < 0x20 || ch >= 0x7f) {
+                        const char digits[] = {'\\', char('0' + (ch >> 6)), char('0' + ((ch >> 3) & 7)), char('0' + (ch & 7)), '\0'};
+                        res += digits;
+                    } else
+                        res += ch;
+            }
+        }
+        return res + "\"";
+    }
+
+    const char* IntOpName(IntOp op) {
+        switch (op) {
+            case IntOp::Add: return "Add";
+            case IntOp::Sub: return "Sub";
+            case IntOp::Mul: return "Mul";
+            case IntOp::Div: return "Div";
+            case IntOp::Mod: return "Mod";
+            case IntOp::Lt: return "Lt";
+            case IntOp::Le: return "Le";
+            case IntOp::Gt: return "Gt";
+            case IntOp::Ge: return "Ge";
+            case IntOp::Eq: return "Eq";
+        }
+        return "";
+    }
+
+    // Constants are printed and read back when the program starts, so they must consist of readable values
+    bool IsReadable(const MalValue& val) {
+        switch (val.tag) {
+            case Nil_T:
+            case True_T:
+            case False_T:
+            case Int_T:
+            case Bigint_T:
+            case String_T:
+            case Keyword_T:
+            case Symbol_T:
+                return true;
+            case List_T:
+            case Vector_T:
+                for (ListIterator it = mh::as_list(val); it; ++it) {
+                    if (!IsReadable(*it))
+                        return false;
+                }
+                return true;
+            default:
+                return false;
+        }
+    }
+
+    // Constants, global cells and builtins referred to by the compiled functions of a script
+    // They are resolved by the init function of the emitted program
+    class Unit {
+        static std::size_t Add(std::vector<std::string>& table, const std::string& entry) {
+            auto it = std::find(table.begin(), table.end(), entry);
+            if (it != table.end())
+                return it - table.begin();
+            table.push_back(entry);
+            return table.size() - 1;
+        }
+    public:
+        Interpreter& interp;
+        std::vector<Definition> definitions;
+        // Names bound more than once by the script, their values at compile time tell nothing about later calls
+        std::vector<std::string> redefined;
+        // Names the script binds to macros, compiled code can't expand calls of them at runtime
+        std::vector<std::string> macros;
+        std::vector<std::string> constants; // Printed values
+        std::vector<std::string> cells;     // Global names
+        std::vector<std::string> builtins;  // Names the builtins were defined with
+
+        Unit(Interpreter& interp, std::vector<Definition> definitions, std::vector<std::string> redefined, std::vector<std::string> macros)
+            : interp{interp}, definitions{std::move(definitions)}, redefined{std::move(redefined)}, macros{std::move(macros)} {}
+
+        bool IsRedefined(const std::string& name) const {
+            return std::find(redefined.begin(), redefined.end(), name) != redefined.end();
+        }
+
+        std::string Constant(const MalValue& val) {
+            StringBuilder printed{false};
+            printed.Append(val);
+            return "k" + std::to_string(Add(constants, printed.Get())) + ".v";
+        }
+
+        std::string Cell(const std::string& name) {
+            return "c" + std::to_string(Add(cells, name));
+        }
+
+        std::string BuiltinRef(const Builtin* blt) {
+            return "b" + std::to_string(Add(builtins, blt->name));
+        }
+
+        // Returns the index of the compiled definition of `name`
+        std::size_t Find(const std::string& name) const {
+            for (std::size_t i = 0; i < definitions.size(); ++i) {
+                if (definitions[i].name == name)
+                    return i;
+            }
+            return definitions.size();
+        }
+    };
+
+    // Translates the body of a compiled definition into the body of a C++ function
+    //
+    // Subexpressions are evaluated into temporaries in the order of the interpreter, their values are
+    // passed on as C++ expressions without side effects (see: Value). Local bindings are never rebound,
+    // so let* bindings are aliases of the values of their expressions. Self tail calls rebind the
+    // parameters and restart the body, which is then wrapped in a loop
+    class Translator {
+        Unit& unit;
+        std::size_t self;
+        std::ostringstream out;
+        std::size_t indent = 3; // Function body in a loop
+        std::vector<std::pair<std::string, Value>> locals;
+        std::size_t temps = 0;
+        std::size_t expanding = 0; // Nesting of the macro expansions being translated
+        static constexpr std::size_t MAX_EXPANSION_DEPTH = 100;
+
+        void Line(const std::string& line) {
+            out << std::string(4 * indent, ' ') << line << '\n';
+        }
+
+        std::string Temp(const char* prefix = "t") {
+            return prefix + std::to_string(temps++);
+        }
+
+        // Declares a temporary holding the value of a C++ expression
+        Value Hoist(const std::string& expr) {
+            std::string t = Temp();
+            Line("MalValue " + t + " = " + expr + ";");
+            return Value{t, true};
+        }
+
+        // Returns the value from the function if `tail` is set
+        Value Result(Value val, bool tail) {
+            if (!tail)
+                return val;
+            Line("return " + val.Take() + ";");
+            return Value{};
+        }
+
+        Value Result(const std::string& expr, bool tail) {
+            if (!tail)
+                return Hoist(expr);
+            Line("return " + expr + ";");
+            return Value{};
+        }
+
+        const Value* Local(const std::string& name) const {
+            for (auto it = locals.rbegin(); it != locals.rend(); ++it) {
+                if (it->first == name)
+                    return &it->second;
+            }
+            return nullptr;
+        }
+
+        Value Constant(const MalValue& val) {
+            switch (val.tag) {
+                case Nil_T: return Value{"mh::nil"};
+                case True_T: return Value{"mh::bool_val(true)"};
+                case False_T: return Value{"mh::bool_val(false)"};
+                case Int_T:
+                    // The minimal fixnum has no literal, it's read back like bignums
+                    if (val.no != std::numeric_limits<std::int64_t>::min())
+                        return Value{"mh::num(" + std::to_string(val.no) + "LL)"};
+                    return Value{unit.Constant(val)};
+                case Builtin_T: return Value{"mh::builtin(" + unit.BuiltinRef(val.blt) + ")"};
+                default:
+                    // Atoms and functions placed in the code by macros have no printed form
+                    if (!IsReadable(val))
+                        throw Unsupported{};
+                    return Value{unit.Constant(val)};
+            }
+        }
+
+        // Evaluates the arguments of a call `args` into an array
+        std::string ArgumentArray(const Ref<MalList>& args) {
+            std::vector<Value> values;
+            for (ListIterator it = args; it; ++it)
+                values.push_back(Expression(*it, false));
+            if (values.empty())
+                return "nullptr";
+            std::string array = Temp("a"), init;
+            for (const Value& v : values)
+                init += (init.empty() ? "" : ", ") + v.Take();
+            Line("MalValue " + array + "[] = {" + init + "};");
+            return array;
+        }
+
+        Value Form(SpecialForm form, const MalValue& expr, bool tail);
+        Value Call(const MalValue& expr, bool tail);
+        Value SelfTailCall(const Ref<MalList>& args, const std::string& cell);
+    public:
+        bool loop = false; // The body restarts on self tail calls
+
+        Translator(Unit& unit, std::size_t self) : unit{unit}, self{self} {
+            const Definition& def = unit.definitions[self];
+            for (std::size_t i = 0; i < def.params.size(); ++i)
+                locals.emplace_back(def.params[i], Value{"p" + std::to_string(i) + ".v"});
+        }
+
+        // Emits statements evaluating `expr`, returns its value or returns it from the function if `tail` is set
+        Value Expression(const MalValue& expr, bool tail);
+
+        std::string Body() const {
+            return out.str();
+        }
+    };
+
+    Value Translator::Expression(const MalValue& expr, bool tail) {
+        switch (expr.tag) {
+            case Symbol_T:
+                if (const Value* local = Local(expr.st->Get()))
+                    return Result(*local, tail);
+                return Result(unit.Cell(expr.st->Get()) + "->get()", tail);
+            case Vector_T: {
+                std::vector<Value> values;
+                for (ListIterator it = mh::as_list(expr); it; ++it)
+                    values.push_back(Expression(*it, false));
+                std::string args;
+                for (const Value& v : values)
+                    args += (args.empty() ? "" : ", ") + v.Take();
+                return Result("aot::Vector(aot::Args(" + args + "))", tail);
+            }
+            case List_T:
+                if (expr.li == nullptr)
+                    return Result(Constant(expr), tail);
+                if (mh::is_symbol(expr.li->First())) {
+                    SpecialForm form = expr.li->First().st->Form();
+                    if (form != SpecialForm::None)
+                        return Form(form, expr, tail);
+                }
+                return Call(expr, tail);
+            case Map_T:
+                throw Unsupported{};
+            default:
+                return Result(Constant(expr), tail);
+        }
+    }
+
+    Value Translator::Form(SpecialForm form, const MalValue& expr, bool tail) {
+        const auto& args = expr.li->Rest();
+        std::size_t argc = args ? args->GetSize() : 0;
+        switch (form) {
+            case SpecialForm::If: {
+                if (argc != 2 && argc != 3)
+                    throw Unsupported{};
+                Value cond = Expression(args->At(0), false);
+                std::string result = tail ? "" : Temp();
+                if (!tail)
+                    Line("MalAtom " + result + ";");
+                Line("if (aot::IsTrue(" + cond.expr + ")) {");
+                for (std::size_t branch = 1; branch <= 2; ++branch) {
+                    ++indent;
+                    Value v = branch < argc ? Expression(args->At(branch), tail) : Result(Value{"mh::nil"}, tail);
+                    if (!tail)
+                        Line(result + " = " + v.Take() + ";");
+                    --indent;
+                    Line(branch == 1 ? "} else {" : "}");
+                }
+                return Value{result + ".v", !tail};
+            }
+            case SpecialForm::Do: {
+                if (argc == 0)
+                    return Result(Value{"mh::nil"}, tail);
+                for (ListIterator it = args; it; ) {
+                    MalValue e = *it;
+                    ++it;
+                    if (!it)
+                        return Expression(e, tail);
+                    Expression(e, false);
+                }
+                return Value{};
+            }
+            case SpecialForm::Let: {
+                if (argc != 2 || args->At(0).tag != List_T)
+                    throw Unsupported{};
+                std::size_t outer = locals.size();
+                for (ListIterator it = args->At(0).li; it; ++it) {
+                    MalValue key = *it;
+                    ++it;
+                    if (key.tag != Symbol_T || !it)
+                        throw Unsupported{};
+                    Value v = Expression(*it, false);
+                    // Aliases may be used more than once
+                    locals.emplace_back(key.st->Get(), Value{v.expr});
+                }
+                Value v = Expression(args->At(1), tail);
+                locals.resize(outer);
+                return v;
+            }
+            case SpecialForm::Quote:
+                if (argc != 1)
+                    throw Unsupported{};
+                return Result(Constant(args->First()), tail);
+            case SpecialForm::Quasiquote:
+                if (argc != 1)
+                    throw Unsupported{};
+                return Expression(unit.interp.QuasiQuote(args->First()), tail);
+            default:
+                // def, fn, macro, try*, macroexpand & the loops
+                throw Unsupported{};
+        }
+    }
+
+    Value Translator::Call(const MalValue& expr, bool tail) {
+        const MalValue& head = expr.li->First();
+        const auto& args = expr.li->Rest();
+        std::size_t argc = args ? args->GetSize() : 0;
+        if (mh::is_symbol(head) && Local(head.st->Get()) == nullptr) {
+            const std::string& name = head.st->Get();
+            std::size_t def = unit.Find(name);
+            if (def != unit.definitions.size()) {
+                if (unit.definitions[def].params.size() == argc) {
+                    if (def == self && tail)
+                        return SelfTailCall(args, unit.Cell(name));
+                    std::string array = ArgumentArray(args);
+                    return Result("aot::Direct(interp, *" + unit.Cell(name) + ", d" + std::to_string(def) + ", " + array + ", " + std::to_string(argc) + ")", tail);
+                }
+            } else if (unit.IsRedefined(name)) {
+                if (std::find(unit.macros.begin(), unit.macros.end(), name) != unit.macros.end())
+                    throw Unsupported{};
+            } else if (const MalAtom* bound = unit.interp.env_global->find(name)) {
+                const MalValue& callee = bound->v;
+                if (callee.tag == Function_T && callee.fun->kind == MalFunction::KMacro) {
+                    if (expanding == MAX_EXPANSION_DEPTH)
+                        throw Unsupported{};
+                    MalAtom expansion;
+                    try {
+                        expansion = unit.interp.ExpandMacro(expr, callee.fun);
+                    } catch (const mal_error&) {
+                        throw Unsupported{};
+                    }
+                    ++expanding;
+                    Value v = Expression(expansion.v, tail);
+                    --expanding;
+                    return v;
+                }
+                IntOp op;
+                if (callee.tag == Builtin_T && argc == 2 && LookupIntOp(callee.blt->name, op)) {
+                    Value a = Expression(args->At(0), false);
+                    Value b = Expression(args->At(1), false);
+                    return Result(std::string{"aot::Int<IntOp::"} + IntOpName(op) + ">(interp, *" + unit.Cell(name) + ", *"
+                        + unit.BuiltinRef(callee.blt) + ", " + a.expr + ", " + b.expr + ")", tail);
+                }
+                if (callee.tag == Builtin_T && callee.blt->direct != nullptr && callee.blt->arity == argc) {
+                    std::string array = ArgumentArray(args);
+                    return Result("aot::Direct(interp, *" + unit.Cell(name) + ", *" + unit.BuiltinRef(callee.blt) + ", " + array + ", " + std::to_string(argc) + ")", tail);
+                }
+            }
+        }
+        // The callee is evaluated before the arguments
+        Value callee = Expression(head, false);
+        std::vector<Value> values;
+        for (ListIterator it = args; it; ++it)
+            values.push_back(Expression(*it, false));
+        std::string call_args;
+        for (const Value& v : values)
+            call_args += (call_args.empty() ? "" : ", ") + v.Take();
+        return Result("aot::Call(interp, " + callee.expr + ", aot::Args(" + call_args + "))", tail);
+    }
+
+    Value Translator::SelfTailCall(const Ref<MalList>& args, const std::string& cell) {
+        std::string array = ArgumentArray(args);
+        std::string def = "d" + std::to_string(self);
+        std::size_t argc = unit.definitions[self].params.size();
+        // The arguments were copied, so they may refer to the parameters
+        Line("if (aot::Holds(*" + cell + ", " + def + ")) {");
+        for (std::size_t i = 0; i < argc; ++i)
+            Line("    p" + std::to_string(i) + " = std::move(" + array + "[" + std::to_string(i) + "]);");
+        Line("    continue;");
+        Line("}");
+        Line("return aot::Direct(interp, *" + cell + ", " + def + ", " + array + ", " + std::to_string(argc) + ");");
+        loop = true;
+        return Value{};
+    }
+
+    bool ContainsForm(const MalValue& expr, SpecialForm form) {
+        if (mh::is_symbol(expr))
+            return expr.st->Form() == form;
+        if (!mh::is_sequence(expr))
+            return false;
+        for (ListIterator it = mh::as_list(expr); it; ++it) {
+            if (ContainsForm(*it, form))
+                return true;
+        }
+        return false;
+    }
+
+    // Collects names bound by `def` to values made by `macro` forms
+    void CollectMacroDefs(const MalValue& expr, std::vector<std::string>& names) {
+        if (!mh::is_fseq(expr))
+            return;
+        const auto& l = mh::as_list(expr);
+        if (expr.tag == List_T && mh::is_symbol(l->First()) && l->First().st->Form() == SpecialForm::Def
+                && mh::is_symbol(l->At(1)) && ContainsForm(l->At(2), SpecialForm::Macro))
+            names.push_back(l->At(1).st->Get());
+        for (ListIterator it = l; it; ++it)
+            CollectMacroDefs(*it, names);
+    }
+
+    // Returns the compiled definition of a top-level form `(def name (fn (params...) body))`
+    bool ParseDefinition(const MalValue& form, std::size_t index, Definition& def) {
+        if (!mh::is_flist(form) || form.li->GetSize() != 3 || !mh::is_symbol(form.li->First())
+                || form.li->First().st->Form() != SpecialForm::Def || !mh::is_symbol(form.li->At(1)))
+            return false;
+        const MalValue& fn = form.li->At(2);
+        if (!mh::is_flist(fn) || fn.li->GetSize() != 3 || !mh::is_symbol(fn.li->First()) || fn.li->First().st->Form() != SpecialForm::Fn)
+            return false;
+        MalString::string_t param_var;
+        try {
+            ParseParameters(fn.li->At(1), def.params, param_var);
+        } catch (const mal_error&) {
+            return false;
+        }
+        def.form = index;
+        def.name = form.li->At(1).st->Get();
+        def.body = fn.li->At(2);
+        return param_var.empty();
+    }
+
+    // Translates a function, returns false if its body is not supported
+    bool Translate(Unit& unit, std::size_t index, std::string& body, bool& loop) {
+        Translator translator{unit, index};
+        try {
+            translator.Expression(unit.definitions[index].body.v, true);
+        } catch (const Unsupported&) {
+            return false;
+        }
+        body = translator.Body();
+        loop = translator.loop;
+        return true;
+    }
+}
+
+namespace mal {
+    void EmitProgram(Interpreter& interp, const std::string& bootstrap, const std::string& script_name, const std::string& script, std::ostream& out) {
+        MalValue forms = ReadForm("(" + script + ")", &interp.str_interner);
+        if (!mh::is_sequence(forms))
+            throw mal_error{"Cannot read the script"};
+
+        // Macros and the functions they use are defined, function bodies are only expanded
+        std::vector<std::string> defined, redefined, macros;
+        CollectDefs(forms, defined);
+        CollectMacroDefs(forms, macros);
+        for (const std::string& name : defined) {
+            if (std::count(defined.begin(), defined.end(), name) > 1 && std::count(redefined.begin(), redefined.end(), name) == 0)
+                redefined.push_back(name);
+        }
+        std::vector<Definition> definitions;
+        std::size_t index = 0;
+        for (ListIterator it = forms.li; it; ++it, ++index) {
+            const MalValue form = *it;
+            if (!mh::is_flist(form) || form.li->GetSize() != 3 || !mh::is_symbol(form.li->First()) || form.li->First().st->Form() != SpecialForm::Def
+                    || !mh::is_flist(form.li->At(2)) || !mh::is_symbol(form.li->At(2).li->First()))
+                continue;
+            SpecialForm kind = form.li->At(2).li->First().st->Form();
+            if (kind != SpecialForm::Fn && kind != SpecialForm::Macro)
+                continue;
+            try {
+                interp.EvaluateExpression(form, interp.env_global);
+            } catch (const mal_error&) {
+                continue;
+            }
+            Definition def;
+            IntOp op;
+            // Names bound more than once are left to the interpreter, and so are names of arithmetic builtins,
+            // which the VM identifies by name (see: LookupIntOp)
+            if (ParseDefinition(form, index, def) && std::count(redefined.begin(), redefined.end(), def.name) == 0 && !LookupIntOp(def.name, op))
+                definitions.push_back(std::move(def));
+        }
+
+        // Unsupported bodies don't depend on other definitions, so the first pass finds all of them
+        {
+            Unit probe{interp, definitions, redefined, macros};
+            std::vector<Definition> supported;
+            for (std::size_t i = 0; i < definitions.size(); ++i) {
+                std::string body;
+                bool loop;
+                if (Translate(probe, i, body, loop))
+                    supported.push_back(std::move(definitions[i]));
+            }
+            definitions = std::move(supported);
+        }
+        Unit unit{interp, std::move(definitions), std::move(redefined), std::move(macros)};
+        std::vector<std::string> bodies(unit.definitions.size());
+        std::vector<bool> loops(unit.definitions.size());
+        for (std::size_t i = 0; i < unit.definitions.size(); ++i) {
+            bool loop = false;
+            Translate(unit, i, bodies[i], loop);
+            loops[i] = loop;
+        }
+
+        out << "// Generated by mal_repl --emit-cpp from " << script_name << "\n"
+            << "#include \"aot.hpp\"\n\n"
+            << "namespace {\n"
+            << "    using namespace mal;\n\n";
+        for (std::size_t i = 0; i < unit.constants.size(); ++i)
+            out << "    MalAtom k" << i << ";\n";
+        for (std::size_t i = 0; i < unit.cells.size(); ++i)
+            out << "    GlobalCell* c" << i << ";\n";
+        for (std::size_t i = 0; i < unit.builtins.size(); ++i)
+            out << "    const Builtin* b" << i << ";\n";
+        out << "\n";
+        for (std::size_t i = 0; i < unit.definitions.size(); ++i) {
+            const Definition& def = unit.definitions[i];
+            out << "    // " << def.name << "\n"
+                << "    MalValue f" << i << "(Interpreter& interp, MalValue* args);\n"
+                << "    MalValue g" << i << "(Interpreter& interp, MalArgs&& args);\n"
+                << "    Builtin d" << i << "{g" << i << ", f" << i << ", " << def.params.size() << ", " << Literal(def.name) << "};\n\n";
+        }
+
+        out << "    void Init([[maybe_unused]] Interpreter& interp) {\n";
+        for (std::size_t i = 0; i < unit.constants.size(); ++i)
+            out << "        k" << i << " = aot::Constant(interp, " << Literal(unit.constants[i]) << ");\n";
+        for (std::size_t i = 0; i < unit.cells.size(); ++i)
+            out << "        c" << i << " = interp.env_global->cell(" << Literal(unit.cells[i]) << ").get();\n";
+        for (std::size_t i = 0; i < unit.builtins.size(); ++i)
+            out << "        b" << i << " = aot::FindBuiltin(interp, " << Literal(unit.builtins[i]) << ");\n";
+        out << "    }\n";
+
+        for (std::size_t i = 0; i < unit.definitions.size(); ++i) {
+            const Definition& def = unit.definitions[i];
+            out << "\n    MalValue f" << i << "([[maybe_unused]] Interpreter& interp, [[maybe_unused]] MalValue* args) {\n"
+                << "        aot::StackGuard guard;\n";
+            for (std::size_t p = 0; p < def.params.size(); ++p)
+                out << "        MalAtom p" << p << "{std::move(args[" << p << "])};\n";
+            if (loops[i]) {
+                out << "        for (;;) {\n";
+                out << bodies[i];
+                out << "        }\n";
+            } else {
+                // Without the loop the body is one level shallower
+                std::istringstream lines{bodies[i]};
+                for (std::string line; std::getline(lines, line);)
+                    out << line.substr(4) << "\n";
+            }
+            out << "    }\n\n"
+                << "    MalValue g" << i << "(Interpreter& interp, MalArgs&& args) {\n"
+                << "        return aot::Generic(interp, d" << i << ", std::move(args));\n"
+                << "    }\n";
+        }
+        out << "}\n\n"
+            << "int main(int argc, char** argv) {\n"
+            << "    mal::aot::Program program{\n"
+            << "        " << Literal(bootstrap) << ",\n"
+            << "        " << Literal(script_name) << ",\n"
+            << "        " << Literal(script) << ",\n"
+            << "        {";
+        for (std::size_t i = 0; i < unit.definitions.size(); ++i)
+            out << (i == 0 ? "" : ", ") << "{" << unit.definitions[i].form << ", &d" << i << "}";
+        out << "},\n"
+            << "        Init,\n"
+            << "    };\n"
+            << "    return mal::aot::Run(program, argc, argv);\n"
+            << "}\n";
+    }
+}
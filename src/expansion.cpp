@@ -0,0 +1,84 @@
+#include "interpreter.hpp"
+
+namespace mal {
+    // Macro calls are expanded once per call site: the expansion is cached, keyed by the
+    // identity of the call form, and reused as long as the callee evaluates to the same macro
+    // Redefining the macro binding makes the callee evaluate to another function, so the form is expanded again
+
+    const MalValue* Interpreter::CachedExpansion(const MalValue& form, const MalFunction& macro) const {
+        auto entry = expansions.find(form.li.get());
+        if (entry == expansions.end() || entry->second.macro.get() != &macro || entry->second.form.expired())
+            return nullptr;
+        return &entry->second.value.v;
+    }
+
+    void Interpreter::CacheExpansion(const MalValue& form, Ref<MalFunction> macro, const MalValue& expansion) {
+        PruneForms(expansions, expansions_pruned, &Expansion::form);
+        auto& entry = expansions[form.li.get()];
+        entry.form = form.li;
+        entry.macro = std::move(macro);
+        entry.value = expansion;
+    }
+
+    MalValue Interpreter::ExpandMacro(const MalValue& form, const Ref<MalFunction>& macro) {
+        if (const MalValue* expansion = CachedExpansion(form, *macro))
+            return *expansion;
+        MalValue expansion = EvalFunction(*macro, form.li->Rest());
+        CacheExpansion(form, macro, expansion);
+        return expansion;
+    }
+
+    // Expands macro calls of a function body ahead of time, including macro calls in the expansions
+    // Callees are resolved in the defining environment; if they evaluate to another value at runtime,
+    // the cached expansion is simply not used. Failing expansions are left for the runtime
+    void Interpreter::PreExpand(const MalValue& expr, const EnvironFrame& env, std::size_t depth) {
+        if (!mh::is_fseq(expr) || depth > MAX_RECURSION_DEPTH)
+            return;
+        const auto& elements = mh::as_list(expr);
+        const MalValue& head = elements->First();
+        if (expr.tag == List_T && mh::is_symbol(head)) {
+            switch (head.st->Form()) {
+                case SpecialForm::Quote:
+                case SpecialForm::Quasiquote:
+                    return;
+                case SpecialForm::Let:
+                case SpecialForm::Loop:
+                    if (mh::is_sequence(expr.li->At(1))) {
+                        for (ListIterator it = mh::as_list(expr.li->At(1)); it; ++it) {
+                            ++it; // Skip the name
+                            PreExpand(*it, env, depth + 1);
+                        }
+                    }
+                    PreExpand(expr.li->At(2), env, depth + 1);
+                    return;
+                case SpecialForm::Fn:
+                case SpecialForm::Macro:
+                    PreExpand(expr.li->At(2), env, depth + 1);
+                    return;
+                case SpecialForm::Dotimes:
+                    if (mh::is_flist(expr.li->At(1)))
+                        PreExpand(expr.li->At(1).li->At(1), env, depth + 1);
+                    PreExpand(expr.li->At(2), env, depth + 1);
+                    return;
+                case SpecialForm::None:
+                case SpecialForm::Unresolved: {
+                    const MalAtom* callee = env->find(head.st->Get());
+                    if (callee == nullptr || callee->v.tag != Function_T || callee->v.fun->kind != MalFunction::KMacro)
+                        break;
+                    MalAtom expansion;
+                    try {
+                        expansion = ExpandMacro(expr, callee->v.fun);
+                    } catch (const mal_error&) {
+                        return;
+                    }
+                    PreExpand(expansion.v, env, depth + 1);
+                    return;
+                }
+                default:
+                    break;
+            }
+        }
+        for (ListIterator it = elements; it; ++it)
+            PreExpand(*it, env, depth + 1);
+    }
+}
@@ -0,0 +1,336 @@
+#include "interpreter.hpp"
+
+#include <algorithm>
+
+namespace {
+    using namespace mal;
+
+    // Classes of code values, from the most to the least foldable
+    enum Purity {
+        Constant, // Evaluation has no side effects and the value doesn't depend on the environment
+        Pure,     // Evaluation has no side effects, but the value depends on local variables
+        Impure,
+    };
+
+    inline Purity Join(Purity a, Purity b) {
+        return std::max(a, b);
+    }
+
+    // Macro expansions may bind any name mentioned in their arguments with `def`
+    void CollectMacroNames(const Environment& global, const MalValue& expr, std::vector<std::string>& names) {
+        if (expr.tag == Symbol_T) {
+            names.push_back(expr.st->Get());
+            return;
+        }
+        if (!mh::is_fseq(expr))
+            return;
+        const auto& elements = mh::as_list(expr);
+        const MalValue& head = elements->First();
+        if (expr.tag == List_T && mh::is_symbol(head)) {
+            if (head.st->Form() == SpecialForm::Quote)
+                return;
+            const MalAtom* callee = global.find(head.st->Get());
+            if (callee != nullptr && callee->v.tag == Function_T && callee->v.fun->kind == MalFunction::KMacro) {
+                for (ListIterator it = expr.li->Rest(); it; ++it)
+                    CollectMacroNames(global, *it, names);
+                return;
+            }
+        }
+        for (ListIterator it = elements; it; ++it) {
+            if (mh::is_sequence(*it))
+                CollectMacroNames(global, *it, names);
+        }
+    }
+
+    // Finds constant subexpressions of code values and marks them in the fold table of the interpreter
+    // Only the outermost constant expressions are marked, the first evaluation of a marked
+    // expression stores its value in the mark (see: Interpreter/ReadFold())
+    //
+    // Global bindings are assumed to keep their values, unless they have already been redefined.
+    // Cells the analysis relies on are pinned, so redefining them increments the epoch of the
+    // global environment, which invalidates all marks made before
+    //
+    // The analysis knows which names are free, so it also registers calls of global names
+    // for the inline caches of the tree-walker (see: Interpreter/RegisterCallSite())
+    class Folder {
+        Interpreter& interp;
+        Environment& global;
+        // Parameters and let* bindings of the current point
+        std::vector<std::string> locals;
+        // Names which may be bound in local environments at runtime
+        std::vector<std::string> shadows;
+        // Global names referred to by the expressions being analyzed
+        std::vector<std::string> names;
+        // Constant subexpressions of the expressions being analyzed, with the range of their names
+        struct Folded {
+            const MalValue* expr;
+            std::size_t first, last;
+        };
+        std::vector<Folded> constants;
+
+        bool IsLocal(const std::string& name) const {
+            return std::find(locals.rbegin(), locals.rend(), name) != locals.rend()
+                || std::find(shadows.begin(), shadows.end(), name) != shadows.end();
+        }
+
+        // Returns the value of a global binding, which is assumed to be constant
+        const MalValue* Global(const std::string& name) {
+            auto entry = global.cells.find(name);
+            if (entry == global.cells.end() || !entry->second->bound || entry->second->redefined)
+                return nullptr;
+            entry->second->pinned = true;
+            names.push_back(name);
+            return &entry->second->value.v;
+        }
+
+        // Constant expressions are marked only if evaluating them takes some work
+        static bool Worth(const MalValue& expr) {
+            if (!mh::is_fseq(expr))
+                return false;
+            if (expr.tag == Vector_T)
+                return true;
+            const MalValue& head = expr.li->First();
+            return !mh::is_symbol(head) || head.st->Form() != SpecialForm::Quote;
+        }
+
+        void Mark(const Folded& c) {
+            std::vector<std::string> free;
+            for (std::size_t i = c.first; i < c.last; ++i) {
+                if (std::find(free.begin(), free.end(), names[i]) == free.end())
+                    free.push_back(names[i]);
+            }
+            interp.MarkFold(*c.expr, std::move(free));
+        }
+
+        // Analyzes a subexpression, constant subexpressions are kept in `constants` until
+        // the analysis of the enclosing expression decides whether they have to be marked
+        Purity Sub(const MalValue& expr) {
+            std::size_t first = names.size();
+            Purity p = Analyze(expr);
+            if (p == Constant && Worth(expr))
+                constants.push_back({&expr, first, names.size()});
+            return p;
+        }
+
+        // Analyzes elements of a list, starting with `p`
+        Purity Elements(const Ref<MalList>& list, Purity p) {
+            for (const MalList* l = list.get(); l != nullptr; l = l->Next())
+                p = Join(p, Sub(l->First()));
+            return p;
+        }
+
+        Purity Call(const MalValue& expr);
+        Purity Form(SpecialForm form, const Ref<MalList>& args);
+        Purity Analyze(const MalValue& expr);
+    public:
+        Folder(Interpreter& interp) : interp{interp}, global{*interp.env_global} {}
+
+        // Sets up the analysis of a function body
+        Folder(Interpreter& interp, const MalFunction& func) : Folder{interp} {
+            locals = func.params;
+            if (func.IsVariadic())
+                locals.push_back(func.param_var);
+            CollectDefs(func.body, shadows);
+            CollectMacroNames(global, func.body, shadows);
+        }
+
+        // Marks constant subexpressions of `expr`, returns the class of `expr`
+        Purity Fold(const MalValue& expr) {
+            Purity p = Sub(expr);
+            for (const Folded& c : constants)
+                Mark(c);
+            constants.clear();
+            names.clear();
+            return p;
+        }
+    };
+
+    Purity Folder::Analyze(const MalValue& expr) {
+        switch (expr.tag) {
+            case Symbol_T:
+                if (IsLocal(expr.st->Get()))
+                    return Pure;
+                return Global(expr.st->Get()) != nullptr ? Constant : Impure;
+            case List_T:
+                if (expr.li == nullptr)
+                    return Constant;
+                break;
+            case Vector_T:
+                if (expr.ve == nullptr)
+                    return Constant;
+                break;
+            default:
+                return Constant;
+        }
+
+        std::size_t mark = constants.size();
+        Purity p;
+        if (expr.tag == Vector_T)
+            p = Elements(mh::as_list(expr), Constant);
+        else {
+            const MalValue& head = expr.li->First();
+            SpecialForm form = mh::is_symbol(head) ? head.st->Form() : SpecialForm::None;
+            p = form == SpecialForm::None || form == SpecialForm::Unresolved ? Call(expr) : Form(form, expr.li->Rest());
+        }
+        // Subexpressions of a constant expression are folded together with it
+        if (p == Constant)
+            constants.resize(mark);
+        return p;
+    }
+
+    Purity Folder::Form(SpecialForm form, const Ref<MalList>& args) {
+        switch (form) {
+            case SpecialForm::Quote:
+                return Constant;
+            case SpecialForm::If:
+            case SpecialForm::Do:
+                return Elements(args, Constant);
+            case SpecialForm::Let:
+            case SpecialForm::Loop: {
+                // A loop without recur is a let*, recur makes the body impure
+                if (args == nullptr || args->At(0).tag != List_T)
+                    return Impure;
+                std::size_t outer = locals.size();
+                Purity p = Pure;
+                for (const MalList* l = args->At(0).li.get(); l != nullptr; l = l->Next()) {
+                    const MalValue& key = l->First();
+                    l = l->Next();
+                    if (key.tag != Symbol_T || l == nullptr) {
+                        p = Impure;
+                        break;
+                    }
+                    p = Join(p, Sub(l->First()));
+                    locals.push_back(key.st->Get());
+                }
+                if (args->Rest() != nullptr)
+                    p = Join(p, Sub(args->Rest()->First()));
+                locals.resize(outer);
+                return p;
+            }
+            case SpecialForm::Fn:
+            case SpecialForm::Macro: {
+                // Functions are new values, only the body is analyzed
+                std::vector<MalString::string_t> params;
+                MalString::string_t param_var;
+                try {
+                    ParseParameters(args != nullptr ? args->First() : mh::nil, params, param_var);
+                } catch (const mal_error&) {
+                    return Impure;
+                }
+                if (args->Rest() == nullptr)
+                    return Impure;
+                std::size_t outer = locals.size();
+                locals.insert(locals.end(), params.begin(), params.end());
+                if (!param_var.empty())
+                    locals.push_back(param_var);
+                Sub(args->Rest()->First());
+                locals.resize(outer);
+                return Impure;
+            }
+            case SpecialForm::Try: {
+                if (args == nullptr || args->GetSize() != 3 || !mh::is_symbol(args->At(1)))
+                    return Impure;
+                Purity p = Join(Pure, Sub(args->First()));
+                locals.push_back(args->At(1).st->Get());
+                p = Join(p, Sub(args->At(2)));
+                locals.pop_back();
+                return p;
+            }
+            case SpecialForm::Def:
+                if (args != nullptr && args->Rest() != nullptr)
+                    Sub(args->Rest()->First());
+                return Impure;
+            case SpecialForm::Recur:
+                return Elements(args, Impure);
+            case SpecialForm::Dotimes: {
+                // Evaluated for the side effects of the body
+                if (args == nullptr || args->GetSize() != 2 || !mh::is_flist(args->First()) || args->First().li->GetSize() != 2
+                        || !mh::is_symbol(args->First().li->First()))
+                    return Impure;
+                Sub(args->First().li->At(1));
+                locals.push_back(args->First().li->First().st->Get());
+                Sub(args->At(1));
+                locals.pop_back();
+                return Impure;
+            }
+            default:
+                // quasiquote and macroexpand produce new code values
+                return Impure;
+        }
+    }
+
+    Purity Folder::Call(const MalValue& expr) {
+        const MalValue& head = expr.li->First();
+        const auto& args = expr.li->Rest();
+        Purity callee = Impure;
+        if (head.tag == Symbol_T && !IsLocal(head.st->Get())) {
+            interp.RegisterCallSite(expr, head.st->Get());
+            if (const MalValue* fn = Global(head.st->Get())) {
+                if (fn->tag == Function_T && fn->fun->kind == MalFunction::KMacro) {
+                    // Arguments of macros are not code, but an expansion made by the macro is
+                    const MalValue* expansion = interp.CachedExpansion(expr, *fn->fun);
+                    return expansion != nullptr ? Sub(*expansion) : Impure;
+                }
+                if (fn->tag == Builtin_T ? interp.pure_builtins.count(fn->blt) != 0 : fn->tag == Function_T && interp.IsPure(*fn->fun))
+                    callee = Constant;
+            }
+        } else
+            Sub(head);
+        return Elements(args, callee);
+    }
+}
+
+namespace mal {
+    void Interpreter::FoldFunction(const MalFunction& func) {
+        Folder{*this, func}.Fold(func.body);
+    }
+
+    bool Interpreter::Refold(const MalValue& expr) {
+        // A marked expression refers to no local bindings, so it can be analyzed on its own
+        if (Folder{*this}.Fold(expr) == Constant)
+            return true;
+        folds.erase(FoldForm(expr).get());
+        return false;
+    }
+
+    void Interpreter::MarkFold(const MalValue& form, std::vector<std::string>&& names) {
+        const Ref<MalList>& list = FoldForm(form);
+        PruneForms(folds, folds_pruned, &FoldMark::form);
+        FoldMark& mark = folds[list.get()];
+        if (mark.form.lock() == list && mark.epoch == env_global->epoch)
+            return;
+        mark.form = list;
+        mark.epoch = env_global->epoch;
+        mark.names = std::move(names);
+        mark.valued = false;
+        mark.value = mh::nil;
+        list->folded = true;
+    }
+
+    bool Interpreter::IsFolded(const MalValue& form) const {
+        auto entry = folds.find(FoldForm(form).get());
+        return entry != folds.end() && !entry->second.form.expired();
+    }
+
+    bool Interpreter::IsPure(const MalFunction& func) {
+        // Closures may refer to mutable local environments
+        if (func.kind != MalFunction::KFunc || !func.env->global)
+            return false;
+        // Recursive calls are assumed to be pure
+        if (std::find(purity_stack.begin(), purity_stack.end(), &func) != purity_stack.end())
+            return true;
+        // The result is kept with the function, the body may be shared by functions of other parameters
+        if (func.purity_epoch == env_global->epoch)
+            return func.pure;
+
+        purity_stack.push_back(&func);
+        bool pure = Folder{*this, func}.Fold(func.body) != Impure;
+        purity_stack.pop_back();
+        // A positive result may rely on the assumptions about the functions being analyzed
+        if (!pure || purity_stack.empty()) {
+            func.purity_epoch = env_global->epoch;
+            func.pure = pure;
+        }
+        return pure;
+    }
+}
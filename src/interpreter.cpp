@@ -1,29 +1,28 @@
 #include "interpreter.hpp"
+#include "bytecode.hpp"
 
 namespace mal {
-    std::array<std::shared_ptr<MalString>, 10> Interpreter::InitSymbols() {
-        return {
-            str_interner.Intern("def"),
-            str_interner.Intern("let*"),
-            str_interner.Intern("do"),
-            str_interner.Intern("if"),
-            str_interner.Intern("fn"),
-            str_interner.Intern("macro"),
-            str_interner.Intern("quote"),
-            str_interner.Intern("quasiquote"),
-            str_interner.Intern("macroexpand"),
-            str_interner.Intern("try*")
-        };
-    }
-
-    MalValue CreateFunction(const std::shared_ptr<MalList>& args, const EnvironFrame& env, MalFunction::FKind kind) {
+    MalValue Interpreter::CreateFunction(const Ref<MalList>& args, const EnvironFrame& env, MalFunction::FKind kind) {
         if (args->GetSize() != 2)
             throw mal_error{"Function takes 2 arguments"};
-        if (!mh::is_sequence(args->At(0)))
-            throw mal_error{"Function takes a list/vector as first argument"};
-        ListIterator it = args->At(0).li;
         std::vector<MalString::string_t> params;
         MalString::string_t param_var = "";
+        ParseParameters(args->At(0), params, param_var);
+        auto func = MalFunction::Make(std::move(params), std::move(param_var), env, args->At(1), kind);
+        collector.Track(func);
+        if (pre_expand)
+            PreExpand(func->body, env);
+        if (func->env->global)
+            FoldFunction(*func);
+        if (engine == Engine::VM)
+            func->code = CompileFunction(*this, *func);
+        return func;
+    }
+
+    void ParseParameters(const MalValue& spec, std::vector<MalString::string_t>& params, MalString::string_t& param_var) {
+        if (!mh::is_sequence(spec))
+            throw mal_error{"Function takes a list/vector as first argument"};
+        ListIterator it = mh::as_list(spec);
         while (it) {
             MalValue v = *it;
             ++it;
@@ -39,64 +38,50 @@ namespace mal {
             }
             params.push_back(v.st->Get());
         }
-        return MalFunction::Make(std::move(params), std::move(param_var), env, args->At(1), kind);
     }
 
-    inline EnvironFrame PrepareFunctionCall(const MalFunction& func, MalArgs&& args) {
+    void CollectDefs(const MalValue& expr, std::vector<std::string>& names) {
+        if (mh::is_vector(expr)) {
+            for (ListIterator it = mh::as_list(expr); it; ++it)
+                CollectDefs(*it, names);
+            return;
+        }
+        if (!mh::is_flist(expr))
+            return;
+        const MalValue& head = expr.li->First();
+        if (mh::is_symbol(head)) {
+            if (head.st->Get() == "quote")
+                return;
+            if (head.st->Get() == "def" && mh::is_symbol(expr.li->At(1)))
+                names.push_back(expr.li->At(1).st->Get());
+        }
+        for (ListIterator it = expr.li; it; ++it)
+            CollectDefs(*it, names);
+    }
+
+    EnvironFrame PrepareFunctionCall(const MalFunction& func, MalArgs&& args) {
         if (func.IsVariadic() ? args.size() < func.params.size() : args.size() != func.params.size())
             throw mal_error{"Arguments count doesn't match function's parameter count"};
-        EnvironFrame env = std::make_unique<Environment>(func.env);
+        EnvironFrame env = FramePool::Make(func.env, func.frame);
         std::size_t i;
-        for (i = 0; i < func.params.size(); ++i) {
-            env->set(func.params[i], std::move(args)[i]);
-        }
+        for (i = 0; i < func.params.size(); ++i)
+            env->slots.emplace_back(std::move(args)[i]);
         if (func.IsVariadic()) {
             ListBuilder lb;
-            for (; i < args.size(); ++i) {
+            for (; i < args.size(); ++i)
                 lb.push(std::move(args)[i]);
-            }
-            env->set(func.param_var, mh::list(lb.release()));
+            env->slots.emplace_back(mh::list(lb.release()));
         }
         return env;
     }
 
-    inline void RequireMeta(const MalValue& val) {
-        if (mh::is_map(val.Meta()))
-            return;
-        // Override !! meta of the code value with an empty hash map
-        const_cast<MalValue&>(val).SetMeta(mh::hash_map(MalMap::Make()));
-    }
-
-    inline void SetMeta(const MalValue& target, const std::string& name, const MalValue& val) {
-        RequireMeta(target);
-        auto map = target.Meta().Map();
-        map->Set(mh::keyword(name), val);
-    }
-
-    inline MalValue GetMeta(const MalValue& target, const std::string& name) {
-        RequireMeta(target);
-        auto map = target.Meta().Map();
-        auto v = map->Lookup(mh::keyword(name));
-        return v == map->data.end() ? mh::nil : v->second.get();
-    }
-
     MalValue Interpreter::EvalAst(const MalValue& expr, const EnvironFrame& env) {
         switch (expr.tag) {
             case Symbol_T:
                 return env->lookup(expr.st->Get());
-            case List_T:
-            case Vector_T: {
-                auto l = mh::map(*expr.li, [&env, this](const auto& v){return this->EvaluateExpression(v, env); });
-                return expr.tag == List_T ? mh::list(l) : mh::vector(l);
-            }
+            // Lists and vectors are evaluated by EvaluateExpression
             default:
-                /*if (mh::is_num(expr) || mh::is_nil(expr) || mh::is_true(expr) || mh::is_false(expr)) {
-                    // Mark a constant
-                    SetMeta(expr, "constant_value", expr);
-                }*/
-                auto ret = expr;
-                ret.SetMeta(nullptr);
-                return ret;
+                return expr;
         }
     }
 
@@ -120,95 +105,84 @@ namespace mal {
         if (mh::is_flist(l->First())) {
             const auto& fir = l->First().li;
             if (mh::is_symbol(fir->First()) && fir->First().st->Get() == "splice-unquote")  {
-                return mh::list(mh::cons(env_global->data["concat"].get(), mh::cons(MalValue(fir->At(1)), mh::cons(QuasiQuote(mh::list(l->Rest())), nullptr))));
+                return mh::list(mh::cons(MalValue(quasiquote_concat->value.get()), mh::cons(MalValue(fir->At(1)), mh::cons(QuasiQuote(mh::list(l->Rest())), nullptr))));
             }
         }
-        return mh::list(mh::cons(env_global->data["cons"].get(), mh::cons(QuasiQuote(l->First()), mh::cons(QuasiQuote(mh::list(l->Rest())), nullptr))));
+        return mh::list(mh::cons(MalValue(quasiquote_cons->value.get()), mh::cons(QuasiQuote(l->First()), mh::cons(QuasiQuote(mh::list(l->Rest())), nullptr))));
+    }
+
+    // Reads the binding at `it` of a let* form, returns its value expression
+    static MalValue NextBinding(ListIterator it) {
+        const MalValue& k = *it;
+        if (k.tag != Symbol_T)
+            throw mal_error{"Let* only accepts symbol keys"};
+        ++it;
+        if (!it)
+            throw mal_error{"Odd number of arguments"};
+        return *it;
     }
 
 #   define RET_VALUE(v) do { curr = v; return true; } while(false)
 // Equivalent to: return EvaluateExpression(expr, new_env)
 #   define RET_TCO(expr, new_env) do { curr = expr; env = new_env; return false; } while(false)
 #   define MV std::move
-    bool Interpreter::Apply(MalAtom& curr, EnvironFrame& env, const MalValue& func, std::shared_ptr<MalList> args) {
+    bool Interpreter::Apply(MalAtom& curr, EnvironFrame& env, const MalValue& func, Ref<MalList> args) {
         // Check special values
-        if (func.tag == Symbol_T) {
-            std::shared_ptr<MalString> sym = func.st;
-            if (!sym->IsInterned(&str_interner)) {
-                sym = str_interner.Intern(sym->Get());
-            }
-
-            if (sym == symbols_form[symDef]) {
+        if (func.tag == Symbol_T) switch (func.st->Form()) {
+            case SpecialForm::Def: {
                 if (args->GetSize() != 2)
                     throw mal_error{"Def! takes 2 arguments"};
                 MalValue key = args->At(0);
                 if (key.tag != Symbol_T)
                     throw mal_error{"Def! only accepts symbol keys"};
-                MalValue val = EvaluateExpression(args->At(1), env);
-                env->set(key.st->Get(), val);
-                RET_VALUE(MV(val));
+                PushFrame({EvalFrame::KDef, env, args});
+                RET_TCO(args->At(1), env);
             }
-            else if (sym == symbols_form[symLet]) {
+            case SpecialForm::Let: {
                 if (args->GetSize() != 2)
                     throw mal_error{"Let* takes 2 arguments"};
                 if (args->At(0).tag != List_T)
                     throw mal_error{"Let* takes a list as first argument"};
-                auto e = std::make_shared<Environment>(env);
-                ListIterator it = args->At(0).li;
-                while (it) {
-                    MalValue k = *it;
-                    if (k.tag != Symbol_T)
-                        throw mal_error{"Let* only accepts symbol keys"};
-                    ++it;
-                    if (!it)
-                        throw mal_error{"Odd number of arguments"};
-                    MalValue v = *it;
-                    ++it;
-                    e->set(k.st->Get(), EvaluateExpression(v, e));
-                }
-                RET_TCO(args->At(1), MV(e));
+                const auto& bindings = args->At(0).li;
+                if (bindings == nullptr)
+                    RET_TCO(args->At(1), MakeRef<Environment>(env));
+                auto e = FramePool::Make(env, LetSlots(bindings));
+                PushFrame({EvalFrame::KLet, e, args->At(0).li, args->At(1)});
+                RET_TCO(NextBinding(eval_stack.back().it), MV(e));
             }
-            else if (sym == symbols_form[symDo]) {
+            case SpecialForm::Do: {
                 ListIterator it = args;
                 if (!it)
                     RET_VALUE(mh::nil);
-                MalAtom val{*it};
+                MalValue first = *it;
                 ++it;
-                while (it) {
-                    EvaluateExpression(val.get(), env);
-                    val = *it;
-                    ++it;
-                }
-                RET_TCO(val.get(), env);
+                if (it)
+                    PushFrame({EvalFrame::KDo, env, MV(it)});
+                RET_TCO(MV(first), env);
             }
-            else if (sym == symbols_form[symIf]) {
+            case SpecialForm::If: {
                 if (args->GetSize() != 3 && args->GetSize() != 2)
                     throw mal_error{"If takes 2 or 3 arguments"};
-                MalValue res = EvaluateExpression(args->At(0), env);
-                if (res.tag != Nil_T && res.tag != False_T)
-                    RET_TCO(args->At(1), env);
-                else if (args->GetSize() == 3)
-                    RET_TCO(args->At(2), env);
-                else
-                    RET_VALUE(mh::nil);
+                PushFrame({EvalFrame::KIf, env, args->Rest()});
+                RET_TCO(args->At(0), env);
             }
-            else if (sym == symbols_form[symFn]) {
+            case SpecialForm::Fn: {
                 RET_VALUE(CreateFunction(args, env, MalFunction::KFunc));
             }
-            else if (sym == symbols_form[symMacro]) {
+            case SpecialForm::Macro: {
                 RET_VALUE(CreateFunction(args, env, MalFunction::KMacro));
             }
-            else if (sym == symbols_form[symQuote]) {
+            case SpecialForm::Quote: {
                 if (args->GetSize() != 1)
                     throw mal_error{"Quote takes 1 argument"};
                 RET_VALUE(args->First());
             }
-            else if (sym == symbols_form[symQuasiquote]) {
+            case SpecialForm::Quasiquote: {
                 if (args->GetSize() != 1)
                     throw mal_error{"QuasiQuote takes 1 argument"};
                 RET_TCO(QuasiQuote(args->First()), env);
             }
-            else if (sym == symbols_form[symMacroexpand]) {
+            case SpecialForm::Macroexpand: {
                 // ! WARNING: Can cause side effects (always evaluates the callee expression)
                 // ! EXTRA WARNING: Silently ignores errors in the callee-expr evaluation
                 if (args->GetSize() != 1)
@@ -228,59 +202,486 @@ namespace mal {
                 }
                 RET_VALUE(sub_expr.get());
             }
-            else if (sym == symbols_form[symTry]) {
+            case SpecialForm::Try: {
                 if (args->GetSize() != 3)
                     throw mal_error{"try* takes 3 arguments"};
                 if (!mh::is_symbol(args->At(1)))
                     throw mal_error{"Second argument must be a name"};
-                try {
-                    RET_VALUE(EvaluateExpression(args->First(), env));
-                } catch (const mal_error& err) {
-                    auto e = std::make_shared<Environment>(env);
-                    e->set(args->At(1).st->Get(), err.msg);
-                    RET_TCO(args->At(2), e);
+                // Errors are caught by EvaluateExpression
+                PushFrame({EvalFrame::KTry, env, args->Rest()});
+                RET_TCO(args->First(), env);
+            }
+            case SpecialForm::Loop: {
+                if (args->GetSize() != 2)
+                    throw mal_error{"Loop takes 2 arguments"};
+                if (args->At(0).tag != List_T)
+                    throw mal_error{"Loop takes a list as first argument"};
+                const auto& bindings = args->At(0).li;
+                if (bindings == nullptr) {
+                    // Without variables, the body runs in the current environment (see: `while` in bootstrap.mal)
+                    PushFrame({EvalFrame::KLoop, env, ListIterator{nullptr}, curr.v});
+                    RET_TCO(args->At(1), env);
                 }
+                // The bindings are evaluated like the ones of let*, the body then runs above the KLoop frame
+                auto e = FramePool::Make(env, LetSlots(bindings));
+                PushFrame({EvalFrame::KLoop, e, bindings, curr.v});
+                PushFrame({EvalFrame::KLet, e, bindings, args->At(1)});
+                RET_TCO(NextBinding(eval_stack.back().it), MV(e));
+            }
+            case SpecialForm::Recur: {
+                // Calls in a tail position of a loop body pop the KLoop frames (see: NextArgument), so one is on the top
+                // only if the recur is in a tail position of the body itself
+                if (eval_stack.size() == eval_base || eval_stack.back().kind != EvalFrame::KLoop)
+                    throw mal_error{"Recur must be in a tail position of loop"};
+                if (args == nullptr)
+                    return Recur(curr, env, MalArgs{});
+                EvalFrame fr{EvalFrame::KRecur, env, args->Rest()};
+                fr.values.reserve(args->GetSize());
+                PushFrame(MV(fr));
+                RET_TCO(args->First(), env);
             }
+            case SpecialForm::Dotimes: {
+                if (args->GetSize() != 2)
+                    throw mal_error{"Dotimes takes 2 arguments"};
+                const MalValue& spec = args->At(0);
+                if (spec.tag != List_T || spec.li == nullptr || spec.li->GetSize() != 2 || spec.li->First().tag != Symbol_T)
+                    throw mal_error{"Dotimes takes a list of a name and a count as first argument"};
+                // The count is evaluated outside of the scope of the name
+                PushFrame({EvalFrame::KDotimes, FramePool::Make(env, LetSlots(spec.li)), ListIterator{nullptr}, curr.v});
+                RET_TCO(spec.li->At(1), env);
+            }
+            case SpecialForm::None:
+            case SpecialForm::Unresolved:
+                break;
         }
 
         // Call function
-        MalValue ev_func = EvaluateExpression(func, env);
-        if (!mh::is_invokable(ev_func))
-            throw mal_error{"Cannot call non-function"};
-        if (ev_func.tag == Function_T && ev_func.fun->kind == mal::MalFunction::KMacro) {
-            // MacroExpand
-            // In-place macro expansion
-            RET_TCO(EvalFunction(*ev_func.fun, args), env);
+        if (func.tag == Symbol_T) {
+            if (const MalValue* callee = CachedCallee(curr->li.get(), env)) {
+                EvalFrame fr{EvalFrame::KArgs, env, args, curr.v};
+                fr.callee = *callee;
+                fr.values.reserve(args ? args->GetSize() : 0);
+                PushFrame(MV(fr));
+                return NextArgument(curr, env);
+            }
+        }
+        PushFrame({EvalFrame::KCallee, env, MV(args), curr.v});
+        RET_TCO(func, env);
+    }
+
+    // Resolves the callee of a call site registered by the folding pass, returns nullptr if the
+    // form is not a call site, the callee is not a function or the name is bound locally in `env`
+    // (a form shared with another body may be evaluated where the name is a parameter)
+    const MalValue* Interpreter::CachedCallee(const MalList* form, const EnvironFrame& env) {
+        if (call_sites.empty())
+            return nullptr;
+        auto entry = call_sites.find(form);
+        if (entry == call_sites.end())
+            return nullptr;
+        CallSite& site = entry->second;
+        if (site.form.expired()) {
+            // The address belongs to another form now
+            call_sites.erase(entry);
+            return nullptr;
+        }
+        const GlobalCell& cell = *site.cell;
+        // A frame right below the global environment is checked once for each layout of its slots
+        const Environment& frame = *env;
+        const bool toplevel = !frame.global && frame.outer->global && frame.data.empty() && frame.slot_names;
+        if (!toplevel || frame.slot_names != site.frame) {
+            if (env->binds_locally(cell.name))
+                return nullptr;
+            if (toplevel && std::find(frame.slot_names->begin(), frame.slot_names->end(), cell.name) == frame.slot_names->end())
+                site.frame = frame.slot_names;
+        }
+        if (site.version == cell.version) {
+            ++call_cache_hits;
+            return &cell.value.v;
+        }
+        ++call_cache_misses;
+        const MalValue& callee = cell.value.v;
+        if (!cell.bound || !mh::is_invokable(callee) || (callee.tag == Function_T && callee.fun->kind == MalFunction::KMacro))
+            return nullptr;
+        site.version = cell.version;
+        return &callee;
+    }
+
+    void Interpreter::RegisterCallSite(const MalValue& form, const std::string& name) {
+        PruneForms(call_sites, call_sites_pruned, &CallSite::form);
+        CallSite& site = call_sites[form.li.get()];
+        if (site.form.lock() == form.li)
+            return;
+        site.form = form.li;
+        site.cell = env_global->cell(name);
+        site.version = -1;
+        site.frame = nullptr;
+    }
+
+    // Returns the names of the bindings of a let* form, the bindings must be valid (see: NextBinding)
+    const std::shared_ptr<const SlotNames>& Interpreter::LetSlots(const Ref<MalList>& bindings) {
+        auto entry = let_scopes.find(bindings.get());
+        if (entry != let_scopes.end() && !entry->second.bindings.expired())
+            return entry->second.names;
+        PruneForms(let_scopes, let_scopes_pruned, &LetScope::bindings);
+        auto names = std::make_shared<SlotNames>();
+        for (const MalList* l = bindings.get(); l != nullptr; l = l->Next() ? l->Next()->Next() : nullptr)
+            names->push_back(l->First().tag == Symbol_T ? l->First().st->Get() : "");
+        LetScope& scope = let_scopes[bindings.get()];
+        scope.bindings = bindings;
+        scope.names = std::move(names);
+        return scope.names;
+    }
+
+    void RebindLoop(EnvironFrame& e, MalValue* values, std::size_t count) {
+        if (count != 0 && e.use_count() > 1) {
+            auto fresh = FramePool::Make(e->outer, e->slot_names);
+            fresh->data = e->data;
+            e = MV(fresh);
+        }
+        if (e->slots.empty()) {
+            for (std::size_t i = 0; i < count; ++i)
+                e->slots.emplace_back(MV(values[i]));
+        } else {
+            for (std::size_t i = 0; i < count; ++i)
+                e->slots[i] = MV(values[i]);
+        }
+    }
+
+    // Restarts the loop on the top of the stack with new values of its variables
+    bool Interpreter::Recur(MalAtom& curr, EnvironFrame& env, MalArgs&& values) {
+        EvalFrame& loop = eval_stack.back();
+        // `it` holds the bindings, a loop without them shares the environment of its form
+        if (values.size() != (loop.it ? loop.env->slots.size() : 0))
+            throw mal_error{"Recur arguments count doesn't match loop's binding count"};
+        env = nullptr;
+        RebindLoop(loop.env, values.begin(), values.size());
+        if (tier_threshold != 0 && ++loop.iterations == tier_threshold) {
+            // The compilation may expand macros, which can reallocate the stack
+            if (auto code = TierUpLoop(MalValue{loop.expr}, EnvironFrame{loop.env})) {
+                EnvironFrame loop_env = MV(eval_stack.back().env);
+                eval_stack.pop_back();
+                RET_VALUE(RunCode(MV(code), MV(loop_env), {}));
+            }
+        }
+        const EvalFrame& top = eval_stack.back();
+        RET_TCO(top.expr.li->At(2), top.env);
+    }
+
+    // Compiles the loop `form`, running in `env`, once it made `tier_threshold` iterations in the tree-walker
+    // The bytecode continues the loop in the same environment (see: CompileLoop)
+    std::shared_ptr<const Code> Interpreter::TierUpLoop(const MalValue& form, const EnvironFrame& env) {
+        // Loops with variables and dotimes run in an environment of their own
+        bool scoped = form.li->First().st->Form() == SpecialForm::Dotimes || form.li->At(1).li != nullptr;
+        bool global = (scoped ? env->outer : env) == env_global;
+        auto entry = loop_code.find(form.li.get());
+        if (entry != loop_code.end() && entry->second.form.lock() == form.li && entry->second.global == global)
+            return entry->second.code;
+        PruneForms(loop_code, loop_code_pruned, &LoopCode::form);
+        LoopCode& compiled = loop_code[form.li.get()];
+        compiled.form = form.li;
+        compiled.global = global;
+        compiled.code = CompileLoop(*this, form, env);
+        return compiled.code;
+    }
+
+    // Passes the value `curr` to the frame on the top of the stack
+    // Returns false, if the frame requests evaluation of `curr` in `env`
+    bool Interpreter::Continue(MalAtom& curr, EnvironFrame& env) {
+        EvalFrame& fr = eval_stack.back();
+        switch (fr.kind) {
+            case EvalFrame::KDef:
+                fr.env->set((*fr.it).st->Get(), curr.v);
+                eval_stack.pop_back();
+                return true;
+            case EvalFrame::KLet:
+                fr.env->slots.emplace_back(MV(curr.v));
+                ++fr.it;
+                ++fr.it;
+                if (fr.it)
+                    RET_TCO(NextBinding(fr.it), fr.env);
+                curr = fr.expr;
+                env = MV(fr.env);
+                eval_stack.pop_back();
+                return false;
+            case EvalFrame::KDo: {
+                curr = *fr.it;
+                ++fr.it;
+                env = fr.env;
+                if (!fr.it)
+                    eval_stack.pop_back();
+                return false;
+            }
+            case EvalFrame::KIf: {
+                ListIterator it = MV(fr.it);
+                env = MV(fr.env);
+                eval_stack.pop_back();
+                if (curr->tag == Nil_T || curr->tag == False_T)
+                    ++it;
+                if (!it)
+                    RET_VALUE(mh::nil);
+                curr = *it;
+                return false;
+            }
+            case EvalFrame::KTry:
+                eval_stack.pop_back();
+                return true;
+            case EvalFrame::KVector:
+                fr.values.push_back(MV(curr.v));
+                if (fr.it) {
+                    curr = *fr.it;
+                    ++fr.it;
+                    env = fr.env;
+                    return false;
+                } else {
+                    VectorBuilder vb;
+                    for (auto& v : fr.values)
+                        vb.push(MV(v));
+                    eval_stack.pop_back();
+                    RET_VALUE(mh::vector(vb.release()));
+                }
+            case EvalFrame::KCallee:
+                if (!mh::is_invokable(curr.v))
+                    throw mal_error{"Cannot call non-function"};
+                if (curr->tag == Function_T && curr->fun->kind == mal::MalFunction::KMacro) {
+                    // In-place macro expansion, once per call site
+                    if (const MalValue* expansion = CachedExpansion(fr.expr, *curr->fun)) {
+                        curr = *expansion;
+                        env = MV(fr.env);
+                        eval_stack.pop_back();
+                        return false;
+                    }
+                    auto macro = curr->fun;
+                    MalArgs m_args = fr.expr.li->Rest();
+                    fr.kind = EvalFrame::KExpand;
+                    fr.callee = MV(curr.v);
+                    if (macro->code)
+                        RET_VALUE(RunCompiled(*macro, MV(m_args)));
+                    RET_TCO(macro->body, PrepareFunctionCall(*macro, MV(m_args)));
+                }
+                fr.kind = EvalFrame::KArgs;
+                fr.callee = MV(curr.v);
+                fr.values.reserve(fr.expr.li->GetSize() - 1);
+                return NextArgument(curr, env);
+            case EvalFrame::KArgs:
+                fr.values.push_back(MV(curr.v));
+                return NextArgument(curr, env);
+            case EvalFrame::KExpand:
+                CacheExpansion(fr.expr, fr.callee->fun, curr.v);
+                env = MV(fr.env);
+                eval_stack.pop_back();
+                return false;
+            case EvalFrame::KFold:
+                StoreFold(fr.expr, curr.v);
+                eval_stack.pop_back();
+                return true;
+            case EvalFrame::KLoop:
+                eval_stack.pop_back();
+                return true;
+            case EvalFrame::KRecur: {
+                fr.values.push_back(MV(curr.v));
+                if (fr.it) {
+                    curr = *fr.it;
+                    ++fr.it;
+                    env = fr.env;
+                    return false;
+                }
+                MalArgs values = MV(fr.values);
+                eval_stack.pop_back();
+                return Recur(curr, env, MV(values));
+            }
+            case EvalFrame::KDotimes: {
+                if (fr.values.size() == 0) {
+                    if (curr->tag != Int_T)
+                        throw mal_error{"Dotimes takes a number as the count"};
+                    fr.values.push_back(MV(curr.v));
+                } else
+                    ++fr.iterations;
+                const MalValue& count = *fr.values.begin();
+                if (count.no <= 0 || fr.iterations >= static_cast<std::size_t>(count.no)) {
+                    eval_stack.pop_back();
+                    RET_VALUE(mh::nil);
+                }
+                MalValue counter = mh::num(fr.iterations);
+                env = nullptr;
+                RebindLoop(fr.env, &counter, 1);
+                if (tier_threshold != 0 && fr.iterations == tier_threshold) {
+                    // The count stays on the stack of the bytecode (see: Op::Times)
+                    std::vector<MalValue> stack{count};
+                    // The compilation may expand macros, which can reallocate the stack
+                    if (auto code = TierUpLoop(MalValue{fr.expr}, EnvironFrame{fr.env})) {
+                        EnvironFrame loop_env = MV(eval_stack.back().env);
+                        eval_stack.pop_back();
+                        RET_VALUE(RunCode(MV(code), MV(loop_env), MV(stack)));
+                    }
+                }
+                const EvalFrame& top = eval_stack.back();
+                RET_TCO(top.expr.li->At(2), top.env);
+            }
+        }
+        return true;
+    }
+
+    // Evaluates the next argument of the call on the top of the stack, or calls the function
+    bool Interpreter::NextArgument(MalAtom& curr, EnvironFrame& env) {
+        EvalFrame& fr = eval_stack.back();
+        if (fr.it) {
+            curr = *fr.it;
+            ++fr.it;
+            env = fr.env;
+            return false;
+        }
+        MalValue ev_func = MV(fr.callee.v);
+        MalArgs ev_args = MV(fr.values);
+        eval_stack.pop_back();
+        if (ev_func.tag == Builtin_T) {
+            const Builtin& blt = *ev_func.blt;
+            if (blt.direct != nullptr && ev_args.size() == blt.arity)
+                RET_VALUE(blt.direct(*this, ev_args.begin()));
+            RET_VALUE(blt.call(*this, MV(ev_args)));
         }
-        auto ev_args = EvalAst(mh::list(args), env).li;
-        if (ev_func.tag == Builtin_T)
-            RET_VALUE(ev_func.blt(*this, ev_args));
         else /*if (ev_func.tag == Function_T)*/ {
             auto& fun = *ev_func.fun;
-            auto n_env = PrepareFunctionCall(fun, ev_args);
+            if (fun.code || TierUp(fun))
+                RET_VALUE(RunCompiled(fun, MV(ev_args)));
+            auto n_env = PrepareFunctionCall(fun, MV(ev_args));
+            // A call in a tail position of a loop body ends the loop, a recur in the function can't restart it
+            // The loop may itself be in a tail position of an enclosing loop, which ends as well
+            while (eval_stack.size() > eval_base && eval_stack.back().kind == EvalFrame::KLoop)
+                eval_stack.pop_back();
             RET_TCO(fun.body, n_env);
         }
     }
 
+    bool Interpreter::TierUp(MalFunction& func) {
+        if (tier_threshold == 0 || func.kind != MalFunction::KFunc || ++func.calls < tier_threshold)
+            return false;
+        func.code = CompileFunction(*this, func);
+        return true;
+    }
+
+    // Serves the value of a constant expression marked by the folding pass (see: folding.cpp)
+    // The mark holds only where the free names of the form are global: a form shared with another body may refer to
+    // local bindings there. Returns false if the expression has to be evaluated
+    bool Interpreter::ReadFold(MalAtom& curr, const EnvironFrame& env) {
+        auto entry = folds.find(FoldForm(curr.v).get());
+        if (entry == folds.end())
+            return false;
+        FoldMark& mark = entry->second;
+        if (mark.form.expired()) {
+            // The address belongs to another form now
+            folds.erase(entry);
+            return false;
+        }
+        for (const std::string& name : mark.names) {
+            if (env && env->binds_locally(name))
+                return false;
+        }
+        if (mark.epoch != env_global->epoch) {
+            if (!Refold(curr.v))
+                return false;
+        } else if (mark.valued) {
+            curr = mark.value.v;
+            return true;
+        }
+        // The first evaluation stores the value
+        PushFrame({EvalFrame::KFold, nullptr, ListIterator{nullptr}, curr.v});
+        return false;
+    }
+
+    void Interpreter::StoreFold(const MalValue& form, const MalValue& value) {
+        auto entry = folds.find(FoldForm(form).get());
+        if (entry == folds.end() || entry->second.form.expired() || entry->second.epoch != env_global->epoch)
+            return;
+        entry->second.value = value;
+        entry->second.valued = true;
+    }
+
+    void Interpreter::PushFrame(EvalFrame&& frame) {
+        if (eval_stack.size() >= stack_limit)
+            throw mal_error{"Stack limit reached"};
+        eval_stack.push_back(MV(frame));
+    }
+
     MalValue Interpreter::EvalFunction(const MalFunction& func, MalArgs&& args) {
+        if (func.code)
+            return RunCompiled(func, std::move(args));
         return EvaluateExpression(func.body, PrepareFunctionCall(func, std::move(args)));
     }
 
     MalValue Interpreter::EvaluateExpression(const MalValue& expr, EnvironFrame env) {
         RecursionGuard<MAX_RECURSION_DEPTH> rg{recursion_depth};
+        // Frames pushed by this invocation are above `base`
+        const std::size_t base = eval_stack.size();
+        struct StackGuard {
+            std::vector<EvalFrame>& stack;
+            std::size_t base;
+            std::size_t& current_base;
+            std::size_t outer_base;
+            ~StackGuard() {
+                while (stack.size() > base)
+                    stack.pop_back();
+                current_base = outer_base;
+            }
+        } sg{eval_stack, base, eval_base, eval_base};
+        eval_base = base;
+
         MalAtom curr{expr};
         while (true) {
-            switch (curr->tag) {
-                case List_T: {
-                    if (curr->li == nullptr)
-                        return curr.get();
-                    if (Apply(curr, env, curr->li->First(), curr->li->Rest()))
-                        return std::move(curr.v);
-                    break;
+            try {
+                while (true) {
+                    // Evaluate `curr` in `env`
+                    bool value;
+                    const MalList* form = FoldForm(curr.v).get();
+                    if (form != nullptr && form->folded && ReadFold(curr, env))
+                        value = true;
+                    else switch (curr->tag) {
+                        case List_T:
+                            value = curr->li == nullptr || Apply(curr, env, curr->li->First(), curr->li->Rest());
+                            break;
+                        case Vector_T:
+                            // Elements are walked on the list view of the vector, made once per literal
+                            if (curr->ve == nullptr) {
+                                value = true;
+                            } else {
+                                const auto& elements = mh::as_list(curr.v);
+                                MalValue first = elements->First();
+                                PushFrame({EvalFrame::KVector, env, elements->Rest()});
+                                curr = MV(first);
+                                value = false;
+                            }
+                            break;
+                        default:
+                            curr = EvalAst(curr.v, env);
+                            value = true;
+                    }
+                    // Pass the value down the stack, until a frame requests another evaluation
+                    while (value) {
+                        if (eval_stack.size() == base)
+                            return std::move(curr.v);
+                        value = Continue(curr, env);
+                    }
                 }
-                default:
-                    return EvalAst(curr.v, env);
+            } catch (const mal_error& err) {
+                // Unwind to the innermost try* of this invocation
+                while (eval_stack.size() > base && eval_stack.back().kind != EvalFrame::KTry)
+                    eval_stack.pop_back();
+                if (eval_stack.size() == base)
+                    throw;
+                EvalFrame& fr = eval_stack.back();
+                env = MakeRef<Environment>(fr.env);
+                env->set((*fr.it).st->Get(), err.msg);
+                ++fr.it;
+                curr = *fr.it;
+                eval_stack.pop_back();
             }
         }
     }
+
+    Ref<MalList> Interpreter::CallStack() const {
+        ListBuilder lb;
+        for (auto it = eval_stack.rbegin(); it != eval_stack.rend(); ++it)
+            if (it->kind == EvalFrame::KCallee || it->kind == EvalFrame::KArgs)
+                lb.push(MalValue{it->expr});
+        return lb.release();
+    }
 }
@@ -4,54 +4,232 @@
 #include <string>
 
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <array>
 
 #include "malvalue.hpp"
 #include "printer.hpp"
 #include "invoke.hpp"
+#include "collector.hpp"
 
 namespace mal {
     class Printer;    
 
+    // A pending step of the tree-walking evaluator, waiting for the value of a subexpression (see: EvaluateExpression)
+    struct EvalFrame {
+        enum Kind {
+            KDef,    // Bind the value to the symbol at `it`
+            KLet,    // Bind the value to the symbol at `it`, then evaluate the next binding or `expr` (body)
+            KDo,     // Drop the value, then evaluate the rest of `it`
+            KIf,     // Evaluate one of the branches starting at `it`
+            KTry,    // Return the value; catch errors raised above this frame, `it` points at the handler's name
+            KVector, // Collect the value, then evaluate the rest of `it`
+            KCallee, // Evaluate the arguments `it` of the call `expr` (or expand it, if the value is a macro)
+            KArgs,   // Collect the value, then evaluate the rest of `it` and call `callee`
+            KExpand, // Cache the value as the expansion of the call `expr` by `callee`, then evaluate it
+            KFold,   // Store the value in the fold mark of `expr` (see: Interpreter::ReadFold)
+            KLoop,   // Return the value of the loop `expr`; a recur rebinds the slots of `env` (bound by `it`) and evaluates the body again
+            KRecur,  // Collect the value, then evaluate the rest of `it` and restart the loop below
+            KDotimes,// Receive the count (`values`), then evaluate the body of `expr` for each value of the counter
+        } kind;
+        EnvironFrame env;
+        ListIterator it;
+        MalValue expr;
+        MalAtom callee;
+        MalArgs values; // Evaluated elements or arguments
+        std::size_t iterations = 0; // Of a loop, the counter of dotimes
+
+        EvalFrame(Kind kind, EnvironFrame env, ListIterator it, MalValue expr = mh::nil)
+            : kind{kind}, env{std::move(env)}, it{std::move(it)}, expr{std::move(expr)} {}
+    };
+
+    // Removes entries of freed forms from a table keyed by forms, once it doubled its size since the last pruning
+    // Entries keep a weak reference to their form in the member `form`
+    template <typename Table, typename Entry>
+    void PruneForms(Table& table, std::size_t& pruned, Weak<MalList> Entry::*form) {
+        if (table.size() < 2 * pruned + 64)
+            return;
+        for (auto it = table.begin(); it != table.end();) {
+            if ((it->second.*form).expired())
+                it = table.erase(it);
+            else
+                ++it;
+        }
+        pruned = table.size();
+    }
+
+    // The key of a form in the table of fold marks: its list, or the list view of a vector literal
+    inline const Ref<MalList>& FoldForm(const MalValue& form) {
+        static const Ref<MalList> none;
+        if (form.tag == List_T)
+            return form.li;
+        if (form.tag == Vector_T)
+            return mh::as_list(form);
+        return none;
+    }
+
     class Interpreter {
         void InitEnv();
-        std::array<std::shared_ptr<MalString>, 10> InitSymbols();
 
         MalValue EvalAst(const MalValue& expr, const EnvironFrame& env);
-        bool Apply(MalAtom& curr, EnvironFrame& env, const MalValue& func, std::shared_ptr<MalList> args);
-        MalValue QuasiQuote(const MalValue& expr);
+        bool Apply(MalAtom& curr, EnvironFrame& env, const MalValue& func, Ref<MalList> args);
+        bool Continue(MalAtom& curr, EnvironFrame& env);
+        bool ReadFold(MalAtom& curr, const EnvironFrame& env);
+        bool NextArgument(MalAtom& curr, EnvironFrame& env);
+        bool Recur(MalAtom& curr, EnvironFrame& env, MalArgs&& values);
+        const MalValue* CachedCallee(const MalList* form, const EnvironFrame& env);
+        void PushFrame(EvalFrame&& frame);
+        MalValue CreateFunction(const Ref<MalList>& args, const EnvironFrame& env, MalFunction::FKind kind);
+        // Runs a function compiled to bytecode (see: vm.cpp)
+        MalValue RunCompiled(const MalFunction& func, MalArgs&& args);
+        // Runs bytecode in `env`, starting with `stack` on the stack
+        MalValue RunCode(std::shared_ptr<const Code> code, EnvironFrame env, std::vector<MalValue>&& stack);
 
         // ! WARNING: Platform specific
         std::size_t recursion_depth = 0;
+        // Explicit stack of the evaluator, shared by all nested invocations of EvaluateExpression
+        std::vector<EvalFrame> eval_stack;
+        // Frames pushed by the innermost invocation of EvaluateExpression are above `eval_base`
+        std::size_t eval_base = 0;
+        // Functions whose purity is being analyzed
+        std::vector<const MalFunction*> purity_stack;
+
+        // Expansion of a macro call (see: expansion.cpp)
+        struct Expansion {
+            Weak<MalList> form; // Detects reuse of the address of a freed form
+            Ref<MalFunction> macro;
+            MalAtom value;
+        };
+        // Expansions keyed by the call form
+        std::unordered_map<const MalList*, Expansion> expansions;
+        // Dead forms are removed when the table doubles its size
+        std::size_t expansions_pruned = 0;
+        void PreExpand(const MalValue& expr, const EnvironFrame& env, std::size_t depth = 0);
+
+        // Constant expression found by the folding pass, keyed by its list (by the list view of a vector literal)
+        // The mark is kept out of the metadata of the form: a form shared by several bodies may be constant in some of them only
+        struct FoldMark {
+            Weak<MalList> form;
+            std::size_t epoch; // Of the global environment when the form was analyzed
+            std::vector<std::string> names; // Free names of the form, global where it was analyzed
+            bool valued = false; // Set by the first evaluation
+            MalAtom value;
+        };
+        std::unordered_map<const MalList*, FoldMark> folds;
+        std::size_t folds_pruned = 0;
+        void StoreFold(const MalValue& form, const MalValue& value);
+
+        // Inline cache of a call whose callee is a global name (see: RegisterCallSite)
+        struct CallSite {
+            Weak<MalList> form;
+            std::shared_ptr<GlobalCell> cell;
+            std::size_t version; // Version of the cell, whose value was checked to be a function
+            std::shared_ptr<const SlotNames> frame; // Slots of the last frame found not to bind the name
+        };
+        std::unordered_map<const MalList*, CallSite> call_sites;
+        std::size_t call_sites_pruned = 0;
+
+        // Slots of the environments made by a let* form, keyed by its list of bindings
+        struct LetScope {
+            Weak<MalList> bindings;
+            std::shared_ptr<const SlotNames> names;
+        };
+        std::unordered_map<const MalList*, LetScope> let_scopes;
+        std::size_t let_scopes_pruned = 0;
+        const std::shared_ptr<const SlotNames>& LetSlots(const Ref<MalList>& bindings);
+
+        // Bytecode of the rest of a loop whose iterations reached the tier-up threshold, keyed by the loop form
+        struct LoopCode {
+            Weak<MalList> form;
+            bool global; // Compiled for a loop enclosed by the global environment
+            std::shared_ptr<const Code> code; // nullptr if the loop is left to the tree-walker
+        };
+        std::unordered_map<const MalList*, LoopCode> loop_code;
+        std::size_t loop_code_pruned = 0;
+        std::shared_ptr<const Code> TierUpLoop(const MalValue& form, const EnvironFrame& env);
     public:
+        // Limit of native reentries into the evaluator (builtins calling functions, macro expansions, VM <-> tree transitions)
         static constexpr std::size_t MAX_RECURSION_DEPTH = 500;
+        static constexpr std::size_t DEFAULT_STACK_LIMIT = 1000000;
+        // Limit of evaluator frames and VM frames (they don't use the native stack)
+        std::size_t stack_limit = DEFAULT_STACK_LIMIT;
+
+        // Evaluation strategy used for function bodies
+        enum class Engine {
+            Tree, // Walk the code values directly
+            VM,   // Compile function bodies to bytecode when they are created
+        } engine = Engine::Tree;
+        // Expand macro calls in function bodies when the functions are created, instead of on the first evaluation
+        bool pre_expand = false;
+        static constexpr std::size_t DEFAULT_TIER_THRESHOLD = 100;
+        // Calls after which the tree-walker compiles a function to bytecode, 0 disables the compilation
+        std::size_t tier_threshold = DEFAULT_TIER_THRESHOLD;
+        // Counts a call of a function without bytecode, returns true if the function has been compiled
+        bool TierUp(MalFunction& func);
 
         EnvironFrame env_global;
+        // Functions used by quasiquote expansions
+        std::shared_ptr<GlobalCell> quasiquote_cons, quasiquote_concat;
         Printer& printer;
+        // Builtins without side effects, calls to them may be folded (see: folding.cpp)
+        std::unordered_set<const Builtin*> pure_builtins;
 
         StringInternPool str_interner;
-        // Interned symbols
-        enum {
-            symDef, symLet, symDo, symIf, symFn, symMacro,
-            symQuote, symQuasiquote, symMacroexpand, symTry
-        };
-        std::array<std::shared_ptr<MalString>, 10> symbols_form;
+        // Frees cycles of closures, environments and atoms (see: collector.cpp)
+        CycleCollector collector;
 
-        Interpreter(Printer& printer) : printer{printer}, symbols_form{InitSymbols()} {
+        Interpreter(Printer& printer) : printer{printer} {
             InitEnv();
         }
 
         MalValue EvalFunction(const MalFunction& func, MalArgs&& args);
+        MalValue QuasiQuote(const MalValue& expr);
         MalValue EvaluateExpression(const MalValue& expr, EnvironFrame env);
+        // Calls through inline caches that found the callee resolved (hits) or had to check it (misses)
+        std::size_t call_cache_hits = 0, call_cache_misses = 0;
+        // Marks `form` as a call of the global binding `name`, the tree-walker then resolves the callee through an inline cache
+        // where the name is not bound in a local environment
+        void RegisterCallSite(const MalValue& form, const std::string& name);
+        // Returns the cached expansion of the macro call `form`, if it was expanded by `macro`
+        const MalValue* CachedExpansion(const MalValue& form, const MalFunction& macro) const;
+        void CacheExpansion(const MalValue& form, Ref<MalFunction> macro, const MalValue& expansion);
+        // Expands the macro call `form` once, later calls return the cached expansion
+        MalValue ExpandMacro(const MalValue& form, const Ref<MalFunction>& macro);
+        // Marks constant subexpressions of a global function's body (see: folding.cpp)
+        void FoldFunction(const MalFunction& func);
+        // Marks `form` as a constant expression whose free names are `names`
+        void MarkFold(const MalValue& form, std::vector<std::string>&& names);
+        // The form has a fold mark, which the tree-walker serves where the free names are global
+        bool IsFolded(const MalValue& form) const;
+        // Re-analyzes an expression with an outdated fold mark, returns true if it's still constant
+        bool Refold(const MalValue& expr);
+        // A function is pure if its calls have no side effects and depend only on the arguments
+        bool IsPure(const MalFunction& func);
+        // Forms of the calls currently being evaluated, innermost first
+        Ref<MalList> CallStack() const;
         inline MalValue InvokeFunction(const MalValue& func, MalArgs&& args) { // func must be invokable
             if (func.tag == Builtin_T)
-                return func.blt(*this, std::move(args));
+                return func.blt->call(*this, std::move(args));
             // Function_T
             return EvalFunction(*func.fun, std::move(args));
         }
     };
 
+    // Reads a parameter list of `fn`/`macro` form
+    void ParseParameters(const MalValue& spec, std::vector<MalString::string_t>& params, MalString::string_t& param_var);
+
+    // Collects names bound with `def` anywhere in the code
+    // Such names may shadow outer bindings at runtime
+    void CollectDefs(const MalValue& expr, std::vector<std::string>& names);
+
+    // Binds the arguments to the slots of a new call frame (see: FramePool)
+    EnvironFrame PrepareFunctionCall(const MalFunction& func, MalArgs&& args);
+
+    // Binds the next values of the variables of a loop, in place unless a closure captured the environment
+    // The caller must drop its own references to the environment first
+    void RebindLoop(EnvironFrame& env, MalValue* values, std::size_t count);
+
     /*struct interpreter {
         std::unique_ptr<mal_error> i_error;
     };
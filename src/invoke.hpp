@@ -1,72 +1,292 @@
 #pragma once
 
 #include "malvalue.hpp"
+#include "ref.hpp"
 
+#include <new>
 #include <vector>
 #include <unordered_map>
 
 namespace mal {
+    // Arguments of a call, stored inline up to INLINE_COUNT values (the typical arities) and on the heap beyond
+    // Callees consume the values by moving them out (see: operator[] &&)
     struct MalArgs {
-        std::vector<MalValue> vec;
+        static constexpr std::size_t INLINE_COUNT = 4;
 
-        std::size_t size() const { return vec.size(); }
+        MalArgs() = default;
 
-        MalArgs(const std::shared_ptr<MalList>& list) {
-            vec.reserve(list->GetSize());
-            for (const MalList* l = list.get(); l != nullptr; l = l->Rest().get())
-                vec.push_back(l->First());
+        MalArgs(const Ref<MalList>& list) {
+            for (const MalList* l = list.get(); l != nullptr; l = l->Next())
+                push_back(MalValue{l->First()});
         }
 
-        MalArgs(std::initializer_list<MalValue> init) : vec{init} {}
+        MalArgs(std::initializer_list<MalValue> init) {
+            reserve(init.size());
+            for (const MalValue& v : init)
+                push_back(MalValue{v});
+        }
+
+        MalArgs(MalArgs&& other) noexcept {
+            if (other.values != other.Inline()) {
+                values = other.values;
+                capacity = other.capacity;
+                count = other.count;
+                other.values = other.Inline();
+                other.capacity = INLINE_COUNT;
+                other.count = 0;
+                return;
+            }
+            for (std::size_t i = 0; i < other.count; ++i)
+                new (values + i) MalValue{std::move(other.values[i])};
+            count = other.count;
+            other.clear();
+        }
+
+        ~MalArgs() {
+            clear();
+            if (values != Inline())
+                ::operator delete(values);
+        }
+
+        std::size_t size() const { return count; }
+
+        void reserve(std::size_t n) {
+            if (n > capacity)
+                Grow(n);
+        }
+
+        void push_back(MalValue&& value) {
+            if (count == capacity)
+                Grow(2 * capacity);
+            new (values + count) MalValue{std::move(value)};
+            ++count;
+        }
+
+        void clear() {
+            for (; count > 0; --count)
+                values[count - 1].~MalValue();
+        }
 
         const MalValue& operator[](std::size_t i) const& {
-            return vec[i];
+            return values[i];
         }
 
         MalValue&& operator[](std::size_t i) && {
-            return std::move(vec[i]);
+            return std::move(values[i]);
         }
 
-        decltype(vec)::iterator begin() {
-            return vec.begin();
+        MalValue* begin() {
+            return values;
         }
 
-        decltype(vec)::iterator end() {
-            return vec.end();
+        MalValue* end() {
+            return values + count;
         }
 
+        MalArgs(const MalArgs&) = delete;
         MalArgs& operator=(const MalArgs&) = delete;
         MalArgs& operator=(MalArgs&&) = delete;
+
+    private:
+        alignas(MalValue) unsigned char storage[INLINE_COUNT * sizeof(MalValue)];
+        MalValue* values = Inline();
+        std::size_t count = 0;
+        std::size_t capacity = INLINE_COUNT;
+
+        MalValue* Inline() {
+            return reinterpret_cast<MalValue*>(storage);
+        }
+
+        void Grow(std::size_t n) {
+            MalValue* heap = static_cast<MalValue*>(::operator new(n * sizeof(MalValue)));
+            for (std::size_t i = 0; i < count; ++i) {
+                new (heap + i) MalValue{std::move(values[i])};
+                values[i].~MalValue();
+            }
+            if (values != Inline())
+                ::operator delete(values);
+            values = heap;
+            capacity = n;
+        }
     };
 
     class Environment;
-    using EnvironFrame = std::shared_ptr<Environment>;
+    using EnvironFrame = Ref<Environment>;
+
+    // Names of lexically addressed slots of an environment
+    using SlotNames = std::vector<std::string>;
+
+    // A binding of the global environment
+    // Cells are created on the first reference and never move, so code can keep pointers to them
+    // Redefinition of a global name updates its cell in place
+    struct GlobalCell {
+        MalAtom value;
+        bool bound = false;
+        bool redefined = false; // Bound more than once, the value is not considered constant
+        bool pinned = false; // Folded code relies on the value (see: folding.cpp)
+        std::size_t version = 0; // Incremented on every change of the value
+        std::string name;
+
+        GlobalCell(const std::string& name) : name{name} {}
+
+        const MalValue& get() const {
+            if (!bound)
+                throw mal_error{"Cannot find '" + name + "' in current context"};
+            return value.v;
+        }
+    };
 
     struct Environment {
         std::unordered_map<std::string, MalAtom> data;
+        // Bindings of the global environment, used instead of `data`
+        std::unordered_map<std::string, std::shared_ptr<GlobalCell>> cells;
+        bool global = false;
+        // Incremented when a pinned global binding changes, which invalidates folded code (global environment only)
+        std::size_t epoch = 0;
+        // Parameters and let* bindings, addressed by name or lexically by compiled code (see: compiler.cpp)
+        // Only the first slots.size() names are bound
+        std::vector<MalAtom> slots;
+        std::shared_ptr<const SlotNames> slot_names;
         EnvironFrame outer;
+        // Captured by a closure, watched by the cycle collector (see: collector.cpp)
+        bool tracked = false;
 
         Environment(EnvironFrame outer = nullptr) : outer{std::move(outer)} {}
+        Environment(EnvironFrame outer, std::shared_ptr<const SlotNames> names) : slot_names{std::move(names)}, outer{std::move(outer)} {
+            slots.reserve(slot_names->size());
+        }
+
+        // Returns the cell of a global binding, creating an unbound one if needed
+        const std::shared_ptr<GlobalCell>& cell(const std::string& key) {
+            auto& c = cells[key];
+            if (!c)
+                c = std::make_shared<GlobalCell>(key);
+            return c;
+        }
 
         void set(const std::string& key, MalValue&& value) {
-            data[key] = std::move(value);
+            if (global) {
+                auto& c = *cell(key);
+                if (c.pinned) {
+                    c.pinned = false;
+                    ++epoch;
+                }
+                c.redefined = c.bound;
+                ++c.version;
+                c.value = std::move(value);
+                c.bound = true;
+            } else if (MalAtom* slot = find_slot(key))
+                *slot = std::move(value);
+            else
+                data[key] = std::move(value);
         }
 
         void set(const std::string& key, const MalValue& value) {
-            data[key] = value;
+            set(key, MalValue{value});
         }
 
-        MalValue lookup(const std::string& key) {
+        // Returns nullptr if the key is not bound
+        const MalAtom* find(const std::string& key) const {
             for (const Environment* env = this; env != nullptr; env = env->outer.get()) {
+                if (const MalAtom* slot = env->find_slot(key))
+                    return slot;
+                if (env->global) {
+                    auto entry = env->cells.find(key);
+                    if (entry != env->cells.cend() && entry->second->bound)
+                        return &entry->second->value;
+                    continue;
+                }
+                if (env->data.empty())
+                    continue;
                 auto entry = env->data.find(key);
                 if (entry != env->data.cend()) {
-                    return entry->second.get();
+                    return &entry->second;
                 }
             }
+            return nullptr;
+        }
+
+        // Whether an environment of the chain other than the global one binds `key`
+        bool binds_locally(const std::string& key) const {
+            for (const Environment* env = this; env != nullptr && !env->global; env = env->outer.get()) {
+                if (env->find_slot(key) || (!env->data.empty() && env->data.count(key) != 0))
+                    return true;
+            }
+            return false;
+        }
+
+        const MalValue& lookup(const std::string& key) const {
+            if (const MalAtom* value = find(key))
+                return value->get();
             throw mal_error{"Cannot find '" + key + "' in current context"};
         }
+
+        // Resolves a lexical address
+        const MalAtom& at(std::size_t depth, std::size_t slot) const {
+            const Environment* env = this;
+            for (; depth > 0; --depth)
+                env = env->outer.get();
+            return env->slots[slot];
+        }
+
+    private:
+        // The last bound slot with the given name
+        MalAtom* find_slot(const std::string& key) const {
+            for (std::size_t i = slots.size(); i > 0; --i) {
+                if ((*slot_names)[i-1] == key)
+                    return const_cast<MalAtom*>(&slots[i-1]);
+            }
+            return nullptr;
+        }
+    };
+
+    // Environments of function calls and let* forms are recycled: when the last reference to a frame
+    // is dropped (no closure captured it), the object keeps the storage of its slots and returns to the pool
+    class FramePool {
+        static constexpr std::size_t MAX_FREE = 1024;
+        std::vector<Environment*> free;
+
+        // Never destroyed, frames may be released during the destruction of other statics
+        static FramePool& Get() {
+            static auto* pool = new FramePool();
+            return *pool;
+        }
+
+        friend void Free(Environment* env);
+    public:
+        // Returns a frame with unbound slots named by `names`
+        static EnvironFrame Make(EnvironFrame outer, std::shared_ptr<const SlotNames> names) {
+            FramePool& pool = Get();
+            EnvironFrame env;
+            if (pool.free.empty())
+                env = MakeRef<Environment>();
+            else {
+                env = EnvironFrame::Revive(pool.free.back());
+                pool.free.pop_back();
+            }
+            env->outer = std::move(outer);
+            env->slots.reserve(names->size());
+            env->slot_names = std::move(names);
+            return env;
+        }
     };
 
+    inline void Free(Environment* env) {
+        FramePool& pool = FramePool::Get();
+        // A frame watched by weak references (see: CycleCollector) must not come back as another frame
+        if (pool.free.size() >= FramePool::MAX_FREE || EnvironFrame::WeakCount(env) != 0) {
+            EnvironFrame::Destroy(env);
+            return;
+        }
+        // Releasing the bindings may recycle other frames
+        env->slots.clear();
+        env->data.clear();
+        env->slot_names.reset();
+        env->outer.reset();
+        env->tracked = false;
+        pool.free.push_back(env);
+    }
+
     template <std::size_t max_depth>
     struct RecursionGuard {
         std::size_t& guard;
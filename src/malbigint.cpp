@@ -0,0 +1,363 @@
+#include "malbigint.hpp"
+
+#include <algorithm>
+#include <utility>
+
+namespace {
+    using namespace mal;
+
+    using limb_t = MalBigInt::limb_t;
+    using Limbs = std::vector<limb_t>;
+
+    constexpr std::uint64_t BASE = std::uint64_t{1} << 32;
+    // Operands shorter than this (in limbs) are multiplied by the schoolbook method
+    constexpr std::size_t KARATSUBA_THRESHOLD = 32;
+    // The largest power of 10 that fits in a limb, numbers are printed and read in groups of its digits
+    constexpr limb_t DECIMAL_BASE = 1000000000;
+    constexpr std::size_t DECIMAL_DIGITS = 9;
+
+    void Trim(Limbs& a) {
+        while (!a.empty() && a.back() == 0)
+            a.pop_back();
+    }
+
+    Limbs Magnitude(std::uint64_t v) {
+        Limbs a;
+        for (; v != 0; v >>= 32)
+            a.push_back(static_cast<limb_t>(v));
+        return a;
+    }
+
+    // A number as a sign and a magnitude, fixnums are converted to a temporary
+    struct Operand {
+        Limbs fixnum;
+        const Limbs* mag;
+        bool negative;
+
+        explicit Operand(const MalValue& v) {
+            if (v.tag == Int_T) {
+                negative = v.no < 0;
+                // Negated in unsigned arithmetic, the minimal fixnum has no positive counterpart
+                fixnum = Magnitude(negative ? 0 - static_cast<std::uint64_t>(v.no) : static_cast<std::uint64_t>(v.no));
+                mag = &fixnum;
+            } else {
+                negative = v.bi->negative;
+                mag = &v.bi->limbs;
+            }
+        }
+
+        Operand(const Operand&) = delete;
+        Operand& operator=(const Operand&) = delete;
+    };
+
+    // Returns a fixnum if the number fits in one
+    MalValue Normalize(bool negative, Limbs&& mag) {
+        Trim(mag);
+        if (mag.size() <= 2) {
+            std::uint64_t v = 0;
+            for (std::size_t i = mag.size(); i > 0; --i)
+                v = (v << 32) | mag[i - 1];
+            constexpr auto max = static_cast<std::uint64_t>(std::numeric_limits<std::int64_t>::max());
+            if (!negative && v <= max)
+                return MalValue{static_cast<std::int64_t>(v)};
+            if (negative && v <= max + 1)
+                return MalValue{static_cast<std::int64_t>(0 - v)};
+        }
+        auto big = MalBigInt::Make();
+        big->limbs = std::move(mag);
+        big->negative = negative;
+        return MalValue{std::move(big)};
+    }
+
+    int CompareMagnitudes(const Limbs& a, const Limbs& b) {
+        if (a.size() != b.size())
+            return a.size() < b.size() ? -1 : 1;
+        for (std::size_t i = a.size(); i > 0; --i) {
+            if (a[i - 1] != b[i - 1])
+                return a[i - 1] < b[i - 1] ? -1 : 1;
+        }
+        return 0;
+    }
+
+    Limbs AddMagnitudes(const Limbs& a, const Limbs& b) {
+        const Limbs& longer = a.size() >= b.size() ? a : b;
+        const Limbs& shorter = a.size() >= b.size() ? b : a;
+        Limbs r(longer.size() + 1);
+        std::uint64_t carry = 0;
+        for (std::size_t i = 0; i < longer.size(); ++i) {
+            carry += longer[i];
+            if (i < shorter.size())
+                carry += shorter[i];
+            r[i] = static_cast<limb_t>(carry);
+            carry >>= 32;
+        }
+        r.back() = static_cast<limb_t>(carry);
+        Trim(r);
+        return r;
+    }
+
+    // Requires a >= b
+    Limbs SubMagnitudes(const Limbs& a, const Limbs& b) {
+        Limbs r(a.size());
+        std::int64_t borrow = 0;
+        for (std::size_t i = 0; i < a.size(); ++i) {
+            std::int64_t d = static_cast<std::int64_t>(a[i]) - borrow - (i < b.size() ? b[i] : 0);
+            borrow = d < 0;
+            r[i] = static_cast<limb_t>(d + (borrow ? BASE : 0));
+        }
+        Trim(r);
+        return r;
+    }
+
+    // Adds `b` shifted by `shift` limbs to `r`, which must be long enough to hold the sum
+    void AddShifted(Limbs& r, const Limbs& b, std::size_t shift) {
+        std::uint64_t carry = 0;
+        std::size_t i = 0;
+        for (; i < b.size(); ++i) {
+            carry += static_cast<std::uint64_t>(r[shift + i]) + b[i];
+            r[shift + i] = static_cast<limb_t>(carry);
+            carry >>= 32;
+        }
+        for (; carry != 0; ++i) {
+            carry += r[shift + i];
+            r[shift + i] = static_cast<limb_t>(carry);
+            carry >>= 32;
+        }
+    }
+
+    Limbs MulSchoolbook(const Limbs& a, const Limbs& b) {
+        Limbs r(a.size() + b.size());
+        for (std::size_t i = 0; i < a.size(); ++i) {
+            std::uint64_t carry = 0;
+            for (std::size_t j = 0; j < b.size(); ++j) {
+                carry += static_cast<std::uint64_t>(a[i]) * b[j] + r[i + j];
+                r[i + j] = static_cast<limb_t>(carry);
+                carry >>= 32;
+            }
+            r[i + b.size()] = static_cast<limb_t>(carry);
+        }
+        Trim(r);
+        return r;
+    }
+
+    Limbs Slice(const Limbs& a, std::size_t from, std::size_t to) {
+        from = std::min(from, a.size());
+        to = std::min(to, a.size());
+        Limbs r(a.begin() + from, a.begin() + to);
+        Trim(r);
+        return r;
+    }
+
+    // Karatsuba: with a = a1 B^m + a0 and b = b1 B^m + b0, the product takes three multiplications of halves,
+    // a0 b0, a1 b1 and (a0 + a1)(b0 + b1), instead of four: O(n^1.58) rather than O(n^2)
+    Limbs MulMagnitudes(const Limbs& a, const Limbs& b) {
+        if (a.empty() || b.empty())
+            return {};
+        if (std::min(a.size(), b.size()) < KARATSUBA_THRESHOLD)
+            return MulSchoolbook(a, b);
+        std::size_t m = std::max(a.size(), b.size()) / 2;
+        Limbs a0 = Slice(a, 0, m), a1 = Slice(a, m, a.size());
+        Limbs b0 = Slice(b, 0, m), b1 = Slice(b, m, b.size());
+        Limbs z0 = MulMagnitudes(a0, b0);
+        Limbs z2 = MulMagnitudes(a1, b1);
+        Limbs z1 = SubMagnitudes(SubMagnitudes(MulMagnitudes(AddMagnitudes(a0, a1), AddMagnitudes(b0, b1)), z0), z2);
+        Limbs r(a.size() + b.size() + 1);
+        AddShifted(r, z0, 0);
+        AddShifted(r, z1, m);
+        AddShifted(r, z2, 2 * m);
+        Trim(r);
+        return r;
+    }
+
+    // Divides by one limb, returns the remainder
+    limb_t DivSmall(Limbs& a, limb_t d) {
+        std::uint64_t rem = 0;
+        for (std::size_t i = a.size(); i > 0; --i) {
+            std::uint64_t cur = (rem << 32) | a[i - 1];
+            a[i - 1] = static_cast<limb_t>(cur / d);
+            rem = cur % d;
+        }
+        Trim(a);
+        return static_cast<limb_t>(rem);
+    }
+
+    void MulAddSmall(Limbs& a, limb_t mul, limb_t add) {
+        std::uint64_t carry = add;
+        for (limb_t& limb : a) {
+            carry += static_cast<std::uint64_t>(limb) * mul;
+            limb = static_cast<limb_t>(carry);
+            carry >>= 32;
+        }
+        if (carry != 0)
+            a.push_back(static_cast<limb_t>(carry));
+    }
+
+    int CountLeadingZeros(limb_t v) {
+        int n = 0;
+        for (; (v & 0x80000000u) == 0; v <<= 1)
+            ++n;
+        return n;
+    }
+
+    // Long division of magnitudes (Knuth, TAOCP vol. 2, 4.3.1, algorithm D), `v` must not be zero
+    void DivModMagnitudes(const Limbs& u, const Limbs& v, Limbs& q, Limbs& r) {
+        if (CompareMagnitudes(u, v) < 0) {
+            q.clear();
+            r = u;
+            return;
+        }
+        if (v.size() == 1) {
+            q = u;
+            limb_t rem = DivSmall(q, v[0]);
+            r = rem != 0 ? Limbs{rem} : Limbs{};
+            return;
+        }
+        std::size_t n = v.size(), m = u.size() - n;
+        // Normalized, the top limb of the divisor has its high bit set, so the estimates of the quotient digits are off by at most 2
+        int s = CountLeadingZeros(v.back());
+        Limbs vn(n), un(u.size() + 1);
+        for (std::size_t i = n - 1; i > 0; --i)
+            vn[i] = (v[i] << s) | (s ? static_cast<limb_t>(static_cast<std::uint64_t>(v[i - 1]) >> (32 - s)) : 0);
+        vn[0] = v[0] << s;
+        un[u.size()] = s ? static_cast<limb_t>(static_cast<std::uint64_t>(u.back()) >> (32 - s)) : 0;
+        for (std::size_t i = u.size() - 1; i > 0; --i)
+            un[i] = (u[i] << s) | (s ? static_cast<limb_t>(static_cast<std::uint64_t>(u[i - 1]) >> (32 - s)) : 0);
+        un[0] = u[0] << s;
+
+        q.assign(m + 1, 0);
+        for (std::size_t j = m + 1; j-- > 0;) {
+            std::uint64_t num = (static_cast<std::uint64_t>(un[j + n]) << 32) | un[j + n - 1];
+            std::uint64_t qhat = num / vn[n - 1];
+            std::uint64_t rhat = num % vn[n - 1];
+            while (qhat >= BASE || qhat * vn[n - 2] > ((rhat << 32) | un[j + n - 2])) {
+                --qhat;
+                rhat += vn[n - 1];
+                if (rhat >= BASE)
+                    break;
+            }
+            // Subtract qhat * vn from the current window of un
+            std::int64_t borrow = 0, t;
+            for (std::size_t i = 0; i < n; ++i) {
+                std::uint64_t p = qhat * vn[i];
+                t = static_cast<std::int64_t>(un[i + j]) - borrow - static_cast<std::int64_t>(p & 0xFFFFFFFF);
+                un[i + j] = static_cast<limb_t>(t);
+                borrow = static_cast<std::int64_t>(p >> 32) - (t >> 32);
+            }
+            t = static_cast<std::int64_t>(un[j + n]) - borrow;
+            un[j + n] = static_cast<limb_t>(t);
+            q[j] = static_cast<limb_t>(qhat);
+            if (t < 0) {
+                // The estimate was one too large, add the divisor back
+                --q[j];
+                std::uint64_t carry = 0;
+                for (std::size_t i = 0; i < n; ++i) {
+                    carry += static_cast<std::uint64_t>(un[i + j]) + vn[i];
+                    un[i + j] = static_cast<limb_t>(carry);
+                    carry >>= 32;
+                }
+                un[j + n] += static_cast<limb_t>(carry);
+            }
+        }
+        Trim(q);
+        r.assign(n, 0);
+        for (std::size_t i = 0; i < n; ++i)
+            r[i] = (un[i] >> s) | (s ? static_cast<limb_t>(static_cast<std::uint64_t>(un[i + 1]) << (32 - s)) : 0);
+        Trim(r);
+    }
+
+    MalValue AddSigned(bool a_negative, const Limbs& a, bool b_negative, const Limbs& b) {
+        if (a_negative == b_negative)
+            return Normalize(a_negative, AddMagnitudes(a, b));
+        if (CompareMagnitudes(a, b) >= 0)
+            return Normalize(a_negative, SubMagnitudes(a, b));
+        return Normalize(b_negative, SubMagnitudes(b, a));
+    }
+
+    bool IsZero(const MalValue& v) {
+        return v.tag == Int_T && v.no == 0;
+    }
+}
+
+namespace mal {
+    std::string MalBigInt::ToString() const {
+        Limbs rest = limbs;
+        std::vector<limb_t> groups;
+        while (!rest.empty())
+            groups.push_back(DivSmall(rest, DECIMAL_BASE));
+        std::string str = negative ? "-" : "";
+        str += std::to_string(groups.empty() ? 0 : groups.back());
+        for (std::size_t i = groups.size() - 1; i-- > 0;) {
+            std::string group = std::to_string(groups[i]);
+            str.append(DECIMAL_DIGITS - group.size(), '0');
+            str += group;
+        }
+        return str;
+    }
+
+    std::size_t MalBigInt::Hash() const {
+        std::size_t h = negative;
+        for (limb_t limb : limbs)
+            h = h * 1000003 ^ limb;
+        return h;
+    }
+
+    MalValue BigAdd(const MalValue& a, const MalValue& b) {
+        Operand x{a}, y{b};
+        return AddSigned(x.negative, *x.mag, y.negative, *y.mag);
+    }
+
+    MalValue BigSub(const MalValue& a, const MalValue& b) {
+        Operand x{a}, y{b};
+        return AddSigned(x.negative, *x.mag, !y.negative, *y.mag);
+    }
+
+    MalValue BigMul(const MalValue& a, const MalValue& b) {
+        Operand x{a}, y{b};
+        return Normalize(x.negative != y.negative, MulMagnitudes(*x.mag, *y.mag));
+    }
+
+    MalValue BigDiv(const MalValue& a, const MalValue& b) {
+        if (IsZero(b))
+            throw mal_error{"Division by zero"};
+        Operand x{a}, y{b};
+        Limbs q, r;
+        DivModMagnitudes(*x.mag, *y.mag, q, r);
+        return Normalize(x.negative != y.negative, std::move(q));
+    }
+
+    MalValue BigMod(const MalValue& a, const MalValue& b) {
+        if (IsZero(b))
+            throw mal_error{"Division by zero"};
+        Operand x{a}, y{b};
+        Limbs q, r;
+        DivModMagnitudes(*x.mag, *y.mag, q, r);
+        if (r.empty() || x.negative == y.negative)
+            return Normalize(y.negative, std::move(r));
+        // Floored: a nonzero remainder takes the sign of the divisor
+        return Normalize(y.negative, SubMagnitudes(*y.mag, r));
+    }
+
+    int BigCompare(const MalValue& a, const MalValue& b) {
+        Operand x{a}, y{b};
+        if (x.negative != y.negative)
+            return x.negative ? -1 : 1;
+        int c = CompareMagnitudes(*x.mag, *y.mag);
+        return x.negative ? -c : c;
+    }
+
+    MalValue ParseNumber(const std::string& digits) {
+        bool negative = !digits.empty() && digits[0] == '-';
+        std::size_t i = !digits.empty() && (digits[0] == '-' || digits[0] == '+') ? 1 : 0;
+        Limbs mag;
+        while (i < digits.size()) {
+            std::size_t count = std::min(DECIMAL_DIGITS, digits.size() - i);
+            limb_t group = 0, scale = 1;
+            for (std::size_t k = 0; k < count; ++k, ++i) {
+                group = group * 10 + (digits[i] - '0');
+                scale *= 10;
+            }
+            MulAddSmall(mag, scale, group);
+        }
+        return Normalize(negative, std::move(mag));
+    }
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+#include "malvalue.hpp"
+
+#include <cstdint>
+#include <limits>
+#include <string>
+#include <vector>
+
+namespace mal {
+    // An integer out of the range of fixnums [Bigint_T]
+    // Results of the arithmetic are fixnums (Int_T) whenever they fit in 64 bits, so a bignum never equals a fixnum
+    class MalBigInt {
+    public:
+        using limb_t = std::uint32_t;
+
+        // Magnitude in base 2^32, the least significant limb first, without leading zero limbs
+        std::vector<limb_t> limbs;
+        bool negative = false;
+
+        std::string ToString() const;
+        std::size_t Hash() const;
+
+        static Ref<MalBigInt> Make() {
+            return MakeRef<MalBigInt>();
+        }
+    };
+
+    // Fixnum arithmetic, returns false if the result doesn't fit (or the divisor is zero)
+    // The overflow checks are compiler builtins, the common case costs one branch
+    inline bool FixnumAdd(std::int64_t a, std::int64_t b, std::int64_t& r) {
+        return !__builtin_add_overflow(a, b, &r);
+    }
+
+    inline bool FixnumSub(std::int64_t a, std::int64_t b, std::int64_t& r) {
+        return !__builtin_sub_overflow(a, b, &r);
+    }
+
+    inline bool FixnumMul(std::int64_t a, std::int64_t b, std::int64_t& r) {
+        return !__builtin_mul_overflow(a, b, &r);
+    }
+
+    // 64-bit division takes several times longer than 32-bit division on many x86 cores, small operands use the latter
+    inline bool IsSmall(std::int64_t a, std::int64_t b) {
+        return a == static_cast<std::int32_t>(a) && b == static_cast<std::int32_t>(b);
+    }
+
+    // Truncated division
+    inline bool FixnumDiv(std::int64_t a, std::int64_t b, std::int64_t& r) {
+        if (b == 0)
+            return false;
+        if (b == -1)
+            return FixnumSub(0, a, r);
+        r = IsSmall(a, b) ? static_cast<std::int32_t>(a) / static_cast<std::int32_t>(b) : a / b;
+        return true;
+    }
+
+    // Floored modulo, the result has the sign of the divisor
+    inline bool FixnumMod(std::int64_t a, std::int64_t b, std::int64_t& r) {
+        if (b == 0)
+            return false;
+        if (b == -1)
+            r = 0;
+        else
+            r = IsSmall(a, b) ? static_cast<std::int32_t>(a) % static_cast<std::int32_t>(b) : a % b;
+        if (r != 0 && (r < 0) != (b < 0))
+            r += b;
+        return true;
+    }
+
+    // Arithmetic of bignums, or of fixnums whose result overflowed (see: malbigint.cpp)
+    MalValue BigAdd(const MalValue& a, const MalValue& b);
+    MalValue BigSub(const MalValue& a, const MalValue& b);
+    MalValue BigMul(const MalValue& a, const MalValue& b);
+    MalValue BigDiv(const MalValue& a, const MalValue& b);
+    MalValue BigMod(const MalValue& a, const MalValue& b);
+    int BigCompare(const MalValue& a, const MalValue& b);
+
+    // Arithmetic on numbers of any size, the arguments must be numbers
+    inline MalValue NumberAdd(const MalValue& a, const MalValue& b) {
+        std::int64_t r;
+        if (a.tag == Int_T && b.tag == Int_T && FixnumAdd(a.no, b.no, r))
+            return MalValue{r};
+        return BigAdd(a, b);
+    }
+
+    inline MalValue NumberSub(const MalValue& a, const MalValue& b) {
+        std::int64_t r;
+        if (a.tag == Int_T && b.tag == Int_T && FixnumSub(a.no, b.no, r))
+            return MalValue{r};
+        return BigSub(a, b);
+    }
+
+    inline MalValue NumberMul(const MalValue& a, const MalValue& b) {
+        std::int64_t r;
+        if (a.tag == Int_T && b.tag == Int_T && FixnumMul(a.no, b.no, r))
+            return MalValue{r};
+        return BigMul(a, b);
+    }
+
+    // Throws on division by zero
+    inline MalValue NumberDiv(const MalValue& a, const MalValue& b) {
+        std::int64_t r;
+        if (a.tag == Int_T && b.tag == Int_T && FixnumDiv(a.no, b.no, r))
+            return MalValue{r};
+        return BigDiv(a, b);
+    }
+
+    inline MalValue NumberMod(const MalValue& a, const MalValue& b) {
+        std::int64_t r;
+        if (a.tag == Int_T && b.tag == Int_T && FixnumMod(a.no, b.no, r))
+            return MalValue{r};
+        return BigMod(a, b);
+    }
+
+    // Returns a negative number, zero or a positive number
+    inline int NumberCompare(const MalValue& a, const MalValue& b) {
+        if (a.tag == Int_T && b.tag == Int_T)
+            return (a.no > b.no) - (a.no < b.no);
+        return BigCompare(a, b);
+    }
+
+    // Reads a decimal number, `digits` may start with a sign
+    MalValue ParseNumber(const std::string& digits);
+}
@@ -6,23 +6,41 @@
 
 namespace mal {
     class Environment;
+    struct Code;
     
     class MalFunction {
     public:
         std::vector<MalString::string_t> params;
         MalString::string_t param_var;
-        std::shared_ptr<Environment> env;
+        Ref<Environment> env;
         MalValue body;
         enum FKind {
             KFunc = 0,
             KMacro = 1,
         } kind;
+        // Bytecode of the body, set when the VM engine is used or the function gets hot (see: Interpreter/TierUp)
+        std::shared_ptr<const Code> code;
+        // Calls evaluated by the tree-walker
+        std::size_t calls = 0;
+        // Result of the purity analysis, valid while the global environment is at `purity_epoch` (see: Interpreter::IsPure)
+        mutable std::size_t purity_epoch = static_cast<std::size_t>(-1);
+        mutable bool pure = false;
+        // Slots of the call frame: the parameters, then the variadic parameter
+        std::shared_ptr<const SlotNames> frame;
+        MetaMark meta;
 
-        MalFunction(std::vector<MalString::string_t>&& params, MalString::string_t param_var, std::shared_ptr<Environment> env, const MalValue& body, FKind kind = KFunc)
-          : params{std::move(params)}, param_var{std::move(param_var)}, env{std::move(env)}, body{body}, kind{kind} {}
+        MalFunction(std::vector<MalString::string_t>&& params, MalString::string_t param_var, Ref<Environment> env, const MalValue& body, FKind kind = KFunc, std::shared_ptr<const SlotNames> frame = nullptr)
+          : params{std::move(params)}, param_var{std::move(param_var)}, env{std::move(env)}, body{body}, kind{kind}, frame{std::move(frame)} {
+            if (!this->frame) {
+                auto names = std::make_shared<SlotNames>(this->params);
+                if (IsVariadic())
+                    names->push_back(this->param_var);
+                this->frame = std::move(names);
+            }
+        }
 
-        static std::shared_ptr<MalFunction> Make(std::vector<MalString::string_t>&& params, MalString::string_t param_var, std::shared_ptr<Environment> env, const MalValue& body, FKind kind = KFunc) {
-            return std::make_shared<MalFunction>(std::move(params), std::move(param_var), std::move(env), body, kind);
+        static Ref<MalFunction> Make(std::vector<MalString::string_t>&& params, MalString::string_t param_var, Ref<Environment> env, const MalValue& body, FKind kind = KFunc, std::shared_ptr<const SlotNames> frame = nullptr) {
+            return MakeRef<MalFunction>(std::move(params), std::move(param_var), std::move(env), body, kind, std::move(frame));
         }
 
         bool IsVariadic() const {
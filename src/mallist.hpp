@@ -2,54 +2,78 @@
 
 #include "malvalue.hpp"
 
+#include <cstdint>
+
 namespace mal {
     class MalList {
         MalValue node;
-        std::shared_ptr<MalList> next;
+        Ref<MalList> next;
+        MetaMark meta;
+        // Set once the folding pass finds the list to be a constant expression, so the evaluator
+        // looks for its fold mark (see: Interpreter::ReadFold)
+        mutable bool folded = false;
+        // Hash of the list from this node, 0 until computed (see: MalHash)
+        // 32 bits, so it fits in the padding after the mark and nodes stay 32 bytes
+        mutable std::uint32_t hash = 0;
 
         friend class MalValue;
+        friend class CycleCollector;
+        friend struct MalHash;
+        friend class Interpreter;
     public:
         explicit MalList(MalValue&& val) : node{std::move(val)} {}
 
+        ~MalList() {
+            // Unlink uniquely owned tail nodes one by one, recursive destruction of long lists would overflow the native stack
+            Ref<MalList> p = std::move(next);
+            while (p && p.use_count() == 1)
+                p = std::move(p->next);
+        }
+
         const MalValue& First() const {return node; }
-        std::shared_ptr<MalList> Rest() const {return next; }
+        // Borrowed, copy it to keep the tail beyond the life of this node
+        const Ref<MalList>& Rest() const {return next; }
+        // The next node, for traversals that don't keep it
+        const MalList* Next() const {return next.get(); }
 
         std::size_t GetSize() const {
             const MalList* p = this;
             std::size_t sz;
-            for (sz = 0; p != nullptr; sz++) p = p->Rest().get();
+            for (sz = 0; p != nullptr; sz++) p = p->Next();
             return sz;
         }
 
         const MalValue& At(std::size_t idx) const {
             const MalList* p = this;
-            for (; p != nullptr && idx > 0; idx--) p = p->Rest().get();
+            for (; p != nullptr && idx > 0; idx--) p = p->Next();
             if (p == nullptr)
                 return mh::nil;
             return p->First();
         }
 
-        static std::shared_ptr<MalList> Make(MalValue&& val, std::shared_ptr<MalList> next = nullptr) {
-            auto list = std::make_shared<MalList>(std::move(val));
-            list->next = next;
+        static Ref<MalList> Make(MalValue&& val, Ref<MalList> next = nullptr) {
+            auto list = MakeRef<MalList>(std::move(val));
+            list->next = std::move(next);
             return list;
         }
 
         friend class ListBuilder;
     };
 
+    // Keeps the list alive and walks its nodes without touching their reference counts
     class ListIterator {
-        std::shared_ptr<MalList> val;
+        Ref<MalList> list;
+        const MalList* val;
     public:
-        ListIterator(std::shared_ptr<MalList> value) : val{std::move(value)} {}
+        ListIterator(Ref<MalList> value) : list{std::move(value)}, val{list.get()} {}
 
         ListIterator& operator++() {
             if (val)
-                val = val->Rest();
+                val = val->Next();
             return *this;
         }
 
-        MalValue operator*() {
+        const MalValue& operator*() const {
             if (val)
                 return val->First();
             return mh::nil;
@@ -63,11 +87,11 @@ namespace mal {
     // Utility used to create Mal Linked Lists
     // Ensure that ListBuilder has the only references to the list, because list are immutable
     class ListBuilder {
-        std::shared_ptr<MalList> head = nullptr;
-        std::shared_ptr<MalList> node = nullptr;
+        Ref<MalList> head = nullptr;
+        Ref<MalList> node = nullptr;
 
     public:
-        ListBuilder(/*std::shared_ptr<MalList> head = nullptr*/) {}
+        ListBuilder(/*Ref<MalList> head = nullptr*/) {}
 
         void push(MalValue&& val) {
             if (head == nullptr) {
@@ -86,7 +110,7 @@ namespace mal {
             }
         }
 
-        std::shared_ptr<MalList> release() {
+        Ref<MalList> release() {
             node = nullptr;
             return std::move(head);
         }
@@ -0,0 +1,168 @@
+#include "malvalue.hpp"
+
+namespace {
+    using namespace mal;
+
+    constexpr std::uint32_t SLOT_MASK = (1u << MapNode::BITS) - 1;
+
+    std::uint32_t SlotBit(std::size_t hash, unsigned shift) {
+        return 1u << ((hash >> shift) & SLOT_MASK);
+    }
+
+    // Position of the slot `bit` in the compact array of `bitmap`
+    std::size_t Index(std::uint32_t bitmap, std::uint32_t bit) {
+        return __builtin_popcount(bitmap & (bit - 1));
+    }
+
+    // Makes `node` safe to modify: nodes referenced more than once belong to other versions too, and are copied
+    MapNode& Unshare(Ref<MapNode>& node) {
+        if (node.use_count() > 1)
+            node = MakeRef<MapNode>(*node);
+        return *node;
+    }
+
+    // The elements are moved, values can't be assigned so they are never shifted in place
+    template <typename T>
+    void InsertAt(std::vector<T>& items, std::size_t idx, T&& item) {
+        std::vector<T> out;
+        out.reserve(items.size() + 1);
+        for (std::size_t i = 0; i < items.size(); ++i) {
+            if (i == idx)
+                out.push_back(std::move(item));
+            out.push_back(std::move(items[i]));
+        }
+        if (idx == items.size())
+            out.push_back(std::move(item));
+        items = std::move(out);
+    }
+
+    template <typename T>
+    void RemoveAt(std::vector<T>& items, std::size_t idx) {
+        std::vector<T> out;
+        out.reserve(items.size() - 1);
+        for (std::size_t i = 0; i < items.size(); ++i) {
+            if (i != idx)
+                out.push_back(std::move(items[i]));
+        }
+        items = std::move(out);
+    }
+
+    // Binds `key` in the trie at `node`, returns true if the key is new
+    bool Insert(Ref<MapNode>& node, const MalValue& key, const MalValue& value, std::size_t hash, unsigned shift) {
+        if (node == nullptr)
+            node = MakeRef<MapNode>();
+        MapNode& n = Unshare(node);
+        if (shift >= MapNode::HASH_BITS) {
+            for (auto& entry : n.entries) {
+                if (entry.first == key) {
+                    entry.second = value;
+                    return false;
+                }
+            }
+            n.entries.emplace_back(key, value);
+            return true;
+        }
+        std::uint32_t bit = SlotBit(hash, shift);
+        if (n.nodemap & bit)
+            return Insert(n.nodes[Index(n.nodemap, bit)], key, value, hash, shift + MapNode::BITS);
+        std::size_t idx = Index(n.datamap, bit);
+        if (!(n.datamap & bit)) {
+            n.datamap |= bit;
+            InsertAt(n.entries, idx, MapNode::Entry{key, value});
+            return true;
+        }
+        auto& entry = n.entries[idx];
+        if (entry.first == key) {
+            entry.second = value;
+            return false;
+        }
+        // Both entries move to a subnode, split by the next bits of their hashes
+        Ref<MapNode> sub;
+        Insert(sub, entry.first, entry.second.v, MalHash{}(entry.first), shift + MapNode::BITS);
+        Insert(sub, key, value, hash, shift + MapNode::BITS);
+        RemoveAt(n.entries, idx);
+        n.datamap &= ~bit;
+        InsertAt(n.nodes, Index(n.nodemap, bit), std::move(sub));
+        n.nodemap |= bit;
+        return true;
+    }
+
+    // Removes `key` from the trie at `node`, the key must be bound
+    // Nodes left with a single entry are merged into their parent, so every trie of the same entries has the same shape
+    void Remove(Ref<MapNode>& node, const MalValue& key, std::size_t hash, unsigned shift) {
+        MapNode& n = Unshare(node);
+        if (shift >= MapNode::HASH_BITS) {
+            for (std::size_t i = 0; i < n.entries.size(); ++i) {
+                if (n.entries[i].first == key) {
+                    RemoveAt(n.entries, i);
+                    break;
+                }
+            }
+        } else {
+            std::uint32_t bit = SlotBit(hash, shift);
+            if (n.datamap & bit) {
+                RemoveAt(n.entries, Index(n.datamap, bit));
+                n.datamap &= ~bit;
+            } else {
+                std::size_t idx = Index(n.nodemap, bit);
+                Ref<MapNode>& child = n.nodes[idx];
+                Remove(child, key, hash, shift + MapNode::BITS);
+                if (child == nullptr || (child->nodes.empty() && child->entries.size() == 1)) {
+                    Ref<MapNode> removed = std::move(child);
+                    RemoveAt(n.nodes, idx);
+                    n.nodemap &= ~bit;
+                    if (removed != nullptr) {
+                        n.datamap |= bit;
+                        InsertAt(n.entries, Index(n.datamap, bit), MapNode::Entry{removed->entries.front()});
+                    }
+                }
+            }
+        }
+        if (n.entries.empty() && n.nodes.empty())
+            node.reset();
+    }
+}
+
+namespace mal {
+    const MalValue* MalMap::Find(const MalValue& key) const {
+        std::size_t hash = MalHash{}(key);
+        const MapNode* node = root.get();
+        for (unsigned shift = 0; node != nullptr; shift += MapNode::BITS) {
+            if (shift >= MapNode::HASH_BITS) {
+                for (const auto& entry : node->entries) {
+                    if (entry.first == key)
+                        return &entry.second.v;
+                }
+                return nullptr;
+            }
+            std::uint32_t bit = SlotBit(hash, shift);
+            if (node->datamap & bit) {
+                const auto& entry = node->entries[Index(node->datamap, bit)];
+                return entry.first == key ? &entry.second.v : nullptr;
+            }
+            if (!(node->nodemap & bit))
+                return nullptr;
+            node = node->nodes[Index(node->nodemap, bit)].get();
+        }
+        return nullptr;
+    }
+
+    void MalMap::Set(const MalValue& key, const MalValue& value) {
+        if (Insert(root, key, value, MalHash{}(key), 0))
+            ++count;
+        hash = 0;
+    }
+
+    Ref<MalMap> MalMap::Assoc(const MalValue& key, const MalValue& value) const {
+        auto map = MakeRef<MalMap>(*this);
+        map->Set(key, value);
+        return map;
+    }
+
+    Ref<MalMap> MalMap::Dissoc(const MalValue& key) const {
+        auto map = MakeRef<MalMap>(*this);
+        Remove(map->root, key, MalHash{}(key), 0);
+        --map->count;
+        return map;
+    }
+}
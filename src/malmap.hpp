@@ -2,102 +2,81 @@
 
 #include "malvalue.hpp"
 
-#include <unordered_map>
-#include <stack>
+#include <cstdint>
+#include <utility>
+#include <vector>
 
 namespace mal {
+    // Structural hash, consistent with operator==
+    // Strings, sequences and maps cache their hash, they are immutable once built
     struct MalHash {
         // Implemented in core_lib.cpp
         std::size_t operator ()(const MalValue&) const;
     };
-    struct MapSpec;
 
-    // A hash-map type [Map_T]
-    struct MalMap {
-        std::unordered_map<MalValue, MalAtom, MalHash> data;
-
-        MalMap() {}
-        explicit MalMap(const MapSpec& spec);
-
-        auto Lookup(const MalValue& key) {
-            return data.find(key);
-        }
-
-        void Set(const MalValue& key, const MalValue& value) {
-            data[key] = value;
-        }
-
-        static std::shared_ptr<MalMap> Make(const MapSpec& spec) {
-            return std::make_shared<MalMap>(spec);
-        }
-
-        static std::shared_ptr<MalMap> Make() {
-            return std::make_shared<MalMap>();
-        }
+    // A node of a hash array mapped trie, indexed by BITS bits of the key hashes per level
+    // Slots of a node hold either an entry or a subnode, marked in `datamap` and `nodemap`; both arrays are compact,
+    // in the order of the slots. Below the last level of hash bits, a collision node holds entries of equal hashes
+    // Nodes are shared between the versions of a map, a node is modified in place only while it's referenced once
+    class MapNode {
+    public:
+        static constexpr unsigned BITS = 5;
+        static constexpr unsigned HASH_BITS = 8 * sizeof(std::size_t);
+
+        using Entry = std::pair<MalValue, MalAtom>;
+
+        std::uint32_t datamap = 0;
+        std::uint32_t nodemap = 0;
+        std::vector<Entry> entries;
+        std::vector<Ref<MapNode>> nodes;
     };
 
-    // A hash-map specialisation type [MapSpec_T]
-    // This is a type intended to optimize map construction
-    // via (assoc) and (dissoc) forms, the MapSpec value is
-    // converted to MalMap on use. This might be the only case
-    // when a mal value is mutated
-    struct MapSpec {
-        union {
-            std::shared_ptr<MalMap> v_map;
-            std::shared_ptr<MapSpec> v_spec; // May be null
-        };
-
-        MalValue key;
-        MalValue value; // May be `nil` if unused
-
-        bool s_map; // This spec extends a map (as opposed to another spec)
-        bool s_assoc; // This spec specifies association (as opposed to erasure)
-
-        MapSpec(const MalValue& key, const MalValue& value) : key{key}, value{value} {}
-        ~MapSpec() {
-            if (s_map)
-                v_map.~shared_ptr();
-            else
-                v_spec.~shared_ptr();
+    // A persistent hash-map [Map_T]
+    // Lookups walk at most log32(n) nodes, `Assoc` and `Dissoc` copy the path to the changed node and share the rest
+    class MalMap {
+        std::size_t count = 0;
+        Ref<MapNode> root; // Null if the map is empty
+        MetaMark meta;
+        mutable std::size_t hash = 0; // 0 until computed (see: MalHash)
+
+        friend class MalValue;
+        friend class CycleCollector;
+        friend struct MalHash;
+    public:
+        MalMap() = default;
+        // The copy shares the trie, but not the metadata and the hash
+        MalMap(const MalMap& other) : count{other.count}, root{other.root} {}
+
+        std::size_t GetSize() const {return count; }
+
+        // The value bound to `key`, nullptr if there's none
+        const MalValue* Find(const MalValue& key) const;
+
+        // Binds `key` in place, for maps referenced once (maps being built)
+        void Set(const MalValue& key, const MalValue& value);
+
+        // A new map with `key` bound to `value`
+        Ref<MalMap> Assoc(const MalValue& key, const MalValue& value) const;
+        // A new map without `key`, requires Find(key)
+        Ref<MalMap> Dissoc(const MalValue& key) const;
+
+        // Calls `func` with the key and the value of every entry
+        template <typename F>
+        void ForEach(F&& func) const {
+            if (root)
+                ForEach(*root, func);
         }
 
-        static std::shared_ptr<MapSpec> Make(const std::shared_ptr<MalMap>& map, const MalValue& key, const MalValue& value) {
-            auto m = std::make_shared<MapSpec>(key, value);
-            new (&m->v_map) std::shared_ptr<MalMap>(map);
-            m->s_map = true;
-            return m;
+        static Ref<MalMap> Make() {
+            return MakeRef<MalMap>();
         }
-
-        static std::shared_ptr<MapSpec> Make(const std::shared_ptr<MapSpec>& spec, const MalValue& key, const MalValue& value) {
-            auto m = std::make_shared<MapSpec>(key, value);
-            new (&m->v_spec) std::shared_ptr<MapSpec>(spec);
-            m->s_map = false;
-            return m;
+    private:
+        template <typename F>
+        static void ForEach(const MapNode& node, F& func) {
+            for (const auto& entry : node.entries)
+                func(entry.first, entry.second.v);
+            for (const auto& child : node.nodes)
+                ForEach(*child, func);
         }
     };
-
-    inline MalMap::MalMap(const MapSpec& spec) {
-        std::stack<const MapSpec*> st;
-        const MapSpec* sp = &spec;
-        do {
-            st.push(sp);
-            if (sp->s_map) {
-                data.merge(sp->v_map->data); // Copy underlying map
-                break;
-            }
-            sp = sp->v_spec.get();
-        } while (sp != nullptr);
-        while (!st.empty()) {
-            const auto* sc = st.top();
-            if (sc->s_assoc) {
-                // Insert a key (or overwrite it)
-                data[sc->key] = sc->value;
-            } else {
-                // Erase a key (if it exists)
-                data.erase(sc->key);
-            }
-
-            st.pop();
-        }
-    }
-}
\ No newline at end of file
+}
@@ -0,0 +1,124 @@
+#include "malvalue.hpp"
+
+#include <vector>
+
+namespace mal {
+    // The parts referenced once are unlinked one by one: ropes built by appending are as deep as the number of appends,
+    // recursive destruction would overflow the native stack
+    void MalString::ReleaseParts(Ref<MalString>& left, Ref<MalString>& right) {
+        std::vector<Ref<MalString>> pending;
+        pending.push_back(std::move(left));
+        if (right)
+            pending.push_back(std::move(right));
+        while (!pending.empty()) {
+            Ref<MalString> str = std::move(pending.back());
+            pending.pop_back();
+            if (str.use_count() == 1 && str->left) {
+                pending.push_back(std::move(str->left));
+                if (str->right)
+                    pending.push_back(std::move(str->right));
+            }
+        }
+    }
+
+    MalString::~MalString() {
+        if (left)
+            ReleaseParts(left, right);
+        if (id != 0 && origin == nullptr)
+            SymbolTable::Release(this);
+    }
+
+    void MalString::Flatten() const {
+        string_t out;
+        out.reserve(length);
+        // The rope is walked with an explicit stack, the left parts first
+        std::vector<const MalString*> pending{this};
+        while (!pending.empty()) {
+            const MalString* str = pending.back();
+            pending.pop_back();
+            if (str->left && str->right) {
+                pending.push_back(str->right.get());
+                pending.push_back(str->left.get());
+            } else {
+                out.append(str->View());
+            }
+        }
+        str = std::move(out);
+        ReleaseParts(left, right);
+    }
+
+    Ref<MalString> MalString::Slice(const Ref<MalString>& str, std::size_t start, std::size_t count) {
+        if (count == str->Size())
+            return str;
+        if (count <= SHORT)
+            return Make(string_t{str->View().substr(start, count)});
+        if (str->right)
+            str->Flatten();
+        // A slice of a slice views the flat string directly
+        if (str->left)
+            return MakeRef<MalString>(str->left, nullptr, str->offset + start, count);
+        return MakeRef<MalString>(str, nullptr, start, count);
+    }
+
+    Ref<MalString> MalString::Concat(Ref<MalString> a, Ref<MalString> b) {
+        if (b->Size() == 0)
+            return a;
+        if (a->Size() == 0)
+            return b;
+        std::size_t size = a->Size() + b->Size();
+        if (size <= SHORT) {
+            string_t out{a->View()};
+            out.append(b->View());
+            return Make(std::move(out));
+        }
+        return MakeRef<MalString>(std::move(a), std::move(b), 0, size);
+    }
+
+    Ref<MalString> MalString::Copy(const Ref<MalString>& str) {
+        auto copy = Make(string_t{str->View()});
+        if (str->id != 0) {
+            copy->id = str->id;
+            copy->origin = str->origin ? str->origin : str;
+        }
+        return copy;
+    }
+
+    Ref<MalString> SymbolTable::Add(std::string&& name) {
+        SymbolTable& table = Table();
+        auto str = MalString::Make(std::move(name));
+        if (table.free_ids.empty()) {
+            str->id = table.next_id++;
+        } else {
+            str->id = table.free_ids.back();
+            table.free_ids.pop_back();
+        }
+        table.names.emplace(str->View(), str);
+        return str;
+    }
+
+    void SymbolTable::Release(MalString* name) {
+        SymbolTable& table = Table();
+        table.names.erase(name->View());
+        table.free_ids.push_back(name->id);
+    }
+
+    Ref<MalString> SymbolTable::Intern(std::string_view name) {
+        auto it = Table().names.find(name);
+        if (it != Table().names.end())
+            return it->second.lock();
+        return Add(std::string{name});
+    }
+
+    Ref<MalString> SymbolTable::Intern(std::string&& name) {
+        auto it = Table().names.find(name);
+        if (it != Table().names.end())
+            return it->second.lock();
+        return Add(std::move(name));
+    }
+
+    Ref<MalString> SymbolTable::Intern(Ref<MalString> str) {
+        if (str->id != 0)
+            return str;
+        return Intern(str->View());
+    }
+}
@@ -1,58 +1,188 @@
 #pragma once
 
 #include "malvalue.hpp"
+#include <cstdint>
 #include <string>
+#include <string_view>
 
 #include <unordered_map>
+#include <vector>
 
 namespace mal {
-    class StringInternPool;
+    // Special forms of the evaluator (see: Interpreter::Apply)
+    enum class SpecialForm : unsigned char {
+        None = 0,
+        Def, Let, Do, If, Fn, Macro,
+        Quote, Quasiquote, Macroexpand, Try,
+        Loop, Recur, Dotimes,
+        Unresolved, // Not computed yet
+    };
+
+    // Finds the special form named by `name` (a perfect hash by length)
+    inline SpecialForm LookupSpecialForm(const std::string& name) {
+        switch (name.size()) {
+            case 2:
+                if (name == "do") return SpecialForm::Do;
+                if (name == "if") return SpecialForm::If;
+                if (name == "fn") return SpecialForm::Fn;
+                break;
+            case 3:
+                if (name == "def") return SpecialForm::Def;
+                break;
+            case 4:
+                if (name == "let*") return SpecialForm::Let;
+                if (name == "try*") return SpecialForm::Try;
+                if (name == "loop") return SpecialForm::Loop;
+                break;
+            case 5:
+                if (name == "macro") return SpecialForm::Macro;
+                if (name == "quote") return SpecialForm::Quote;
+                if (name == "recur") return SpecialForm::Recur;
+                break;
+            case 7:
+                if (name == "dotimes") return SpecialForm::Dotimes;
+                break;
+            case 10:
+                if (name == "quasiquote") return SpecialForm::Quasiquote;
+                break;
+            case 11:
+                if (name == "macroexpand") return SpecialForm::Macroexpand;
+                break;
+        }
+        return SpecialForm::None;
+    }
+
+    // A string [Symbol_T, Keyword_T, String_T], immutable once made
+    // A string is flat (it owns its bytes), a slice of a flat string, or a rope joining two strings. Slices and ropes
+    // share the bytes of the strings they're made of, they're flattened the first time their bytes are read as a whole
+    // (see: Get), taking the length and the view of a slice doesn't flatten it
+    // Symbols and keywords are interned names, with an ID (see: SymbolTable)
     class MalString {
     public:
         typedef std::string string_t;
+
+        // Slices and joins of up to SHORT bytes are copied: they're flat, and kept inline by std::string if short enough
+        static constexpr std::size_t SHORT = 32;
     private:
-        string_t str;
-        StringInternPool* pool = nullptr;
+        mutable string_t str; // Of a slice or a rope, empty until flattened
+        // A slice views `length` bytes of the flat string `left` from `offset`, a rope joins `left` and `right`
+        mutable Ref<MalString> left;
+        mutable Ref<MalString> right;
+        std::size_t offset = 0;
+        std::size_t length = 0;
+        // Of a copy of a name made to hold metadata: the interned name, kept alive so the ID isn't reused
+        Ref<MalString> origin;
+        mutable std::size_t hash = 0; // 0 until computed (see: MalHash)
+        std::uint32_t id = 0; // Of names, 0 for the other strings
+        mutable SpecialForm form = SpecialForm::Unresolved;
+
+        friend struct MalHash;
+        friend class SymbolTable;
+
+        // Copies the bytes of a slice or a rope into `str` and drops the parts (see: malstring.cpp)
+        void Flatten() const;
+        // Releases the parts of a slice or a rope
+        static void ReleaseParts(Ref<MalString>& left, Ref<MalString>& right);
     public:
+        MetaMark meta;
+
         MalString(const string_t& val) : str{val} {}
-        MalString(const string_t&& val, StringInternPool* pool=nullptr) : str{std::move(val)}, pool{pool} {}
+        MalString(const string_t&& val) : str{std::move(val)} {}
+        MalString(Ref<MalString> left, Ref<MalString> right, std::size_t offset, std::size_t length)
+            : left{std::move(left)}, right{std::move(right)}, offset{offset}, length{length} {}
+        ~MalString();
+
+        const string_t& Get() const {
+            if (left)
+                Flatten();
+            return str;
+        }
+
+        // The bytes without flattening a slice
+        std::string_view View() const {
+            if (!left)
+                return str;
+            if (!right)
+                return std::string_view{left->str}.substr(offset, length);
+            Flatten();
+            return str;
+        }
+
+        std::size_t Size() const {return left ? length : str.size(); }
+
+        // Names are equal if their IDs are
+        std::uint32_t Id() const {return id; }
+
+        // Special form named by this symbol, computed on the first use
+        SpecialForm Form() const {
+            if (form == SpecialForm::Unresolved)
+                form = LookupSpecialForm(Get());
+            return form;
+        }
 
-        const string_t& Get() const {return str; }
+        static Ref<MalString> Make(const string_t& val) {
+            return MakeRef<MalString>(val);
+        }
 
-        static std::shared_ptr<MalString> Make(const string_t& val) {
-            return std::make_shared<MalString>(val);
+        static Ref<MalString> Make(const string_t&& val) {
+            return MakeRef<MalString>(std::move(val));
         }
 
-        static std::shared_ptr<MalString> Make(const string_t&& val, StringInternPool* pool=nullptr) {
-            return std::make_shared<MalString>(std::move(val), pool);
+        // A copy without the metadata, the copy of a name has the same ID
+        static Ref<MalString> Copy(const Ref<MalString>& str);
+
+        // `count` bytes of `str` from `start`, requires start + count <= str->Size()
+        static Ref<MalString> Slice(const Ref<MalString>& str, std::size_t start, std::size_t count);
+        // The bytes of `a` followed by the bytes of `b`
+        static Ref<MalString> Concat(Ref<MalString> a, Ref<MalString> b);
+    };
+
+    // The names of symbols and keywords, shared by all the interpreters of the process
+    // Every name is interned once and has an ID; IDs are dense, the ID of a released name is given to the next new one
+    // The table keeps weak references, a name leaves it when its last reference is released
+    class SymbolTable {
+        // The keys view the bytes of the names
+        std::unordered_map<std::string_view, Weak<MalString>> names;
+        std::vector<std::uint32_t> free_ids;
+        std::uint32_t next_id = 1;
+
+        // Never destroyed, names may be released during the destruction of other statics
+        static SymbolTable& Table() {
+            static auto* table = new SymbolTable();
+            return *table;
         }
 
-        bool IsInterned(StringInternPool* pool_) {return pool == pool_; }
+        static Ref<MalString> Add(std::string&& name);
+        static void Release(MalString* name);
+
+        friend class MalString;
+    public:
+        // The interned name with the bytes of `name`, `name` is copied only for a new name
+        static Ref<MalString> Intern(std::string_view name);
+        static Ref<MalString> Intern(std::string&& name);
+        // `str` itself if it's a name
+        static Ref<MalString> Intern(Ref<MalString> str);
     };
 
-    // Class for interning strings
+    // Interns string literals, for an interpreter
     class StringInternPool {
-        using element_type = std::shared_ptr<MalString>;
-        /*struct StringHash {
-            auto operator()(element_type const& v) const {
-                return std::hash(v->Get());
-            }
-        };
-        struct StringEq {
-            auto operator()(element_type const& a, element_type const& b) const {
-                return a->Get() == b->Get();
-            }
-        };*/
-        std::unordered_map<std::string, element_type/*, StringHash, StringEq*/> pool;
+        using element_type = Ref<MalString>;
+        // The keys view the bytes of the strings
+        std::unordered_map<std::string_view, element_type> pool;
     public:
         element_type Intern(std::string&& str) {
             auto it = pool.find(str);
-            if (it == pool.end())
-                it = pool.emplace(str, MalString::Make(std::move(str), this)).first;
+            if (it == pool.end()) {
+                auto interned = MalString::Make(std::move(str));
+                it = pool.emplace(interned->View(), std::move(interned)).first;
+            }
             return it->second;
         }
         element_type Intern(const std::string& str) {
-            return Intern(static_cast<std::string>(str));
+            auto it = pool.find(str);
+            if (it == pool.end())
+                return Intern(std::string{str});
+            return it->second;
         }
     };
-}
\ No newline at end of file
+}
@@ -1,29 +1,48 @@
 #pragma once
 
+#include <cstdint>
 #include <memory>
 #include <functional>
 #include <stack>
 #include <vector>
 #include <type_traits>
+#include <unordered_map>
+
+#include "ref.hpp"
 
 namespace mal {
     class mal_error;
     class MalList;
+    class MalVector;
+    class VectorNode;
     class MalMap;
-    class MapSpec;
+    class MapNode;
     class MalString;
     class MalFunction;
+    class MalBigInt;
+    class MetaMark;
+    struct MalAtom;
+
+    // Called when the last reference to an object is released (see: ref.hpp)
+    inline void Free(MalList* list);
+    inline void Free(MalVector* vector);
+    inline void Free(VectorNode* node);
+    inline void Free(MalMap* map);
+    inline void Free(MapNode* node);
+    inline void Free(MalString* str);
+    inline void Free(MalFunction* function);
+    inline void Free(MalAtom* atom);
+    inline void Free(MalBigInt* num);
 
     enum MalType {
         Nil_T = 0,
         True_T,
         False_T,
         Int_T,
-        //Bigint_T // TODO
+        Bigint_T, // Integers out of the range of Int_T (see: malbigint.hpp)
         List_T,
-        Vector_T,
-        Map_T,
-        MapSpec_T, // Can be converted to map
+        Vector_T, // A persistent vector (see: malvector.hpp)
+        Map_T, // A persistent hash-map (see: malmap.hpp)
         Symbol_T,
         Keyword_T,
         String_T,
@@ -32,30 +51,35 @@ namespace mal {
         Atom_T,
     };
 
-    struct MalAtom;
+    struct MalValue;
 
-    struct RefCounter {
-        static std::size_t total_refs;
-        RefCounter() {++total_refs; }
-        ~RefCounter() {--total_refs; }
+    // Entry points of a builtin function (see: builtin.hpp)
+    struct Builtin {
+        using generic_t = MalValue(*)(class Interpreter&, struct MalArgs&&);
+        using direct_t = MalValue(*)(class Interpreter&, MalValue* args);
+
+        generic_t call; // Takes any number of arguments
+        direct_t direct; // Takes exactly `arity` arguments stored consecutively, may move them out, nullptr if not available
+        std::size_t arity;
+        const char* name;
     };
 
     struct MalValue {
-        using builtin_t = MalValue(*)(class Interpreter&, class MalArgs&&);
+        using builtin_t = Builtin::generic_t;
 
         MalType tag;
         union {
             struct{} nu; // For null initialization
-            std::shared_ptr<MalList> li;
-            std::shared_ptr<MalMap> mp;
-            std::shared_ptr<MapSpec> ms;
-            std::shared_ptr<MalString> st;
-            builtin_t blt;
-            std::shared_ptr<MalFunction> fun;
-            std::shared_ptr<MalAtom> at;
-            int no;
+            Ref<MalList> li;
+            Ref<MalVector> ve;
+            Ref<MalMap> mp;
+            Ref<MalString> st;
+            const Builtin* blt;
+            Ref<MalFunction> fun;
+            Ref<MalAtom> at;
+            Ref<MalBigInt> bi;
+            std::int64_t no;
         };
-        std::shared_ptr<MalAtom> meta;
 
         constexpr MalValue()
             : tag{Nil_T},
@@ -69,59 +93,69 @@ namespace mal {
             : tag{Int_T},
               no{v} {}
 
-        MalValue(std::shared_ptr<MalList> list, MalType tag)
+        constexpr MalValue(std::int64_t v)
+            : tag{Int_T},
+              no{v} {}
+
+        MalValue(Ref<MalBigInt> num)
+            : tag{Bigint_T},
+              bi{std::move(num)} {}
+
+        MalValue(Ref<MalList> list, MalType tag)
             : tag{tag},
               li{std::move(list)} {}
 
-        MalValue(std::shared_ptr<MalMap> map)
+        MalValue(Ref<MalVector> vector)
+            : tag{Vector_T},
+              ve{std::move(vector)} {}
+
+        MalValue(Ref<MalMap> map)
             : tag{Map_T},
               mp{std::move(map)} {}
 
-        MalValue(std::shared_ptr<MapSpec> spec)
-            : tag{MapSpec_T},
-              ms{std::move(spec)} {}
-
-        MalValue(std::shared_ptr<MalString> str, MalType tag)
+        MalValue(Ref<MalString> str, MalType tag)
             : tag{tag},
               st{std::move(str)} {}
 
-        MalValue(builtin_t builtin)
+        MalValue(const Builtin* builtin)
             : tag{Builtin_T},
-              blt{std::move(builtin)} {}
+              blt{builtin} {}
 
-        MalValue(std::shared_ptr<MalFunction> function)
+        MalValue(Ref<MalFunction> function)
             : tag{Function_T},
               fun{std::move(function)} {}
         
-        MalValue(std::shared_ptr<MalAtom> atom)
+        MalValue(Ref<MalAtom> atom)
             : tag{Atom_T},
               at{std::move(atom)} {}
 
         ~MalValue() {
             switch (tag) {
                 case List_T:
+                    li.~Ref();
+                    break;
                 case Vector_T:
-                    li.~shared_ptr();
+                    ve.~Ref();
                     break;
                 case Map_T:
-                    mp.~shared_ptr();
-                    break;
-                case MapSpec_T:
-                    ms.~shared_ptr();
+                    mp.~Ref();
                     break;
                 case String_T:
                 case Symbol_T:
                 case Keyword_T:
-                    st.~shared_ptr();
+                    st.~Ref();
                     break;
                 // Reserved for future modifications
                 case Builtin_T:
                     break;
                 case Function_T:
-                    fun.~shared_ptr();
+                    fun.~Ref();
                     break;
                 case Atom_T:
-                    at.~shared_ptr();
+                    at.~Ref();
+                    break;
+                case Bigint_T:
+                    bi.~Ref();
                     break;
                 // Noops
                 case Nil_T:
@@ -132,18 +166,17 @@ namespace mal {
             }
         }
 
-        MalValue(const MalValue& cop) : tag{cop.tag}, meta{cop.meta} {
+        MalValue(const MalValue& cop) : tag{cop.tag} {
             switch (tag) {
                 case List_T:
-                case Vector_T:
                     init(li, cop.li);
                     break;
+                case Vector_T:
+                    init(ve, cop.ve);
+                    break;
                 case Map_T:
                     init(mp, cop.mp);
                     break;
-                case MapSpec_T:
-                    init(ms, cop.ms);
-                    break;
                 case String_T:
                 case Symbol_T:
                 case Keyword_T:
@@ -158,6 +191,9 @@ namespace mal {
                 case Atom_T:
                     init(at, cop.at);
                     break;
+                case Bigint_T:
+                    init(bi, cop.bi);
+                    break;
                 case Int_T:
                     no = cop.no;
                     break;
@@ -169,18 +205,17 @@ namespace mal {
             }
         }
 
-        MalValue(MalValue&& src) : tag{std::exchange(src.tag, Nil_T)}, meta{std::move(src.meta)} {
+        MalValue(MalValue&& src) noexcept : tag{std::exchange(src.tag, Nil_T)} {
             switch (tag) {
                 case List_T:
-                case Vector_T:
                     init(li, std::move(src.li));
                     break;
+                case Vector_T:
+                    init(ve, std::move(src.ve));
+                    break;
                 case Map_T:
                     init(mp, std::move(src.mp));
                     break;
-                case MapSpec_T:
-                    init(ms, std::move(src.ms));
-                    break;
                 case String_T:
                 case Symbol_T:
                 case Keyword_T:
@@ -195,6 +230,9 @@ namespace mal {
                 case Atom_T:
                     init(at, std::move(src.at));
                     break;
+                case Bigint_T:
+                    init(bi, std::move(src.bi));
+                    break;
                 case Int_T:
                     no = src.no;
                     break;
@@ -206,35 +244,23 @@ namespace mal {
             }
         }
 
-        // MalValue is immutable...
+        // MalValue is immutable
         MalValue& operator=(const MalValue&) = delete;
         MalValue& operator=(MalValue&&) = delete;
 
-        // ...except for this... Yep!
-        // Requires either Map_T or MapSpec_T
-        std::shared_ptr<MalMap> Map() const {
-            if (tag == MapSpec_T) {
-                auto& th = const_cast<MalValue&>(*this);
-                auto sp = std::move(th.ms);
-                th.ms.~shared_ptr();
-                th.init(th.mp, std::make_shared<MalMap>(*sp));
-                th.tag = Map_T;
-            }
-            return mp;
-        }
-
-        MalValue Meta() const;
-
-        void SetMeta(const MalValue& m);
-        void SetMeta(std::nullptr_t) {
-            meta = nullptr;
-        }
+        // Metadata of the object the value refers to, nil if it has none (see: MetaMark)
+        const MalValue& Meta() const;
+        bool HasMeta() const;
+        // Returns false if the value doesn't refer to an object that can hold metadata
+        bool SetMeta(const MalValue& m) const;
 
         friend inline bool operator!=(const MalValue& a, const MalValue& b) { return !(a == b); }
         friend bool operator==(const MalValue&, const MalValue&);
         friend int compare(const MalValue& a, const MalValue& b);
 
     private:
+        MetaMark* Mark() const;
+
         // A helper to initialize union members
         template <typename T, typename... Args>
         inline void init(T& v, Args&&... args) {
@@ -255,22 +281,26 @@ namespace mal {
         MalAtom(MalValue&& val) : v{std::move(val)} {}
         MalAtom(const MalValue& val) : v{val} {}
         MalAtom(const MalAtom& a) : v{a.v} {}
+        MalAtom(MalAtom&& a) noexcept : v{std::move(a.v)} {}
 
         ~MalAtom() {
             v.~MalValue();
         }
 
-        MalValue get() const {
+        const MalValue& get() const {
             return v;
         }
 
+        // `val` may be borrowed from the old value, which is released after the copy
         MalAtom& operator=(const MalValue& val) {
+            MalValue old{std::move(v)};
             v.~MalValue();
             init(v, val);
             return *this;
         }
 
         MalAtom& operator=(MalValue&& val) {
+            MalValue old{std::move(v)};
             v.~MalValue();
             init(v, std::move(val));
             return *this;
@@ -280,8 +310,8 @@ namespace mal {
             return &v;
         }
 
-        static std::shared_ptr<MalAtom> Make(const MalValue& val) {
-            return std::make_shared<MalAtom>(val);
+        static Ref<MalAtom> Make(const MalValue& val) {
+            return MakeRef<MalAtom>(val);
         }
 
     private:
@@ -292,13 +322,53 @@ namespace mal {
         }
     };
 
-    inline void MalValue::SetMeta(const MalValue& m) {
-        meta = MalAtom::Make(m);
-    }
+    // Metadata is kept in a side table rather than in the values: objects (non-empty sequences, maps, strings and functions)
+    // have a mark, which is set while the table holds their metadata. All values referring to an object share its metadata,
+    // copies of an object start without it
+    class MetaMark {
+        bool set = false;
 
-    inline MalValue MalValue::Meta() const {
-        return meta ? meta->get() : MalValue();
-    }
+        // Never destroyed, objects may be released during the destruction of other statics
+        static std::unordered_map<const MetaMark*, MalValue>& Table() {
+            static auto* table = new std::unordered_map<const MetaMark*, MalValue>();
+            return *table;
+        }
+    public:
+        MetaMark() = default;
+        MetaMark(const MetaMark&) {}
+        MetaMark& operator=(const MetaMark&) {
+            return *this;
+        }
+
+        ~MetaMark() {
+            if (set)
+                Clear();
+        }
+
+        bool IsSet() const {
+            return set;
+        }
+
+        // Requires IsSet()
+        const MalValue& Get() const {
+            return Table().find(this)->second;
+        }
+
+        void Set(MalValue&& meta) {
+            auto& entry = Table()[this];
+            entry.~MalValue();
+            new (&entry) MalValue{std::move(meta)};
+            set = true;
+        }
+
+        void Clear() {
+            auto entry = Table().find(this);
+            // Released after the erasure, the metadata may hold the last references to other marked objects
+            MalValue meta = std::move(entry->second);
+            Table().erase(entry);
+            set = false;
+        }
+    };
 }
 
 namespace mh {
@@ -321,8 +391,59 @@ namespace mal {
 }
 
 #include "mallist.hpp"
+#include "malvector.hpp"
 #include "malmap.hpp"
 #include "malfunction.hpp"
+#include "malbigint.hpp"
+
+namespace mal {
+    inline void Free(MalList* list) { Ref<MalList>::Destroy(list); }
+    inline void Free(MalVector* vector) { Ref<MalVector>::Destroy(vector); }
+    inline void Free(VectorNode* node) { Ref<VectorNode>::Destroy(node); }
+    inline void Free(MalMap* map) { Ref<MalMap>::Destroy(map); }
+    inline void Free(MapNode* node) { Ref<MapNode>::Destroy(node); }
+    inline void Free(MalString* str) { Ref<MalString>::Destroy(str); }
+    inline void Free(MalFunction* function) { Ref<MalFunction>::Destroy(function); }
+    inline void Free(MalAtom* atom) { Ref<MalAtom>::Destroy(atom); }
+    inline void Free(MalBigInt* num) { Ref<MalBigInt>::Destroy(num); }
+
+    inline MetaMark* MalValue::Mark() const {
+        switch (tag) {
+            case List_T:
+                return li ? &li->meta : nullptr;
+            case Vector_T:
+                return ve ? &ve->meta : nullptr;
+            case Map_T:
+                return &mp->meta;
+            case String_T:
+            case Symbol_T:
+            case Keyword_T:
+                return &st->meta;
+            case Function_T:
+                return &fun->meta;
+            default:
+                return nullptr;
+        }
+    }
+
+    inline bool MalValue::HasMeta() const {
+        const MetaMark* mark = Mark();
+        return mark != nullptr && mark->IsSet();
+    }
+
+    inline const MalValue& MalValue::Meta() const {
+        return HasMeta() ? Mark()->Get() : mh::nil;
+    }
+
+    inline bool MalValue::SetMeta(const MalValue& m) const {
+        MetaMark* mark = Mark();
+        if (mark == nullptr)
+            return false;
+        mark->Set(MalValue{m});
+        return true;
+    }
+
+}
 
 // Mal helpers
 namespace mh {
@@ -332,47 +453,48 @@ namespace mh {
 
     // Value makers
 
-    inline std::shared_ptr<mal::MalString> maybe_intern(std::string&& str, mal::StringInternPool* pool) {
+    inline mal::Ref<mal::MalString> maybe_intern(std::string&& str, mal::StringInternPool* pool) {
         return pool ? pool->Intern(move(str)) : mal::MalString::Make(move(str));
     }
 
-    inline mal::MalValue list(const std::shared_ptr<mal::MalList>& list) {
+    inline mal::MalValue list(const mal::Ref<mal::MalList>& list) {
         return mal::MalValue{list, mal::List_T};
     }
 
-    inline mal::MalValue vector(const std::shared_ptr<mal::MalList>& list) {
-        return mal::MalValue{list, mal::Vector_T};
+    inline mal::MalValue vector(const mal::Ref<mal::MalVector>& vector) {
+        return mal::MalValue{vector};
     }
 
-    inline mal::MalValue hash_map(const std::shared_ptr<mal::MalMap>& map) {
+    inline mal::MalValue hash_map(const mal::Ref<mal::MalMap>& map) {
         return mal::MalValue{map};
     }
 
-    inline mal::MalValue symbol(const std::string& str) {
-        return mal::MalValue{mal::MalString::Make(str), mal::Symbol_T};
+    // Symbols and keywords are interned (see: SymbolTable)
+    inline mal::MalValue symbol(std::string_view str) {
+        return mal::MalValue{mal::SymbolTable::Intern(str), mal::Symbol_T};
     }
 
     inline mal::MalValue string(const std::string& str) {
         return mal::MalValue{mal::MalString::Make(str), mal::String_T};
     }
 
-    inline mal::MalValue keyword(const std::string& str) {
-        return mal::MalValue{mal::MalString::Make(str), mal::Keyword_T};
+    inline mal::MalValue keyword(std::string_view str) {
+        return mal::MalValue{mal::SymbolTable::Intern(str), mal::Keyword_T};
     }
 
-    inline mal::MalValue symbol(std::shared_ptr<mal::MalString>&& str) {
-        return mal::MalValue{std::move(str), mal::Symbol_T};
+    inline mal::MalValue symbol(mal::Ref<mal::MalString>&& str) {
+        return mal::MalValue{mal::SymbolTable::Intern(std::move(str)), mal::Symbol_T};
     }
 
-    inline mal::MalValue string(std::shared_ptr<mal::MalString>&& str) {
+    inline mal::MalValue string(mal::Ref<mal::MalString>&& str) {
         return mal::MalValue{std::move(str), mal::String_T};
     }
 
-    inline mal::MalValue keyword(std::shared_ptr<mal::MalString>&& str) {
-        return mal::MalValue{std::move(str), mal::Keyword_T};
+    inline mal::MalValue keyword(mal::Ref<mal::MalString>&& str) {
+        return mal::MalValue{mal::SymbolTable::Intern(std::move(str)), mal::Keyword_T};
     }
 
-    inline mal::MalValue num(int val) {
+    inline mal::MalValue num(std::int64_t val) {
         return mal::MalValue{val};
     }
 
@@ -380,11 +502,7 @@ namespace mh {
         return mal::MalValue{val};
     }
 
-    /*inline MalValue num(BigInt&& val) {
-        return MalValue{val};
-    }*/
-
-    inline mal::MalValue builtin(mal::MalValue::builtin_t builtin) {
+    inline mal::MalValue builtin(const mal::Builtin* builtin) {
         return mal::MalValue{builtin};
     }
 
@@ -396,50 +514,55 @@ namespace mh {
     constexpr inline bool is_nil(const mal::MalValue& val) {return val.tag == mal::Nil_T; }
     constexpr inline bool is_true(const mal::MalValue& val) {return val.tag == mal::True_T; }
     constexpr inline bool is_false(const mal::MalValue& val) {return val.tag == mal::False_T; }
-    constexpr inline bool is_num(const mal::MalValue& val) {return val.tag == mal::Int_T /*|| val.tag == mal::Bigint_T*/; }
+    constexpr inline bool is_num(const mal::MalValue& val) {return val.tag == mal::Int_T || val.tag == mal::Bigint_T; }
     constexpr inline bool is_symbol(const mal::MalValue& val) {return val.tag == mal::Symbol_T; }
     constexpr inline bool is_keyword(const mal::MalValue& val) {return val.tag == mal::Keyword_T; }
     constexpr inline bool is_string(const mal::MalValue& val) {return val.tag == mal::String_T; }
     constexpr inline bool is_list(const mal::MalValue& val) {return val.tag == mal::List_T; }
     constexpr inline bool is_vector(const mal::MalValue& val) {return val.tag == mal::Vector_T; }
-    constexpr inline bool is_map(const mal::MalValue& val) {return val.tag == mal::Map_T || val.tag == mal::MapSpec_T; }
+    constexpr inline bool is_map(const mal::MalValue& val) {return val.tag == mal::Map_T; }
     constexpr inline bool is_sequence(const mal::MalValue& val) {return val.tag == mal::List_T || val.tag == mal::Vector_T; }
     constexpr inline bool is_flist(const mal::MalValue& val) {return val.tag == mal::List_T && (val.li != nullptr); } // Is non-empty list?
-    constexpr inline bool is_fseq(const mal::MalValue& val) {return is_sequence(val) && (val.li != nullptr); } // Is non-empty collection?
+    constexpr inline bool is_fseq(const mal::MalValue& val) {return is_flist(val) || (val.tag == mal::Vector_T && val.ve != nullptr); } // Is non-empty collection?
     constexpr inline bool is_atom(const mal::MalValue& val) {return val.tag == mal::Atom_T; }
     constexpr inline bool is_invokable(const mal::MalValue& val) {return val.tag == mal::Builtin_T || val.tag == mal::Function_T; }
 
+    // val must be a sequence, vectors are viewed as lists (see: MalVector::List)
+    inline const mal::Ref<mal::MalList>& as_list(const mal::MalValue& val) {
+        static const mal::Ref<mal::MalList> empty;
+        if (val.tag == mal::List_T)
+            return val.li;
+        return val.ve ? val.ve->List() : empty;
+    }
+
+    // Number of values of a sequence
+    inline std::size_t seq_size(const mal::MalValue& val) {
+        if (val.tag == mal::List_T)
+            return val.li ? val.li->GetSize() : 0;
+        return val.ve ? val.ve->GetSize() : 0;
+    }
+
     // val must be a map
-    inline auto as_map(const mal::MalValue& val) {return val.Map(); }
-    inline auto assoc(const mal::MalValue& map, const mal::MalValue& key, const mal::MalValue& val) {
-        std::shared_ptr<mal::MapSpec> p;
-        if (map.tag == mal::MapSpec_T)
-            p = mal::MapSpec::Make(map.ms, key, val);
-        else
-            p = mal::MapSpec::Make(map.mp, key, val);
-        p->s_assoc = true;
-        return p;
+    inline const mal::Ref<mal::MalMap>& as_map(const mal::MalValue& val) {return val.mp; }
+    inline mal::Ref<mal::MalMap> assoc(const mal::MalValue& map, const mal::MalValue& key, const mal::MalValue& val) {
+        return map.mp->Assoc(key, val);
     }
-    inline auto dissoc(const mal::MalValue& map, const mal::MalValue& key) {
-        std::shared_ptr<mal::MapSpec> p;
-        if (map.tag == mal::MapSpec_T)
-            p = mal::MapSpec::Make(map.ms, key, mh::nil);
-        else
-            p = mal::MapSpec::Make(map.mp, key, mh::nil);
-        p->s_assoc = false;
-        return p;
+    inline mal::Ref<mal::MalMap> dissoc(const mal::MalValue& map, const mal::MalValue& key) {
+        if (map.mp->Find(key) == nullptr)
+            return map.mp;
+        return map.mp->Dissoc(key);
     }
 
     // Helper functions
 
-    inline std::shared_ptr<mal::MalList> cons(mal::MalValue&& car, std::shared_ptr<mal::MalList> cdr = nullptr) {
+    inline mal::Ref<mal::MalList> cons(mal::MalValue&& car, mal::Ref<mal::MalList> cdr = nullptr) {
         return mal::MalList::Make(std::move(car), std::move(cdr));
     }
 
     template <typename F, typename = std::enable_if_t<std::is_invocable_r_v<mal::MalValue, F, const mal::MalValue&>>>
-    inline std::shared_ptr<mal::MalList> map(const mal::MalList& list, /*std::function<mal::MalValue(const mal::MalValue&)>*/ F&& func) {
+    inline mal::Ref<mal::MalList> map(const mal::MalList& list, /*std::function<mal::MalValue(const mal::MalValue&)>*/ F&& func) {
         mal::ListBuilder l;
-        for (const mal::MalList* node = &list; node != nullptr; node = node->Rest().get()) {
+        for (const mal::MalList* node = &list; node != nullptr; node = node->Next()) {
             l.push(func(node->First()));
         }
         return l.release();
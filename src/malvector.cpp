@@ -0,0 +1,103 @@
+#include "malvalue.hpp"
+
+namespace {
+    using namespace mal;
+
+    // Makes `node` safe to modify: nodes referenced more than once belong to other versions too, and are copied
+    VectorNode& Unshare(Ref<VectorNode>& node) {
+        if (node.use_count() > 1)
+            node = MakeRef<VectorNode>(*node);
+        return *node;
+    }
+
+    // A chain of branches from `level` down to `leaf`
+    Ref<VectorNode> NewPath(unsigned level, Ref<VectorNode> leaf) {
+        for (; level > 0; level -= VectorNode::BITS) {
+            auto branch = MakeRef<VectorNode>(false);
+            branch->children[0] = std::move(leaf);
+            leaf = std::move(branch);
+        }
+        return leaf;
+    }
+}
+
+namespace mal {
+    void MalVector::Append(MalValue&& val) {
+        if (tail.size() == VectorNode::WIDTH)
+            PushTail();
+        if (tail.empty())
+            tail.reserve(count < VectorNode::WIDTH ? 1 : VectorNode::WIDTH);
+        tail.emplace_back(std::move(val));
+        ++count;
+        list.reset();
+        hash = 0;
+    }
+
+    // Moves the full tail into a leaf of the trie
+    void MalVector::PushTail() {
+        auto leaf = MakeRef<VectorNode>(true);
+        for (std::size_t i = 0; i < VectorNode::WIDTH; ++i)
+            leaf->values[i] = std::move(tail[i].v);
+        tail.clear();
+
+        // Index of the last value of the new leaf
+        std::size_t idx = count - 1;
+        if (root == nullptr) {
+            root = MakeRef<VectorNode>(false);
+        } else if ((count >> VectorNode::BITS) > (std::size_t{1} << shift)) {
+            // The trie is full, it becomes the first child of a new root
+            auto top = MakeRef<VectorNode>(false);
+            top->children[0] = std::move(root);
+            top->children[1] = NewPath(shift, std::move(leaf));
+            root = std::move(top);
+            shift += VectorNode::BITS;
+            return;
+        }
+        Ref<VectorNode>* node = &root;
+        for (unsigned level = shift; level > VectorNode::BITS; level -= VectorNode::BITS) {
+            auto& child = Unshare(*node).children[(idx >> level) & VectorNode::MASK];
+            if (child == nullptr) {
+                child = NewPath(level - VectorNode::BITS, std::move(leaf));
+                return;
+            }
+            node = &child;
+        }
+        Unshare(*node).children[(idx >> VectorNode::BITS) & VectorNode::MASK] = std::move(leaf);
+    }
+
+    void MalVector::Set(std::size_t idx, MalValue&& val) {
+        list.reset();
+        hash = 0;
+        if (idx >= TailOffset()) {
+            tail[idx - TailOffset()] = std::move(val);
+            return;
+        }
+        Ref<VectorNode>* node = &root;
+        for (unsigned level = shift; level > 0; level -= VectorNode::BITS)
+            node = &Unshare(*node).children[(idx >> level) & VectorNode::MASK];
+        Unshare(*node).values[idx & VectorNode::MASK] = std::move(val);
+    }
+
+    Ref<MalVector> MalVector::Conj(MalValue&& val) const {
+        auto vector = MakeRef<MalVector>(*this);
+        vector->Append(std::move(val));
+        return vector;
+    }
+
+    Ref<MalVector> MalVector::Assoc(std::size_t idx, MalValue&& val) const {
+        auto vector = MakeRef<MalVector>(*this);
+        vector->Set(idx, std::move(val));
+        return vector;
+    }
+
+    const Ref<MalList>& MalVector::List() const {
+        if (list == nullptr) {
+            ListBuilder lb;
+            ForEach([&lb](const MalValue& v) {
+                lb.push(MalValue{v});
+            });
+            list = lb.release();
+        }
+        return list;
+    }
+}
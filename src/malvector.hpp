@@ -0,0 +1,139 @@
+#pragma once
+
+#include "malvalue.hpp"
+
+#include <vector>
+
+namespace mal {
+    // A node of the trie of a vector: a leaf holds WIDTH values, a branch holds up to WIDTH nodes of the level below
+    // Nodes are shared between the versions of a vector, a node is modified in place only while it's referenced once
+    class VectorNode {
+    public:
+        static constexpr unsigned BITS = 5;
+        static constexpr std::size_t WIDTH = std::size_t{1} << BITS;
+        static constexpr std::size_t MASK = WIDTH - 1;
+
+        const bool leaf;
+        union {
+            MalAtom values[WIDTH];
+            Ref<VectorNode> children[WIDTH];
+        };
+
+        explicit VectorNode(bool leaf) : leaf{leaf} {
+            if (leaf) {
+                for (MalAtom& v : values)
+                    new (&v) MalAtom{};
+            } else {
+                for (auto& child : children)
+                    new (&child) Ref<VectorNode>{};
+            }
+        }
+
+        VectorNode(const VectorNode& other) : leaf{other.leaf} {
+            for (std::size_t i = 0; i < WIDTH; ++i) {
+                if (leaf)
+                    new (&values[i]) MalAtom{other.values[i]};
+                else
+                    new (&children[i]) Ref<VectorNode>{other.children[i]};
+            }
+        }
+
+        ~VectorNode() {
+            for (std::size_t i = 0; i < WIDTH; ++i) {
+                if (leaf)
+                    values[i].~MalAtom();
+                else
+                    children[i].~Ref();
+            }
+        }
+    };
+
+    // A persistent vector [Vector_T]: a trie of WIDTH-way nodes, with the last (up to WIDTH) values in a tail buffer
+    // Indexing walks log32(n) levels, `Conj` and `Assoc` copy the path to the changed leaf and share the rest of the trie
+    // An empty vector is a null reference, like an empty list
+    class MalVector {
+        std::size_t count = 0;
+        unsigned shift = VectorNode::BITS; // Of the level below the root
+        Ref<VectorNode> root; // Null until the tail fills up for the first time
+        std::vector<MalAtom> tail;
+        MetaMark meta;
+        mutable Ref<MalList> list; // The values as a list, made on demand (see: List)
+        mutable std::size_t hash = 0; // 0 until computed (see: MalHash)
+
+        friend class MalValue;
+        friend class CycleCollector;
+        friend class VectorBuilder;
+        friend struct MalHash;
+
+        // Index of the first value in the tail
+        std::size_t TailOffset() const {
+            return count < VectorNode::WIDTH ? 0 : ((count - 1) >> VectorNode::BITS) << VectorNode::BITS;
+        }
+
+        // The values of the leaf holding `idx`, requires idx < count
+        const MalAtom* Leaf(std::size_t idx) const {
+            if (idx >= TailOffset())
+                return tail.data();
+            const VectorNode* node = root.get();
+            for (unsigned level = shift; level > 0; level -= VectorNode::BITS)
+                node = node->children[(idx >> level) & VectorNode::MASK].get();
+            return node->values;
+        }
+
+        // In-place updates, for vectors referenced once (see: malvector.cpp)
+        void Append(MalValue&& val);
+        void Set(std::size_t idx, MalValue&& val);
+        void PushTail();
+    public:
+        MalVector() = default;
+        // The copy shares the trie, but not the metadata, the list and the hash
+        MalVector(const MalVector& other)
+            : count{other.count}, shift{other.shift}, root{other.root}, tail{other.tail} {}
+
+        std::size_t GetSize() const {return count; }
+
+        // nil if out of range, like MalList::At
+        const MalValue& At(std::size_t idx) const {
+            if (idx >= count)
+                return mh::nil;
+            return Leaf(idx)[idx & VectorNode::MASK].v;
+        }
+
+        // Calls `func` with every value in order
+        template <typename F>
+        void ForEach(F&& func) const {
+            std::size_t tail_offset = TailOffset();
+            for (std::size_t i = 0; i < tail_offset; i += VectorNode::WIDTH) {
+                const MalAtom* values = Leaf(i);
+                for (std::size_t j = 0; j < VectorNode::WIDTH; ++j)
+                    func(values[j].v);
+            }
+            for (const MalAtom& v : tail)
+                func(v.v);
+        }
+
+        // A new vector with `val` appended
+        Ref<MalVector> Conj(MalValue&& val) const;
+        // A new vector with the value at `idx` replaced, requires idx < GetSize()
+        Ref<MalVector> Assoc(std::size_t idx, MalValue&& val) const;
+
+        // The values as a list, for the code that walks sequences by their nodes (`rest`, `apply`, binding forms)
+        // Made once and kept with the vector, so repeated traversals don't copy it again
+        const Ref<MalList>& List() const;
+    };
+
+    // Utility used to create vectors, appends in place while the builder holds the only reference
+    class VectorBuilder {
+        Ref<MalVector> vector;
+    public:
+        void push(MalValue&& val) {
+            if (vector == nullptr)
+                vector = MakeRef<MalVector>();
+            vector->Append(std::move(val));
+        }
+
+        Ref<MalVector> release() {
+            return std::move(vector);
+        }
+    };
+}
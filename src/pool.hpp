@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+
+namespace mal {
+    // Storage of the small runtime objects (list nodes, strings, maps, atoms, functions, frames)
+    // Blocks are carved consecutively from large chunks, so objects allocated together are adjacent in memory,
+    // freed blocks are kept in a free list of their size class and reused in O(1). Chunks are never returned to the system
+    class SlabHeap {
+        struct Block {
+            Block* next;
+        };
+
+        static constexpr std::size_t GRANULARITY = 16;
+        static constexpr std::size_t CHUNK_SIZE = 64 << 10;
+
+        Block* free[256 / GRANULARITY] = {};
+        char* cursor = nullptr;
+        char* limit = nullptr;
+
+        // Constant initialized and trivially destructible: usable during the initialization and destruction of other statics
+        static SlabHeap& Get() {
+            static SlabHeap heap;
+            return heap;
+        }
+
+        static std::size_t Class(std::size_t size) {
+            return (size - 1) / GRANULARITY;
+        }
+
+        void* Carve(std::size_t size) {
+            if (static_cast<std::size_t>(limit - cursor) < size) {
+                cursor = static_cast<char*>(::operator new(CHUNK_SIZE));
+                limit = cursor + CHUNK_SIZE;
+            }
+            void* block = cursor;
+            cursor += size;
+            return block;
+        }
+    public:
+        static constexpr std::size_t MAX_SIZE = 256;
+
+        // `size` must be at most MAX_SIZE
+        static void* Allocate(std::size_t size) {
+            SlabHeap& heap = Get();
+            std::size_t c = Class(size);
+            if (Block* block = heap.free[c]) {
+                heap.free[c] = block->next;
+                return block;
+            }
+            return heap.Carve((c + 1) * GRANULARITY);
+        }
+
+        static void Deallocate(void* p, std::size_t size) {
+            SlabHeap& heap = Get();
+            std::size_t c = Class(size);
+            heap.free[c] = new (p) Block{heap.free[c]};
+        }
+    };
+
+    // Blocks of the runtime objects (see: ref.hpp), larger ones come from the global heap
+    inline void* AllocateBlock(std::size_t size) {
+#       if defined(__SANITIZE_ADDRESS__)
+        // Every object is allocated separately, so the sanitizer finds uses of freed objects
+        return ::operator new(size);
+#       else
+        if (size <= SlabHeap::MAX_SIZE)
+            return SlabHeap::Allocate(size);
+        return ::operator new(size);
+#       endif
+    }
+
+    inline void DeallocateBlock(void* p, std::size_t size) {
+#       if defined(__SANITIZE_ADDRESS__)
+        static_cast<void>(size);
+        ::operator delete(p);
+#       else
+        if (size <= SlabHeap::MAX_SIZE)
+            SlabHeap::Deallocate(p, size);
+        else
+            ::operator delete(p);
+#       endif
+    }
+}
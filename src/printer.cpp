@@ -1,148 +1,159 @@
 #include "printer.hpp"
 
-#include <sstream>
+#include <charconv>
 
 namespace mal {
     Printer& OstreamPrinter::operator<<(print_begin_t beg) { is_raw = beg.print_raw; return *this; }
     Printer& OstreamPrinter::operator<<(print_end_t) { stream << std::endl; return *this; }
     Printer& OstreamPrinter::operator<<(const std::string& str) { stream << str; return *this; }
-    
+
     Printer& OstreamPrinter::operator<<(const MalValue& value) {
+        StringBuilder builder{is_raw, colors};
+        builder.Append(value);
+        stream << builder.Get();
+        return *this;
+    }
+
+    void StringBuilder::AppendNumber(std::int64_t num) {
+        char digits[24];
+        auto end = std::to_chars(digits, digits + sizeof(digits), num).ptr;
+        out.append(digits, end);
+    }
+
+    void StringBuilder::Colored(const char* color, std::string_view str) {
+        if (colors)
+            out.append(color);
+        out.append(str);
+        if (colors)
+            out.append(TTYColors::reset);
+    }
+
+    void StringBuilder::Append(const MalValue& value) {
         switch (value.tag) {
             case Nil_T:
-                stream << "nil";
+                Colored(TTYColors::nil, "nil");
                 break;
             case True_T:
-                stream << "true";
+                Colored(TTYColors::boolean, "true");
                 break;
             case False_T:
-                stream << "false";
+                Colored(TTYColors::boolean, "false");
                 break;
             case Int_T:
-                stream << value.no;
+                if (colors)
+                    out.append(TTYColors::number);
+                AppendNumber(value.no);
+                if (colors)
+                    out.append(TTYColors::reset);
+                break;
+            case Bigint_T:
+                Colored(TTYColors::number, value.bi->ToString());
                 break;
             case Symbol_T:
-                stream << value.st->Get();
+                out.append(value.st->View());
                 break;
             case Keyword_T:
-                stream << ":" << value.st->Get();
+                if (colors)
+                    out.append(TTYColors::keyword);
+                out.push_back(':');
+                out.append(value.st->View());
+                if (colors)
+                    out.append(TTYColors::reset);
                 break;
             case String_T:
-                if (is_raw)
-                    stream << value.st->Get();
-                else
-                    stream << EscapeString(value.st->Get());
+                if (raw) {
+                    out.append(value.st->View());
+                } else {
+                    if (colors)
+                        out.append(TTYColors::string);
+                    AppendEscaped(out, value.st->View());
+                    if (colors)
+                        out.append(TTYColors::reset);
+                }
                 break;
             case List_T:
-            case Vector_T:
             {
-                stream << (value.tag == List_T ? '(' : '[');
+                out.push_back('(');
                 bool first = true;
-                for (const MalList* list = value.li.get(); list != nullptr; list = list->Rest().get()) {
-                    if (!first) {
-                        stream << ' ';
-                    }
+                for (const MalList* list = value.li.get(); list != nullptr; list = list->Next()) {
+                    if (!first)
+                        out.push_back(' ');
                     first = false;
-                    operator<<(list->First());
+                    Append(list->First());
                 }
-                stream << (value.tag == List_T ? ')' : ']');
+                out.push_back(')');
+                break;
+            }
+            case Vector_T:
+            {
+                out.push_back('[');
+                bool first = true;
+                if (value.ve != nullptr) {
+                    value.ve->ForEach([this, &first](const MalValue& v) {
+                        if (!first)
+                            out.push_back(' ');
+                        first = false;
+                        Append(v);
+                    });
+                }
+                out.push_back(']');
                 break;
             }
             case Map_T:
-            case MapSpec_T:
             {
-                auto map = mh::as_map(value);
-                stream << '{';
+                out.push_back('{');
                 bool first = true;
-                for (auto it = map->data.begin(); it != map->data.end(); ++it) {
+                value.mp->ForEach([this, &first](const MalValue& key, const MalValue& v) {
                     if (!first)
-                        stream << ' ';
+                        out.push_back(' ');
                     first = false;
-                    operator<<(it->first);
-                    stream << ' ';
-                    operator<<(it->second.v);
-                }
-                stream << '}';
+                    Append(key);
+                    out.push_back(' ');
+                    Append(v);
+                });
+                out.push_back('}');
                 break;
             }
             case Builtin_T:
-                stream << "<builtin-function>";
+                out.append("<builtin-function>");
                 break;
             case Function_T:
-                stream << "<function>";
+                out.append("<function>");
                 break;
             case Atom_T:
-                stream << "<atom ";
-                operator<<(value.at->v);
-                stream << '>';
+                out.append("<atom ");
+                Append(value.at->v);
+                out.push_back('>');
                 break;
             default:
-                stream << "<unknown>";
+                out.append("<unknown>");
         }
-        return *this;
     }
 
-    Printer& TTYPrinter::operator<<(const MalValue& value) {
-        if (is_raw)
-            return _Base::operator<<(value);
-        switch (value.tag) {
-            case Nil_T:
-                stream << TTYColors::nil << "nil" << TTYColors::reset;
-                break;
-            case True_T:
-                stream << TTYColors::boolean << "true" << TTYColors::reset;
-                break;
-            case False_T:
-                stream << TTYColors::boolean << "false" << TTYColors::reset;
-                break;
-            case Int_T:
-                stream << TTYColors::number << value.no << TTYColors::reset;
-                break;
-            case Keyword_T:
-                stream << TTYColors::keyword << ":" << value.st->Get() << TTYColors::reset;
-                break;
-            case String_T:
-                //if (is_raw)
-                //    stream << value.st->Get();
-                //else
-                    stream << TTYColors::string << EscapeString(value.st->Get()) << TTYColors::reset;
-                break;
-            case Symbol_T:
-            case List_T:
-            case Vector_T:
-            case Map_T:
-            case MapSpec_T:
-            case Builtin_T:
-            case Function_T:
-            case Atom_T:
-            default:
-                return _Base::operator<<(value);
+    // One pass over the string, the runs without special codes are appended at once
+    void AppendEscaped(std::string& out, std::string_view str) {
+        out.reserve(out.size() + str.size() + 2);
+        out.push_back('"');
+        std::size_t run = 0;
+        for (std::size_t i = 0; i < str.size(); ++i) {
+            const char* escape;
+            switch (str[i]) {
+                case '\\': escape = "\\\\"; break;
+                case '\n': escape = "\\n"; break;
+                case '"': escape = "\\\""; break;
+                default: continue;
+            }
+            out.append(str.data() + run, i - run);
+            out.append(escape);
+            run = i + 1;
         }
-        return *this;
+        out.append(str.data() + run, str.size() - run);
+        out.push_back('"');
     }
 
     std::string EscapeString(const std::string& str) {
         std::string res;
-        std::size_t i = 0;
-        while (i < str.length()) {
-            std::size_t next = str.find_first_of("\\\n\"", i);
-            if (next != i) {
-                if (next == str.npos)
-                    res += str.substr(i);
-                else
-                    res += str.substr(i, next-i);
-            }
-            i = next;
-            if (i != str.npos) {
-                char ch = str[i++];
-                if (ch == '\\')
-                    res += "\\\\";
-                else if (ch == '\n')
-                    res += "\\n";
-                else if (ch == '"')
-                    res += "\\\"";
-            }
-        }
-        return '"' + res + '"';
+        AppendEscaped(res, str);
+        return res;
     }
-}
\ No newline at end of file
+}
@@ -1,6 +1,9 @@
 #pragma once
 
+#include <cstdint>
 #include <iostream>
+#include <string>
+#include <string_view>
 
 #include "malvalue.hpp"
 
@@ -18,19 +21,47 @@ namespace mal {
         virtual Printer& operator<<(print_end_t) = 0;
         virtual Printer& operator<<(const MalValue& value) = 0;
         virtual Printer& operator<<(const std::string& str) = 0;
+
+        // Whether values are printed with TTY colors (see: StringBuilder)
+        virtual bool HasColors() const {return false; }
+    };
+
+    // Formats values into one string, without streams or virtual calls
+    // The printers and the printing builtins format through it, and write the result at once
+    class StringBuilder {
+        std::string out;
+        bool raw;
+        bool colors;
+    public:
+        // `raw` prints strings as they are rather than readably, `colors` adds TTY colors (not in raw mode)
+        explicit StringBuilder(bool raw, bool colors = false) : raw{raw}, colors{colors && !raw} {}
+
+        void Reserve(std::size_t size) {out.reserve(size); }
+
+        void Append(std::string_view str) {out.append(str); }
+        void Append(char ch) {out.push_back(ch); }
+        void Append(const MalValue& value);
+
+        std::string& Get() {return out; }
+    private:
+        void AppendNumber(std::int64_t num);
+        void Colored(const char* color, std::string_view str);
     };
 
     class OstreamPrinter : public Printer {
     protected:
         std::ostream& stream;
-        bool is_raw;
+        bool is_raw = false;
+        bool colors;
     public:
-        OstreamPrinter(std::ostream& stream) : stream{stream} {}
+        OstreamPrinter(std::ostream& stream, bool colors = false) : stream{stream}, colors{colors} {}
 
         virtual Printer& operator<<(print_begin_t);
         virtual Printer& operator<<(print_end_t);
         virtual Printer& operator<<(const MalValue& value);
         virtual Printer& operator<<(const std::string& str);
+
+        virtual bool HasColors() const {return colors; }
     };
 
     namespace TTYColors {
@@ -43,16 +74,15 @@ namespace mal {
         constexpr str string = "\e[92m";
     };
 
+    // Prints the scalars in colors, except in raw mode
     class TTYPrinter : public OstreamPrinter {
-    protected:
-        using _Base = OstreamPrinter;
     public:
-        using OstreamPrinter::OstreamPrinter;
-        using OstreamPrinter::operator<<;
-
-        virtual Printer& operator<<(const MalValue& value) override;
+        TTYPrinter(std::ostream& stream) : OstreamPrinter{stream, true} {}
     };
 
+    // Appends `str` escaped, with special codes as escape sequences and with prefix/affix '"'
+    void AppendEscaped(std::string& out, std::string_view str);
+
     // Escape a string to represent special codes as escape sequences and with prefix/affix '"'
     std::string EscapeString(const std::string& str);
-}
\ No newline at end of file
+}
@@ -25,21 +25,14 @@ namespace mal {
         tokens.emplace_back(toktype::number, std::string{src, start, i-start});
     }
 
-    int _ParseInt(const std::string& token) {
-        bool neg = token[0] == '-';
-        std::size_t it = (token[0] == '-' || token[0] == '+') ? 1 : 0;
-        int v = 0;
-        while (it < token.size()) {
-            if (token[it] == '_') {
-                ++it;
-                continue;
-            }
-            int d = token[it++] - '0';
-            v = v * 10 + d;
+    // Numbers that don't fit in 64 bits are read as bignums
+    MalValue _ParseInt(const std::string& token) {
+        std::string digits;
+        for (char c : token) {
+            if (c != '_')
+                digits += c;
         }
-        if (neg)
-            v = -v;
-        return v;
+        return ParseNumber(digits);
     }
 
     bool _CheckNumber(char c1, char c2) {
@@ -140,7 +133,10 @@ namespace mal {
             } else if (tok.val == ")") {
                 throw mal_error{"Unexpected character while parsing: ')'"};
             } else if (tok.val == "[") {
-                return mh::vector(ReadList(token{toktype::special, "]"}));
+                VectorBuilder vector;
+                for (ListIterator it = ReadList(token{toktype::special, "]"}); it; ++it)
+                    vector.push(MalValue{*it});
+                return mh::vector(vector.release());
             } else if (tok.val == "]") {
                 throw mal_error{"Unexpected character while parsing: ']'"};
             } else if (tok.val == "{") {
@@ -166,7 +162,7 @@ namespace mal {
                 if (mh::is_flist(meta.v) && mh::is_symbol(meta->li->First()) && ("hash-map" == meta->li->First().st->Get())) {
                     if (!(meta->li->GetSize() & 1))
                         throw mal_error{"hash-map takes even number of arguments"};
-                    auto mmeta = meta->meta;
+                    MalValue mmeta = meta->Meta();
                     auto map = MalMap::Make();
                     for (ListIterator it = meta->li->Rest(); it;) {
                         const auto& key = *it;
@@ -176,10 +172,14 @@ namespace mal {
                         map->Set(key, value);
                     }
                     meta = mh::hash_map(map);
-                    meta.v.meta = std::move(mmeta);
+                    if (!mh::is_nil(mmeta))
+                        meta->SetMeta(mmeta);
                 }
-                auto val = ReadForm();
-                val.SetMeta(meta.v);
+                auto form = ReadForm();
+                // Interned names are shared, the metadata goes to a copy
+                auto val = mh::is_symbol(form) || mh::is_keyword(form) ? MalValue{MalString::Copy(form.st), form.tag} : std::move(form);
+                if (!val.SetMeta(meta.v))
+                    throw mal_error{"Only sequences, hash-maps, strings and functions can have metadata"};
                 return val;
             } else {
                 throw mal_error{"Undefined token: " + tok.val};
@@ -189,7 +189,7 @@ namespace mal {
         }
     }
 
-    std::shared_ptr<MalList> Reader::ReadList(const token& endtok) {
+    Ref<MalList> Reader::ReadList(const token& endtok) {
         ListBuilder list;
         while (true) {
             const token& tok = Peek();
@@ -213,11 +213,11 @@ namespace mal {
                 else if (token.val == "false")
                     return mh::mal_false;
                 else
-                    return mh::symbol(mh::maybe_intern(mh::copy(token.val), str_interner));
+                    return mh::symbol(token.val);
             case toktype::number:
-                return mh::num(_ParseInt(token.val));
+                return _ParseInt(token.val);
             case toktype::keyword:
-                return mh::keyword(mh::maybe_intern(mh::copy(token.val), str_interner));
+                return mh::keyword(token.val);
             case toktype::string:
                 return mh::string(mh::maybe_intern(mh::copy(token.val), str_interner));
             default:
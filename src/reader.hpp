@@ -31,7 +31,7 @@ namespace mal {
         std::vector<token> tokens;
         std::size_t idx = 0;
 
-        std::shared_ptr<MalList> ReadList(const token& endtok);
+        Ref<MalList> ReadList(const token& endtok);
         MalValue ReadSingle(const token& token);
     public:
         Reader(std::vector<token>&& tokens, StringInternPool* str_interner = nullptr) : str_interner{str_interner}, tokens{tokens} {}
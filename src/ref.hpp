@@ -0,0 +1,189 @@
+#pragma once
+
+#include "pool.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <utility>
+
+namespace mal {
+    // Reference counts of a runtime object, stored in the block of the object right before it
+    // The interpreter runs on one thread, so the counts are plain integers rather than atomics
+    struct alignas(8) RefCounts {
+        std::uint32_t strong = 1;
+        std::uint32_t weak = 0;
+    };
+
+    template <typename T>
+    class Weak;
+
+    // An owning reference to a runtime object, allocated by MakeRef
+    // When the last reference is released, the object is passed to `Free(T*)`, found by argument-dependent lookup:
+    // the runtime types declare it next to their forward declarations (see: malvalue.hpp), so references can be
+    // copied and released where the type is incomplete. `Free` usually calls Ref<T>::Destroy
+    //
+    // Copies cost an increment and a decrement; code that only reads an object should borrow it instead,
+    // through a `const Ref<T>&` or a raw pointer (see: MalList::Next)
+    template <typename T>
+    class Ref {
+        T* ptr = nullptr;
+
+        friend class Weak<T>;
+
+        static RefCounts& Counts(T* p) {
+            return reinterpret_cast<RefCounts*>(p)[-1];
+        }
+
+        static void* Block(T* p) {
+            return &Counts(p);
+        }
+
+        static constexpr std::size_t BLOCK_SIZE = sizeof(RefCounts) + sizeof(T);
+
+        explicit Ref(T* p) : ptr{p} {}
+
+        void Retain() const {
+            if (ptr)
+                ++Counts(ptr).strong;
+        }
+
+        static void Release(T* p) {
+            if (p && --Counts(p).strong == 0)
+                Free(p);
+        }
+
+        // Frees the block once the object is destroyed and no weak reference is left
+        static void ReleaseWeak(T* p) {
+            RefCounts& counts = Counts(p);
+            if (--counts.weak == 0 && counts.strong == 0) {
+                counts.~RefCounts();
+                DeallocateBlock(Block(p), BLOCK_SIZE);
+            }
+        }
+    public:
+        constexpr Ref() = default;
+        constexpr Ref(std::nullptr_t) {}
+
+        Ref(const Ref& other) : ptr{other.ptr} {
+            Retain();
+        }
+
+        Ref(Ref&& other) noexcept : ptr{std::exchange(other.ptr, nullptr)} {}
+
+        ~Ref() {
+            Release(ptr);
+        }
+
+        Ref& operator=(const Ref& other) {
+            other.Retain();
+            Release(std::exchange(ptr, other.ptr));
+            return *this;
+        }
+
+        // The old object is released last, `other` may be owned by it
+        Ref& operator=(Ref&& other) noexcept {
+            Release(std::exchange(ptr, std::exchange(other.ptr, nullptr)));
+            return *this;
+        }
+
+        T* get() const { return ptr; }
+        T* operator->() const { return ptr; }
+        T& operator*() const { return *ptr; }
+        explicit operator bool() const { return ptr != nullptr; }
+
+        void reset() {
+            Release(std::exchange(ptr, nullptr));
+        }
+
+        long use_count() const {
+            return ptr ? Counts(ptr).strong : 0;
+        }
+
+        friend bool operator==(const Ref& a, const Ref& b) { return a.ptr == b.ptr; }
+        friend bool operator!=(const Ref& a, const Ref& b) { return a.ptr != b.ptr; }
+        friend constexpr bool operator==(const Ref& a, std::nullptr_t) { return a.ptr == nullptr; }
+        friend constexpr bool operator!=(const Ref& a, std::nullptr_t) { return a.ptr != nullptr; }
+
+        template <typename... A>
+        static Ref Make(A&&... args) {
+            static_assert(alignof(T) <= alignof(RefCounts), "The object must follow its counts without padding");
+            void* block = AllocateBlock(BLOCK_SIZE);
+            auto* counts = new (block) RefCounts{};
+            try {
+                return Ref{new (counts + 1) T(std::forward<A>(args)...)};
+            } catch (...) {
+                DeallocateBlock(block, BLOCK_SIZE);
+                throw;
+            }
+        }
+
+        // Destroys an object whose last reference was released, the block stays while weak references refer to it
+        static void Destroy(T* p) {
+            ++Counts(p).weak;
+            p->~T();
+            ReleaseWeak(p);
+        }
+
+        // Takes an object whose references were all released, but which wasn't destroyed (see: FramePool)
+        // Requires that no weak reference refers to it
+        static Ref Revive(T* p) {
+            Counts(p).strong = 1;
+            return Ref{p};
+        }
+
+        static std::uint32_t WeakCount(T* p) {
+            return Counts(p).weak;
+        }
+    };
+
+    template <typename T, typename... A>
+    Ref<T> MakeRef(A&&... args) {
+        return Ref<T>::Make(std::forward<A>(args)...);
+    }
+
+    // A reference that doesn't keep its object alive, only the block; expired once the object is destroyed
+    template <typename T>
+    class Weak {
+        T* ptr = nullptr;
+
+        void Retain() const {
+            if (ptr)
+                ++Ref<T>::Counts(ptr).weak;
+        }
+    public:
+        Weak() = default;
+
+        Weak(const Ref<T>& ref) : ptr{ref.ptr} {
+            Retain();
+        }
+
+        Weak(const Weak& other) : ptr{other.ptr} {
+            Retain();
+        }
+
+        Weak(Weak&& other) noexcept : ptr{std::exchange(other.ptr, nullptr)} {}
+
+        ~Weak() {
+            if (ptr)
+                Ref<T>::ReleaseWeak(ptr);
+        }
+
+        Weak& operator=(Weak other) noexcept {
+            std::swap(ptr, other.ptr);
+            return *this;
+        }
+
+        bool expired() const {
+            return ptr == nullptr || Ref<T>::Counts(ptr).strong == 0;
+        }
+
+        Ref<T> lock() const {
+            if (expired())
+                return nullptr;
+            Ref<T> ref{ptr};
+            ref.Retain();
+            return ref;
+        }
+    };
+}
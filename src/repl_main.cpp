@@ -1,9 +1,9 @@
+#include <fstream>
 #include <iostream>
 #include "reader.hpp"
 #include "printer.hpp"
 #include "interpreter.hpp"
-
-std::size_t mal::RefCounter::total_refs = 0;
+#include "aot.hpp"
 
 typedef mal::MalValue repl_expr;
 typedef std::string repl_src;
@@ -31,16 +31,54 @@ inline void rep(const repl_src& src, mal::Interpreter& interp) {
         print(v);
 }
 
+inline std::string read_file(const std::string& name) {
+    std::ifstream file{name};
+    if (!file.good())
+        throw mal::mal_error{"Could not open file " + name};
+    return std::string(std::istreambuf_iterator<char>{file}, std::istreambuf_iterator<char>{});
+}
+
 inline mal::MalValue re(const repl_src& src, mal::Interpreter& interp) {
     return eval(read(src, &interp.str_interner), interp);
 }
 
 int main(int argc, char** argv) {
     mal::Interpreter interp{printer};
+    // Compiles the script to C++ instead of running it
+    std::string emit_cpp;
     {
+        // Parse interpreter options (placed before the script name)
+        int arg_i = 1;
+        for (; arg_i < argc; ++arg_i) {
+            std::string opt = argv[arg_i];
+            if (opt.compare(0, 2, "--") != 0)
+                break;
+            if (opt == "--engine=tree")
+                interp.engine = mal::Interpreter::Engine::Tree;
+            else if (opt == "--engine=vm")
+                interp.engine = mal::Interpreter::Engine::VM;
+            else if (opt == "--pre-expand")
+                interp.pre_expand = true;
+            else if (opt.compare(0, 14, "--stack-limit=") == 0 && opt.size() > 14 && opt.find_first_not_of("0123456789", 14) == std::string::npos)
+                interp.stack_limit = std::stoul(opt.substr(14));
+            else if (opt.compare(0, 10, "--tier-up=") == 0 && opt.size() > 10 && opt.find_first_not_of("0123456789", 10) == std::string::npos)
+                interp.tier_threshold = std::stoul(opt.substr(10));
+            else if (opt.compare(0, 11, "--emit-cpp=") == 0 && opt.size() > 11)
+                emit_cpp = opt.substr(11);
+            else {
+                std::cerr << "Unknown option: " << opt << std::endl;
+                return 1;
+            }
+        }
+        if (!emit_cpp.empty() && arg_i + 1 != argc) {
+            std::cerr << "--emit-cpp takes a single script" << std::endl;
+            return 1;
+        }
         // Parse arguments into *ARGV*
         mal::ListBuilder arg_lb;
-        for (int arg_i = 0; arg_i < argc; ++arg_i) {
+        arg_lb.push(mh::string(argv[0]));
+        // The script to compile is not run by bootstrap.mal
+        for (; arg_i < argc && emit_cpp.empty(); ++arg_i) {
             char* arg_s = argv[arg_i];
             arg_lb.push(mh::string(arg_s));
         }
@@ -50,6 +88,15 @@ int main(int argc, char** argv) {
         re("(def load-file (fn (fName) (eval (read-string (str \"(do \" (slurp fName) \")\")))))", interp);
         if (!mh::is_true(re("(load-file \"bootstrap.mal\")", interp)))
             return 0;
+        if (!emit_cpp.empty()) {
+            std::string script_name = argv[argc - 1];
+            std::string script = read_file(script_name);
+            std::ofstream out{emit_cpp};
+            mal::EmitProgram(interp, read_file("bootstrap.mal"), script_name, script, out);
+            if (!out.good())
+                throw mal::mal_error{"Could not write file " + emit_cpp};
+            return 0;
+        }
     } catch (const mal::mal_error& err) {
         printer << mal::print_begin << "Script Mal Error: " << err.msg << mal::print_end;
         return 1;
@@ -0,0 +1,234 @@
+#include "interpreter.hpp"
+#include "bytecode.hpp"
+
+namespace {
+    using namespace mal;
+
+    // Activation record of a compiled function
+    struct Frame {
+        std::shared_ptr<const Code> code;
+        std::size_t pc;
+        EnvironFrame env;
+        std::size_t base; // Stack size at the entry to the frame
+    };
+
+    inline MalValue Pop(std::vector<MalValue>& stack) {
+        MalValue v = std::move(stack.back());
+        stack.pop_back();
+        return v;
+    }
+
+    inline void Truncate(std::vector<MalValue>& stack, std::size_t size) {
+        while (stack.size() > size)
+            stack.pop_back();
+    }
+
+    // Moves top `count` values of the stack into an argument list
+    inline MalArgs PopArgs(std::vector<MalValue>& stack, std::size_t count) {
+        MalArgs args;
+        args.reserve(count);
+        for (std::size_t i = stack.size() - count; i < stack.size(); ++i)
+            args.push_back(std::move(stack[i]));
+        Truncate(stack, stack.size() - count);
+        return args;
+    }
+}
+
+namespace mal {
+    MalValue Interpreter::RunCompiled(const MalFunction& func, MalArgs&& args) {
+        return RunCode(func.code, PrepareFunctionCall(func, std::move(args)), {});
+    }
+
+    MalValue Interpreter::RunCode(std::shared_ptr<const Code> code, EnvironFrame env, std::vector<MalValue>&& stack) {
+        RecursionGuard<MAX_RECURSION_DEPTH> rg{recursion_depth};
+        std::vector<Frame> frames;
+        frames.push_back(Frame{std::move(code), 0, std::move(env), 0});
+
+        Frame* fr = &frames.back();
+        const std::uint32_t* ops = fr->code->ops.data();
+        while (true) {
+            switch (static_cast<Op>(ops[fr->pc++])) {
+                case Op::Const:
+                    stack.push_back(fr->code->consts[ops[fr->pc++]]);
+                    break;
+                case Op::LoadName:
+                    stack.push_back(fr->env->lookup(fr->code->names[ops[fr->pc++]]));
+                    break;
+                case Op::LoadLocal:
+                    stack.push_back(fr->env->at(ops[fr->pc], ops[fr->pc + 1]).v);
+                    fr->pc += 2;
+                    break;
+                case Op::LoadGlobal:
+                    stack.push_back(fr->code->cells[ops[fr->pc++]]->get());
+                    break;
+                case Op::Def:
+                    fr->env->set(fr->code->names[ops[fr->pc++]], stack.back());
+                    break;
+                case Op::Pop:
+                    stack.pop_back();
+                    break;
+                case Op::Jump:
+                    fr->pc = ops[fr->pc];
+                    break;
+                case Op::JumpIfFalse: {
+                    MalValue test = Pop(stack);
+                    if (test.tag == Nil_T || test.tag == False_T)
+                        fr->pc = ops[fr->pc];
+                    else
+                        ++fr->pc;
+                    break;
+                }
+                case Op::MacroCheck: {
+                    const MalValue& callee = stack.back();
+                    if (callee.tag == Function_T && callee.fun->kind == MalFunction::KMacro) {
+                        auto macro = Pop(stack).fun;
+                        const MalValue& form = fr->code->consts[ops[fr->pc]];
+                        MalValue expansion = ExpandMacro(form, macro);
+                        stack.push_back(EvaluateExpression(expansion, fr->env));
+                        fr->pc = ops[fr->pc + 1];
+                    } else
+                        fr->pc += 2;
+                    break;
+                }
+                case Op::Expanded: {
+                    MalValue callee = Pop(stack);
+                    const MalValue& macro = fr->code->consts[ops[fr->pc + 1]];
+                    if (callee.tag == Function_T && callee.fun == macro.fun) {
+                        fr->pc += 3;
+                        break;
+                    }
+                    stack.push_back(EvaluateExpression(fr->code->consts[ops[fr->pc]], fr->env));
+                    fr->pc = ops[fr->pc + 2];
+                    break;
+                }
+                case Op::CallInt: {
+                    std::size_t top = stack.size();
+                    const MalValue& a = stack[top - 2];
+                    const MalValue& b = stack[top - 1];
+                    const MalValue& callee = stack[top - 3];
+                    if (callee.tag != Builtin_T || callee.blt != fr->code->consts[ops[fr->pc]].blt || a.tag != Int_T || b.tag != Int_T) {
+                        // Left to the Call
+                        fr->pc += 2;
+                        break;
+                    }
+                    MalValue ret = IntOperation(static_cast<IntOp>(ops[fr->pc + 1]), a.no, b.no);
+                    if (ret.tag == Nil_T) {
+                        fr->pc += 2;
+                        break;
+                    }
+                    Truncate(stack, top - 3);
+                    stack.push_back(std::move(ret));
+                    fr->pc += 4;
+                    break;
+                }
+                case Op::Call:
+                case Op::TailCall: {
+                    bool tail = static_cast<Op>(ops[fr->pc - 1]) == Op::TailCall;
+                    std::size_t argc = ops[fr->pc++];
+                    const MalValue& head = stack[stack.size() - argc - 1];
+                    if (head.tag == Builtin_T && head.blt->direct != nullptr && head.blt->arity == argc) {
+                        // The arguments are passed in place
+                        MalValue ret = head.blt->direct(*this, stack.data() + stack.size() - argc);
+                        Truncate(stack, stack.size() - argc - 1);
+                        stack.push_back(std::move(ret));
+                        break;
+                    }
+                    MalArgs call_args = PopArgs(stack, argc);
+                    MalValue callee = Pop(stack);
+                    if (!mh::is_invokable(callee))
+                        throw mal_error{"Cannot call non-function"};
+                    if (callee.tag == Builtin_T) {
+                        stack.push_back(callee.blt->call(*this, std::move(call_args)));
+                        break;
+                    }
+                    MalFunction& fun = *callee.fun;
+                    // Functions called from compiled code are compiled right away, so the calls don't reenter the tree-walker
+                    if (!fun.code && tier_threshold != 0 && fun.kind == MalFunction::KFunc)
+                        fun.code = CompileFunction(*this, fun);
+                    if (!fun.code) {
+                        stack.push_back(EvalFunction(fun, std::move(call_args)));
+                        break;
+                    }
+                    EnvironFrame env = PrepareFunctionCall(fun, std::move(call_args));
+                    if (tail) {
+                        fr->code = fun.code;
+                        fr->pc = 0;
+                        fr->env = std::move(env);
+                    } else {
+                        if (frames.size() >= stack_limit)
+                            throw mal_error{"Stack limit reached"};
+                        frames.push_back(Frame{fun.code, 0, std::move(env), stack.size()});
+                        fr = &frames.back();
+                    }
+                    ops = fr->code->ops.data();
+                    break;
+                }
+                case Op::Return: {
+                    MalValue ret = Pop(stack);
+                    Truncate(stack, fr->base);
+                    frames.pop_back();
+                    if (frames.empty())
+                        return ret;
+                    stack.push_back(std::move(ret));
+                    fr = &frames.back();
+                    ops = fr->code->ops.data();
+                    break;
+                }
+                case Op::Closure: {
+                    const Prototype& proto = *fr->code->protos[ops[fr->pc++]];
+                    auto fun = MalFunction::Make(mh::copy(proto.params), proto.param_var, fr->env, proto.body, proto.kind, proto.code->params);
+                    fun->code = proto.code;
+                    collector.Track(fun);
+                    stack.push_back(std::move(fun));
+                    break;
+                }
+                case Op::EnterScope:
+                    fr->env = FramePool::Make(fr->env, fr->code->scopes[ops[fr->pc++]]);
+                    break;
+                case Op::LeaveScope:
+                    fr->env = mh::copy(fr->env->outer);
+                    break;
+                case Op::Bind:
+                    fr->env->slots.emplace_back(Pop(stack));
+                    break;
+                case Op::Rebind: {
+                    std::size_t count = ops[fr->pc];
+                    if (count != ops[fr->pc + 1])
+                        throw mal_error{"Recur arguments count doesn't match loop's binding count"};
+                    fr->pc += 2;
+                    RebindLoop(fr->env, stack.data() + stack.size() - count, count);
+                    Truncate(stack, stack.size() - count);
+                    break;
+                }
+                case Op::Times: {
+                    const MalValue& count = stack.back();
+                    if (count.tag != Int_T)
+                        throw mal_error{"Dotimes takes a number as the count"};
+                    if (fr->env->slots[0]->no >= count.no)
+                        fr->pc = ops[fr->pc];
+                    else
+                        ++fr->pc;
+                    break;
+                }
+                case Op::Step: {
+                    MalValue next = mh::num(fr->env->slots[0]->no + 1);
+                    RebindLoop(fr->env, &next, 1);
+                    fr->pc = ops[fr->pc];
+                    break;
+                }
+                case Op::MakeVector: {
+                    std::size_t count = ops[fr->pc++];
+                    VectorBuilder vb;
+                    for (std::size_t i = stack.size() - count; i < stack.size(); ++i)
+                        vb.push(std::move(stack[i]));
+                    Truncate(stack, stack.size() - count);
+                    stack.push_back(mh::vector(vb.release()));
+                    break;
+                }
+                case Op::EvalTree:
+                    stack.push_back(EvaluateExpression(fr->code->consts[ops[fr->pc++]], fr->env));
+                    break;
+            }
+        }
+    }
+}